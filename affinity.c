@@ -0,0 +1,60 @@
+// Authors:
+// Jack Zhang (jzhan237)
+// Tony Pan (jpan26)
+//
+// CPU affinity for the server's event loop threads, and the peer
+// credentials of AF_UNIX connections. Kept apart from the rest of the
+// server because the affinity calls and struct ucred need _GNU_SOURCE,
+// under which glibc's gai_error clashes with the one in csapp.h.
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include "server.h"
+
+int parse_cpu_list(const char *list, int *cpus, int max) {
+  int n = 0;
+  const char *p = list;
+  while (*p != '\0') {
+    char *end;
+    long first = strtol(p, &end, 10), last = first;
+    if (end == p || first < 0) return -1;
+    p = end;
+    if (*p == '-') {
+      last = strtol(p + 1, &end, 10);
+      if (end == p + 1 || last < first) return -1;
+      p = end;
+    }
+    for (long cpu = first; cpu <= last; cpu++) {
+      if (n == max) return -1;
+      cpus[n++] = cpu;
+    }
+    if (*p == ',') {
+      p++;
+    } else if (*p != '\0') {
+      return -1;
+    }
+  }
+  return n;
+}
+
+int pin_thread(int cpu) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return sched_setaffinity(0, sizeof(set), &set); // 0: the calling thread
+}
+
+int peer_uid(int fd, uid_t *uid) {
+  int domain;
+  socklen_t len = sizeof(domain);
+  if (getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &len) < 0 ||
+      domain != AF_UNIX) {
+    return -1;
+  }
+  struct ucred cred;
+  len = sizeof(cred);
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) return -1;
+  *uid = cred.uid;
+  return 0;
+}
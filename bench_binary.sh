@@ -0,0 +1,35 @@
+#! /bin/bash
+
+# Replies per second of calcServer over the text protocol and over the
+# binary one (calcLoad -B), with 16 connections at several pipeline
+# depths, in the epoll mode (or the one given with -m).
+
+if [ $# -lt 1 ]; then
+	echo "Usage: bench_binary.sh [-m mode] <port> [depths...]"
+	exit 1
+fi
+
+mode=epoll
+if [ "$1" = "-m" ]; then
+	mode="$2"
+	shift 2
+fi
+port="$1"
+shift
+depths="${@:-1 16 128 1024}"
+
+for depth in $depths; do
+	for protocol in text binary; do
+		flag=""
+		[ $protocol = binary ] && flag="-B"
+		./calcServer -m $mode $port &
+		CALC_PID=$!
+		sleep 1
+		echo "depth $depth $protocol:" \
+			$(./calcLoad $flag -c 16 -P $depth -d 5 localhost $port |
+			awk '{ for (i = 1; i < NF; i++) if ($i == "replies/s") print $i, $(i + 1) }')
+		kill -9 $CALC_PID
+		wait $CALC_PID 2> /dev/null
+		port=$((port + 1))
+	done
+done
@@ -0,0 +1,34 @@
+#! /bin/bash
+
+# Replies per second and round trip latency of calcServer through the
+# client library (calc_client.h, calcClientBench), with 16 threads each
+# on a pooled connection of its own at several pipeline depths, and
+# once more calling the synchronous calc_client_eval, in the epoll mode
+# (or the one given with -m).
+
+if [ $# -lt 1 ]; then
+	echo "Usage: bench_client.sh [-m mode] <port> [depths...]"
+	exit 1
+fi
+
+mode=epoll
+if [ "$1" = "-m" ]; then
+	mode="$2"
+	shift 2
+fi
+port="$1"
+shift
+depths="${@:-1 16 128 1024}"
+
+./calcServer -m $mode $port &
+CALC_PID=$!
+sleep 1
+for depth in $depths sync; do
+	flags="-P $depth"
+	[ $depth = sync ] && flags="-S"
+	echo "depth $depth:" \
+		$(./calcClientBench -c 16 $flags -d 5 localhost $port |
+		awk '{ for (i = 1; i < NF; i++) if ($i ~ /^(replies\/s|errors|p50|p99)$/) print $i, $(i + 1) }')
+done
+kill -9 $CALC_PID
+wait $CALC_PID 2> /dev/null
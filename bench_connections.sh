@@ -0,0 +1,24 @@
+#! /bin/bash
+
+# Rate of short-lived connections (connect, "k", "quit") that calcServer
+# handles in each server mode, with 32 clients at a time (calcLoad -s).
+
+if [ $# -lt 1 ]; then
+	echo "Usage: bench_connections.sh <port> [server modes...]"
+	exit 1
+fi
+
+port="$1"
+shift
+modes="${@:-threads epoll pool}"
+
+for mode in $modes; do
+	./calcServer -m $mode $port &
+	CALC_PID=$!
+	sleep 1
+	echo -n "$mode: "
+	./calcLoad -s -c 32 -d 5 localhost $port
+	kill -9 $CALC_PID
+	wait $CALC_PID 2> /dev/null
+	port=$((port + 1))
+done
@@ -0,0 +1,41 @@
+#! /bin/bash
+
+# Latency of a light client next to two saturating ones: two calcLoad
+# processes each keep 8192 "k = k + 1" lines in flight on one
+# connection, while a third sends one line at a time and reports its
+# round trips. Compares this calcServer with another binary if given
+# (e.g. one built before connections were serviced in quanta).
+
+if [ $# -lt 1 ]; then
+	echo "Usage: bench_fairness.sh [-m mode] <port> [other calcServer]"
+	exit 1
+fi
+
+mode=epoll
+if [ "$1" = "-m" ]; then
+	mode="$2"
+	shift 2
+fi
+port="$1"
+servers="./calcServer $2"
+
+for server in $servers; do
+	$server -m $mode $port &
+	CALC_PID=$!
+	sleep 1
+	./calcLoad -c 1 -P 8192 -d 7 localhost $port > /tmp/heavy1.$$ &
+	HEAVY1=$!
+	./calcLoad -c 1 -P 8192 -d 7 localhost $port > /tmp/heavy2.$$ &
+	HEAVY2=$!
+	sleep 1
+	echo "$server light:" \
+		$(./calcLoad -c 1 -d 5 localhost $port |
+		awk '{ for (i = 1; i < NF; i++) if ($i ~ /^(replies\/s|p50|p99)$/) print $i, $(i + 1) }')
+	wait $HEAVY1 $HEAVY2
+	echo "$server heavy:" $(cat /tmp/heavy1.$$ /tmp/heavy2.$$ |
+		awk '{ for (i = 1; i < NF; i++) if ($i == "replies/s") print $i, $(i + 1) }')
+	rm -f /tmp/heavy1.$$ /tmp/heavy2.$$
+	kill -9 $CALC_PID
+	wait $CALC_PID 2> /dev/null
+	port=$((port + 1))
+done
@@ -0,0 +1,39 @@
+#! /bin/bash
+
+# How calcServer's replies go out: replies/s and TCP segments per reply
+# (calcLoad reads them from TCP_INFO) with blocking I/O (threads) and
+# epoll, at several pipeline depths. Given another calcServer binary,
+# for instance one built from an earlier commit, it is measured too,
+# for comparison.
+
+if [ $# -lt 1 ]; then
+	echo "Usage: bench_output.sh <port> [other calcServer] [depths...]"
+	exit 1
+fi
+
+port="$1"
+shift
+servers="./calcServer"
+if [ $# -gt 0 ] && [ -x "$1" ]; then
+	servers="$1 $servers"
+	shift
+fi
+depths="${@:-1 16 128 1024}"
+
+for depth in $depths; do
+	for mode in threads epoll; do
+		for server in $servers; do
+			$server -m $mode $port &
+			CALC_PID=$!
+			sleep 1
+			echo "depth $depth $mode ($server):" \
+				$(./calcLoad -c 16 -P $depth -d 5 localhost $port |
+				awk '{ for (i = 1; i < NF; i++)
+					if ($i == "replies/s" || $i == "segments/reply")
+						printf "%s %s  ", $i, $(i + 1) }')
+			kill -9 $CALC_PID
+			wait $CALC_PID 2> /dev/null
+			port=$((port + 1))
+		done
+	done
+done
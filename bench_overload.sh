@@ -0,0 +1,38 @@
+#! /bin/bash
+
+# Latency of the clients calcServer admits as the load offered grows to
+# 10 times its capacity: calcLoad opens 1, 2, 5 and 10 times capacity
+# connections, each keeping one "k = k + 1" outstanding. With the
+# connection limit (-C capacity) the excess is turned away with "Busy"
+# and the admitted clients' round trips stay as fast as at capacity;
+# without it every client is admitted and they all slow down.
+
+if [ $# -lt 1 ]; then
+	echo "Usage: bench_overload.sh [-m mode] <port> [capacity]"
+	exit 1
+fi
+
+mode=epoll
+if [ "$1" = "-m" ]; then
+	mode="$2"
+	shift 2
+fi
+port="$1"
+capacity="${2:-32}"
+
+for factor in 1 2 5 10; do
+	conns=$((capacity * factor))
+	for limit in capacity none; do
+		flag="-C $capacity"
+		[ $limit = none ] && flag=""
+		./calcServer -m $mode $flag $port &
+		CALC_PID=$!
+		sleep 1
+		echo "offered $conns limit $limit:" \
+			$(./calcLoad -c $conns -d 5 localhost $port |
+			awk '{ for (i = 1; i < NF; i++) if ($i ~ /^(replies\/s|rejected|p50|p99)$/) print $i, $(i + 1) }')
+		kill -9 $CALC_PID
+		wait $CALC_PID 2> /dev/null
+		port=$((port + 1))
+	done
+done
@@ -0,0 +1,26 @@
+#! /bin/bash
+
+# Lines per second that calcServer evaluates for a single client that
+# keeps 1000 lines in flight (calcLoad -c 1 -P 1000), in each server
+# mode.
+
+if [ $# -lt 1 ]; then
+	echo "Usage: bench_pipeline.sh <port> [server modes...]"
+	exit 1
+fi
+
+port="$1"
+shift
+modes="${@:-threads epoll pool uring}"
+
+for mode in $modes; do
+	./calcServer -m $mode $port &
+	CALC_PID=$!
+	sleep 1
+	echo -n "$mode: "
+	./calcLoad -c 1 -P 1000 -d 5 localhost $port |
+		awk '{ for (i = 1; i < NF; i++) if ($i == "replies/s") print "lines/s", $(i + 1) }'
+	kill -9 $CALC_PID
+	wait $CALC_PID 2> /dev/null
+	port=$((port + 1))
+done
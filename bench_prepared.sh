@@ -0,0 +1,35 @@
+#! /bin/bash
+
+# Replies per second of calcServer for "k = k + 1" sent as text and as
+# "EXEC <handle>" of the same statement prepared once per connection
+# (calcLoad -X), with 16 connections at several pipeline depths.
+
+if [ $# -lt 1 ]; then
+	echo "Usage: bench_prepared.sh [-m mode] <port> [depths...]"
+	exit 1
+fi
+
+mode=epoll
+if [ "$1" = "-m" ]; then
+	mode="$2"
+	shift 2
+fi
+port="$1"
+shift
+depths="${@:-1 16 128 1024}"
+
+for depth in $depths; do
+	for how in text EXEC; do
+		flag=""
+		[ $how = EXEC ] && flag="-X"
+		./calcServer -m $mode $port &
+		CALC_PID=$!
+		sleep 1
+		echo "depth $depth $how:" \
+			$(./calcLoad $flag -c 16 -P $depth -d 5 -e "k = k + 1" localhost $port |
+			awk '{ for (i = 1; i < NF; i++) if ($i == "replies/s" || $i == "errors") print $i, $(i + 1) }')
+		kill -9 $CALC_PID
+		wait $CALC_PID 2> /dev/null
+		port=$((port + 1))
+	done
+done
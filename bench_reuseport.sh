@@ -0,0 +1,41 @@
+#! /bin/bash
+
+# Scaling of calcServer -m reuseport from 1 to N reactors (default: the
+# number of CPUs), reactor i pinned to CPU i. For each count, as many
+# calcLoad processes run at once as there are reactors: first with
+# short-lived connections (accepts/s), then with 100 persistent
+# connections each (requests/s). Rates are summed over the processes.
+
+if [ $# -lt 1 ]; then
+	echo "Usage: bench_reuseport.sh <port> [max reactors]"
+	exit 1
+fi
+
+port="$1"
+max="${2:-$(nproc)}"
+
+# run_loads <n> <calcLoad options...>: total of the rate that follows $field
+run_loads() {
+	n="$1"
+	shift
+	for i in $(seq 1 $n); do
+		./calcLoad "$@" localhost $port &
+	done | awk -v field="$field" '
+		{ for (i = 1; i < NF; i++) if ($i == field) sum += $(i + 1) }
+		END { printf "%.0f", sum }'
+	wait
+}
+
+for n in $(seq 1 $max); do
+	./calcServer -m reuseport -n $n -c 0-$((n - 1)) $port &
+	CALC_PID=$!
+	sleep 1
+	field="connections/s"
+	accepts=$(run_loads $n -s -c 32 -d 5)
+	field="replies/s"
+	requests=$(run_loads $n -c 100 -d 5)
+	echo "reactors $n: accepts/s $accepts  requests/s $requests"
+	kill -9 $CALC_PID
+	wait $CALC_PID 2> /dev/null
+	port=$((port + 1))
+done
@@ -0,0 +1,29 @@
+#! /bin/bash
+
+# Throughput and memory of calcServer under many concurrent connections.
+# Each connection keeps one "k = k + 1" request outstanding (calcLoad).
+#
+# 10k or more connections need a high open file limit for both the
+# server and calcLoad, e.g. ulimit -n 200000 as root.
+
+if [ $# -lt 2 ]; then
+	echo "Usage: bench_server.sh <port> <server mode> [connection counts...]"
+	exit 1
+fi
+
+port="$1"
+mode="$2"
+shift 2
+counts="${@:-100 1000 10000 50000}"
+
+ulimit -n $(ulimit -Hn)
+
+for conns in $counts; do
+	./calcServer -m $mode $port &
+	CALC_PID=$!
+	sleep 1
+	./calcLoad -c $conns -d 5 -p $CALC_PID localhost $port
+	kill -9 $CALC_PID
+	wait $CALC_PID 2> /dev/null
+	port=$((port + 1))
+done
@@ -0,0 +1,30 @@
+#! /bin/bash
+
+# Round-trip latency of single requests to calcServer over its
+# shared-memory transport (-R), its AF_UNIX socket (-u) and loopback
+# TCP, all served by one server in the epoll mode (or the one given
+# with -m): calcPing sends "k = k + 1" and waits for the reply, over
+# and over, and reports requests/s, p50 and p99 for each.
+
+if [ $# -lt 1 ]; then
+	echo "Usage: bench_shm.sh [-m mode] <port> [requests]"
+	exit 1
+fi
+
+mode=epoll
+if [ "$1" = "-m" ]; then
+	mode="$2"
+	shift 2
+fi
+port="$1"
+requests="${2:-200000}"
+name=calcServer.$$
+path=/tmp/calcServer.$$.sock
+
+./calcServer -m $mode -R $name -u $path $port &
+CALC_PID=$!
+sleep 1
+./calcPing -n $requests -R $name -U $path localhost $port
+kill -9 $CALC_PID
+wait $CALC_PID 2> /dev/null
+rm -f $path /dev/shm/$name
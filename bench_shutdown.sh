@@ -0,0 +1,31 @@
+#! /bin/bash
+
+# CPU time of the threaded calcServer while it holds 0, 10 and 10000
+# idle connections, and how long it takes after a shutdown to close
+# them and exit (calcLoad -I), with a grace period of the given number
+# of seconds (calcServer -g). Given another calcServer binary, such as
+# one built from an earlier commit, it is measured too (without -g).
+
+if [ $# -lt 1 ]; then
+	echo "Usage: bench_shutdown.sh <port> [grace seconds] [other calcServer]"
+	exit 1
+fi
+
+port="$1"
+grace="${2:-0}"
+other="$3"
+
+for conns in 0 10 10000; do
+	for server in $other ./calcServer; do
+		flags="-g $grace"
+		[ "$server" = "$other" ] && flags=""
+		$server -m threads $flags $port &
+		CALC_PID=$!
+		sleep 1
+		echo "$server $flags:" \
+			$(./calcLoad -I -c $conns -d 3 -p $CALC_PID localhost $port)
+		kill -9 $CALC_PID 2> /dev/null
+		wait $CALC_PID 2> /dev/null
+		port=$((port + 1))
+	done
+done
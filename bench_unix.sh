@@ -0,0 +1,38 @@
+#! /bin/bash
+
+# Replies per second and round trip latency of calcServer over loopback
+# TCP and over its AF_UNIX socket (calcServer -u, calcLoad -U), with 16
+# connections at several pipeline depths, in the epoll mode (or the one
+# given with -m). Both listeners belong to the same server, so the only
+# difference is the socket family.
+
+if [ $# -lt 1 ]; then
+	echo "Usage: bench_unix.sh [-m mode] <port> [depths...]"
+	exit 1
+fi
+
+mode=epoll
+if [ "$1" = "-m" ]; then
+	mode="$2"
+	shift 2
+fi
+port="$1"
+shift
+depths="${@:-1 16 128 1024}"
+path=/tmp/calcServer.$$.sock
+
+./calcServer -m $mode -u $path $port &
+CALC_PID=$!
+sleep 1
+for depth in $depths; do
+	for family in tcp unix; do
+		target="localhost $port"
+		[ $family = unix ] && target="-U $path"
+		echo "depth $depth $family:" \
+			$(./calcLoad -c 16 -P $depth -d 5 $target |
+			awk '{ for (i = 1; i < NF; i++) if ($i ~ /^(replies\/s|p50|p99)$/) print $i, $(i + 1) }')
+	done
+done
+kill -9 $CALC_PID
+wait $CALC_PID 2> /dev/null
+rm -f $path
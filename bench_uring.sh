@@ -0,0 +1,44 @@
+#! /bin/bash
+
+# Throughput and system calls per request of calcServer with blocking
+# I/O (threads), epoll and io_uring, at several pipeline depths
+# (calcLoad -P). The read and write calls come from the server's
+# /proc/<pid>/io; the io_uring mode reports its io_uring_enter calls
+# itself (-S) when it shuts down.
+
+if [ $# -lt 1 ]; then
+	echo "Usage: bench_uring.sh <port> [depths...]"
+	exit 1
+fi
+
+port="$1"
+shift
+depths="${@:-1 16 128}"
+seconds=5
+
+# read and write system calls made so far by process $1
+rw_calls() {
+	awk '/^syscr|^syscw/ { sum += $2 } END { print sum }' /proc/$1/io
+}
+
+for depth in $depths; do
+	for mode in threads epoll uring; do
+		./calcServer -m $mode -S $port &
+		CALC_PID=$!
+		sleep 1
+		before=$(rw_calls $CALC_PID)
+		out=$(./calcLoad -c 16 -P $depth -d $seconds localhost $port)
+		after=$(rw_calls $CALC_PID)
+		rate=$(echo "$out" | awk '{ for (i = 1; i < NF; i++)
+			if ($i == "replies/s") print $(i + 1) }')
+		echo "depth $depth $mode: replies/s $rate  read/write calls per reply" \
+			$(awk -v c=$((after - before)) -v r="$rate" -v d=$seconds \
+				'BEGIN { printf "%.3f", c / (r * d) }')
+		# shut it down cleanly, so that -S gets to report
+		exec 3<> /dev/tcp/localhost/$port
+		echo shutdown >&3
+		exec 3>&-
+		wait $CALC_PID
+		port=$((port + 1))
+	done
+done
@@ -2,14 +2,520 @@
 // Jack Zhang (jzhan237)
 // Tony Pan (jpan26)
 #include "calc.h"
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <cstddef>
+#include <stdint.h>
 #include <vector>
-#include <unordered_map>
-#include <string>
-#include <sstream>
 #include <algorithm>
-#include <pthread.h> 
+#include <atomic>
+#include <pthread.h>
+#include <sched.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
 
-typedef std::unordered_map<std::string, int> VariableList;
+// Normalized expressions longer than this are compiled but not cached
+#define CACHE_KEY_MAX 64
+// Every instruction but the final RET comes from at least one character
+// of the expression, so any cacheable expression fits in this many
+#define MAX_INLINE_CODE CACHE_KEY_MAX
+// Registers available to a compiled expression; each level of nesting
+// on the right of an operator needs one more
+#define MAX_REGS 32
+// Parentheses and unary minuses that may enclose one another; the
+// compiler recurses on each, and neither needs a register
+#define MAX_NESTING 256
+// Cache geometry: CACHE_SETS sets of CACHE_WAYS entries, one lock per set
+#define CACHE_SETS 256
+#define CACHE_WAYS 4
+// Cache counters are spread over this many shards to keep hits from
+// bouncing a shared cache line between threads
+#define COUNTER_SHARDS 64
+
+// Publication records for flat combining; threads beyond this many
+// wait for a record to become free
+#define FC_RECORDS 64
+// Spins waiting for a combiner before yielding the CPU
+#define FC_SPINS 64
+
+// calc_eval_batch compiles this many expressions ahead before running
+// them, and holds the lock for at most this many assignments in a row
+#define BATCH_CHUNK 16
+
+// Columnar evaluation works through its columns this many rows at a time
+#define COLUMN_BLOCK 256
+
+// Variables live in chunks of SLOT_CHUNK_SIZE, so a calculator can hold
+// up to SLOT_CHUNK_SIZE * MAX_SLOT_CHUNKS of them
+#define SLOT_CHUNK_SIZE 1024
+#define MAX_SLOT_CHUNKS 16384
+
+enum TokenKind {
+    TOK_END,
+    TOK_NUMBER,
+    TOK_NAME,
+    TOK_OP,         // + - * /
+    TOK_LPAREN,
+    TOK_RPAREN,
+    TOK_ASSIGN,
+    TOK_ERROR
+};
+
+// Non-owning view of one token inside the expression string
+struct Token {
+    TokenKind kind;
+    const char *str;
+    size_t len;
+};
+
+// Bytecode operations. Instructions work on registers holding ints;
+// the K forms take a constant right operand from imm, and the RK forms
+// a constant left operand (imm - a, imm / a).
+enum Opcode {
+    OP_LOADK,       // dst = imm
+    OP_LOADV,       // dst = variable in slot imm (fails if undefined)
+    OP_NEG,         // dst = -a
+    OP_ADD,         // dst = a op b
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_ADDK,        // dst = a op imm
+    OP_SUBK,
+    OP_MULK,
+    OP_DIVK,
+    OP_RSUBK,       // dst = imm op a
+    OP_RDIVK,
+    OP_RET          // result is a
+};
+
+struct Instr {
+    uint8_t op;
+    uint8_t dst, a, b;
+    int32_t imm;
+};
+
+// Result of parsing an expression once: register bytecode computing
+// the right-hand side, and where to store it
+struct CompiledExpr {
+    bool valid;
+    bool has_target;
+    int target;             // slot of the assigned variable
+    bool reads_target;      // the target is also an operand
+    bool atomic_update;     // "x = x op c" or "x = c op x", done lock-free
+    uint32_t ncode;
+    const Instr *code;      // inline_code, or a per-thread buffer for
+                            // expressions too long to cache
+    Instr inline_code[MAX_INLINE_CODE];
+};
+
+struct CacheEntry {
+    uint64_t hash;
+    uint32_t len;           // 0 means the entry is empty
+    char key[CACHE_KEY_MAX];
+    CompiledExpr compiled;
+};
+
+// Cache entries are stored as words of atomics so that readers can copy
+// them out while a writer may be replacing them (see ExprCache::lookup)
+#define ENTRY_WORDS ((sizeof(CacheEntry) + 7) / 8)
+// hash and len come first, so they are in the first two words
+#define ENTRY_HEADER_WORDS 2
+// Only the used part of the code is copied
+#define ENTRY_CODE_OFFSET \
+    (offsetof(CacheEntry, compiled) + offsetof(CompiledExpr, inline_code))
+
+union EntryWords {
+    CacheEntry entry;
+    uint64_t words[ENTRY_WORDS];
+};
+
+// Words of an entry up to the end of ncode instructions
+static unsigned entry_words(uint32_t ncode) {
+    if (ncode > MAX_INLINE_CODE) ncode = MAX_INLINE_CODE;
+    return (ENTRY_CODE_OFFSET + ncode * sizeof(Instr) + 7) / 8;
+}
+
+struct CacheSet {
+    std::atomic<unsigned> seq;  // odd while a writer is updating the set
+    pthread_mutex_t lock;       // serializes writers
+    unsigned next_victim;
+    std::atomic<uint64_t> entries[CACHE_WAYS][ENTRY_WORDS];
+};
+
+// Per-shard cache counters, padded so shards don't share a cache line
+struct CounterShard {
+    std::atomic<unsigned long> hits, misses, evictions;
+    char pad[64 - 3 * sizeof(std::atomic<unsigned long>)];
+};
+
+// Bounded set-associative cache from normalized expression text
+// to its compiled form. Lookups never block: each set is a seqlock,
+// and a reader retries if a writer replaced an entry under it.
+class ExprCache {
+public:
+    ExprCache();
+    ~ExprCache();
+    bool lookup(const char *key, uint32_t len, uint64_t hash,
+                CompiledExpr *out);
+    void insert(const char *key, uint32_t len, uint64_t hash,
+                const CompiledExpr &compiled);
+    void stats(struct CalcCacheStats *stats);
+private:
+    CacheSet sets[CACHE_SETS];
+    CounterShard counters[COUNTER_SHARDS];
+
+    CacheSet &set_for(uint64_t hash) { return sets[hash % CACHE_SETS]; }
+    CounterShard &my_counters();
+};
+
+// Copy words [from, to) of a stored entry into dst. The loads acquire:
+// a word a writer has stored (with release) brings its odd seq along,
+// so the reader's check of seq afterwards is bound to see it.
+static void load_words(const std::atomic<uint64_t> *src, EntryWords *dst,
+                       unsigned from, unsigned to) {
+    for (unsigned i = from; i < to; i++) {
+        uint64_t w = src[i].load(std::memory_order_acquire);
+        memcpy((char *) dst + i * 8, &w, 8);
+    }
+}
+
+ExprCache::ExprCache() {
+    for (unsigned i = 0; i < CACHE_SETS; i++) {
+        sets[i].seq.store(0, std::memory_order_relaxed);
+        pthread_mutex_init(&sets[i].lock, NULL);
+        sets[i].next_victim = 0;
+        for (unsigned j = 0; j < CACHE_WAYS; j++)
+            for (unsigned k = 0; k < ENTRY_WORDS; k++)
+                sets[i].entries[j][k].store(0, std::memory_order_relaxed);
+    }
+    for (unsigned i = 0; i < COUNTER_SHARDS; i++) {
+        counters[i].hits.store(0, std::memory_order_relaxed);
+        counters[i].misses.store(0, std::memory_order_relaxed);
+        counters[i].evictions.store(0, std::memory_order_relaxed);
+    }
+}
+
+ExprCache::~ExprCache() {
+    for (unsigned i = 0; i < CACHE_SETS; i++)
+        pthread_mutex_destroy(&sets[i].lock);
+}
+
+CounterShard &ExprCache::my_counters() {
+    static std::atomic<unsigned> next_shard(0);
+    static thread_local unsigned shard =
+        next_shard.fetch_add(1, std::memory_order_relaxed) % COUNTER_SHARDS;
+    return counters[shard];
+}
+
+bool ExprCache::lookup(const char *key, uint32_t len, uint64_t hash,
+                       CompiledExpr *out) {
+    CacheSet &set = set_for(hash);
+    EntryWords buf;
+    CacheEntry &entry = buf.entry;
+    bool found;
+    unsigned seq;
+
+    do {
+        seq = set.seq.load(std::memory_order_acquire);
+        if (seq & 1)
+            continue; // a writer is in the middle of an update
+        found = false;
+        for (unsigned i = 0; i < CACHE_WAYS && !found; i++) {
+            load_words(set.entries[i], &buf, 0, ENTRY_HEADER_WORDS);
+            if (entry.len != len || entry.hash != hash)
+                continue;
+            load_words(set.entries[i], &buf, ENTRY_HEADER_WORDS,
+                       entry_words(0));
+            // ncode may be torn if a writer got in; entry_words clamps it
+            // and the seq check below throws the copy away
+            load_words(set.entries[i], &buf, entry_words(0),
+                       entry_words(entry.compiled.ncode));
+            found = memcmp(entry.key, key, len) == 0;
+        }
+    } while ((seq & 1) || set.seq.load(std::memory_order_seq_cst) != seq);
+
+    if (found) {
+        memcpy(out, &entry.compiled, offsetof(CompiledExpr, inline_code) +
+               entry.compiled.ncode * sizeof(Instr));
+        out->code = out->inline_code;
+        my_counters().hits.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        my_counters().misses.fetch_add(1, std::memory_order_relaxed);
+    }
+    return found;
+}
+
+void ExprCache::insert(const char *key, uint32_t len, uint64_t hash,
+                       const CompiledExpr &compiled) {
+    CacheSet &set = set_for(hash);
+    EntryWords buf;
+    CacheEntry &entry = buf.entry;
+    pthread_mutex_lock(&set.lock);
+    int victim = -1;
+    for (unsigned i = 0; i < CACHE_WAYS; i++) {
+        // no writer can run concurrently, so no need to check seq
+        load_words(set.entries[i], &buf, 0, entry_words(0));
+        if (entry.len == len && entry.hash == hash &&
+            memcmp(entry.key, key, len) == 0) {
+            // another thread compiled the same expression first
+            pthread_mutex_unlock(&set.lock);
+            return;
+        }
+        if (victim < 0 && entry.len == 0) victim = i;
+    }
+    if (victim < 0) {
+        // set is full, replace entries round-robin
+        victim = set.next_victim;
+        set.next_victim = (set.next_victim + 1) % CACHE_WAYS;
+        my_counters().evictions.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    unsigned nwords = entry_words(compiled.ncode);
+    memset(buf.words, 0, nwords * 8);
+    entry.hash = hash;
+    entry.len = len;
+    memcpy(entry.key, key, len);
+    memcpy(&entry.compiled, &compiled, offsetof(CompiledExpr, inline_code));
+    memcpy(entry.compiled.inline_code, compiled.code,
+           compiled.ncode * sizeof(Instr));
+
+    // The stores release rather than relying on a fence, so that TSAN
+    // can follow them: each word carries the odd seq stored before it
+    // to any reader that sees the word (see load_words).
+    unsigned seq = set.seq.load(std::memory_order_relaxed);
+    set.seq.store(seq + 1, std::memory_order_release);
+    for (unsigned i = 0; i < nwords; i++)
+        set.entries[victim][i].store(buf.words[i], std::memory_order_release);
+    set.seq.store(seq + 2, std::memory_order_release);
+    pthread_mutex_unlock(&set.lock);
+}
+
+void ExprCache::stats(struct CalcCacheStats *stats) {
+    stats->hits = stats->misses = stats->evictions = 0;
+    for (unsigned i = 0; i < COUNTER_SHARDS; i++) {
+        stats->hits += counters[i].hits.load(std::memory_order_relaxed);
+        stats->misses += counters[i].misses.load(std::memory_order_relaxed);
+        stats->evictions +=
+            counters[i].evictions.load(std::memory_order_relaxed);
+    }
+}
+
+// Storage for one variable. A slot exists from the first time its
+// name is seen, but only holds a value once it has been assigned.
+// Writers store value and then defined (release); readers load
+// defined (acquire) and then value, without taking any lock.
+struct Variable {
+    std::atomic<int> value;
+    std::atomic<bool> defined;
+    char *long_name;        // copy of the name if longer than 8 chars
+    uint32_t name_len;
+};
+
+struct SymbolEntry {
+    std::atomic<uint64_t> key;  // 0 means the entry is empty
+    std::atomic<int> slot;
+};
+
+// One generation of the name -> slot hash table. Tables are never
+// modified once replaced, only retired.
+struct SymbolIndex {
+    uint32_t capacity;      // power of 2
+    SymbolEntry *entries;
+    SymbolIndex *retired;   // next older generation
+};
+
+// Interns variable names into stable integer slots. Values live in a
+// dense, chunked array indexed by slot, so once an expression has been
+// compiled its variables are reached with an indexed load and no
+// hashing.
+//
+// lookup() and var() never block and may run concurrently with
+// intern(); calls to intern() must be serialized by the caller. A new
+// entry is published by storing its key last (release), and growing
+// the table builds a new generation and publishes it with one pointer
+// store. Readers may still be probing an old generation, so retired
+// generations are freed with the table; since each is half the size
+// of the next, they never take more space than the live one.
+class SymbolTable {
+public:
+    SymbolTable();
+    ~SymbolTable();
+    int lookup(const char *name, size_t len);
+    int intern(const char *name, size_t len);
+    // whether slot has been handed out by intern()
+    bool has(int slot) {
+        return slot >= 0 &&
+               (uint32_t) slot < published.load(std::memory_order_acquire);
+    }
+    Variable &var(int slot) {
+        Variable *chunk =
+            chunks[slot / SLOT_CHUNK_SIZE].load(std::memory_order_acquire);
+        return chunk[slot % SLOT_CHUNK_SIZE];
+    }
+private:
+    std::atomic<SymbolIndex *> index;
+    uint32_t nslots;
+    std::atomic<uint32_t> published;    // nslots, once they are set up
+    std::atomic<Variable *> chunks[MAX_SLOT_CHUNKS];
+
+    int find(const SymbolIndex *idx, uint64_t key, const char *name,
+             size_t len);
+    void grow();
+};
+
+// Names of up to 8 letters are packed into the key itself, so they
+// hash and compare as one word. Longer names use their hash with the
+// top bit set, which a packed name never has (letters are < 0x80).
+static uint64_t symbol_key(const char *name, size_t len) {
+    uint64_t key = 0;
+    if (len <= 8) {
+        memcpy(&key, name, len);
+        return key;
+    }
+    key = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++)
+        key = (key ^ (unsigned char) name[i]) * 1099511628211ULL;
+    return key | (1ULL << 63);
+}
+
+static uint32_t symbol_hash(uint64_t key, uint32_t capacity) {
+    // Fibonacci hashing spreads packed names over the table
+    return (uint32_t) ((key * 11400714819323198485ULL) >> 32) & (capacity - 1);
+}
+
+static SymbolIndex *new_symbol_index(uint32_t capacity) {
+    SymbolIndex *idx = new SymbolIndex;
+    idx->capacity = capacity;
+    idx->entries = new SymbolEntry[capacity];
+    idx->retired = NULL;
+    for (uint32_t i = 0; i < capacity; i++) {
+        idx->entries[i].key.store(0, std::memory_order_relaxed);
+        idx->entries[i].slot.store(-1, std::memory_order_relaxed);
+    }
+    return idx;
+}
+
+SymbolTable::SymbolTable() : nslots(0) {
+    published.store(0, std::memory_order_relaxed);
+    index.store(new_symbol_index(64), std::memory_order_relaxed);
+    for (uint32_t i = 0; i < MAX_SLOT_CHUNKS; i++)
+        chunks[i].store(NULL, std::memory_order_relaxed);
+}
+
+SymbolTable::~SymbolTable() {
+    for (uint32_t i = 0; i < nslots; i++)
+        delete[] var(i).long_name;
+    for (uint32_t i = 0; i < MAX_SLOT_CHUNKS; i++)
+        delete[] chunks[i].load(std::memory_order_relaxed);
+    SymbolIndex *idx = index.load(std::memory_order_relaxed);
+    while (idx != NULL) {
+        SymbolIndex *older = idx->retired;
+        delete[] idx->entries;
+        delete idx;
+        idx = older;
+    }
+}
+
+int SymbolTable::find(const SymbolIndex *idx, uint64_t key, const char *name,
+                      size_t len) {
+    uint32_t mask = idx->capacity - 1;
+    for (uint32_t i = symbol_hash(key, idx->capacity); ; i = (i + 1) & mask) {
+        uint64_t k = idx->entries[i].key.load(std::memory_order_acquire);
+        if (k == 0) return -1;
+        if (k != key) continue;
+        int slot = idx->entries[i].slot.load(std::memory_order_relaxed);
+        Variable &v = var(slot);
+        // long names may share a hash, so compare them in full
+        if (len <= 8 || (v.name_len == len &&
+                         memcmp(v.long_name, name, len) == 0))
+            return slot;
+    }
+}
+
+// Return the slot for name, or -1 if it hasn't been interned
+int SymbolTable::lookup(const char *name, size_t len) {
+    return find(index.load(std::memory_order_acquire),
+                symbol_key(name, len), name, len);
+}
+
+static void insert_entry(SymbolIndex *idx, uint64_t key, int slot) {
+    uint32_t mask = idx->capacity - 1;
+    uint32_t i = symbol_hash(key, idx->capacity);
+    while (idx->entries[i].key.load(std::memory_order_relaxed) != 0)
+        i = (i + 1) & mask;
+    idx->entries[i].slot.store(slot, std::memory_order_relaxed);
+    idx->entries[i].key.store(key, std::memory_order_release);
+}
+
+void SymbolTable::grow() {
+    SymbolIndex *old = index.load(std::memory_order_relaxed);
+    SymbolIndex *idx = new_symbol_index(old->capacity * 2);
+    for (uint32_t i = 0; i < old->capacity; i++) {
+        uint64_t key = old->entries[i].key.load(std::memory_order_relaxed);
+        if (key != 0)
+            insert_entry(idx, key,
+                         old->entries[i].slot.load(std::memory_order_relaxed));
+    }
+    idx->retired = old;
+    index.store(idx, std::memory_order_release);
+}
+
+// Return the slot for name, creating it if needed (-1 if the
+// calculator is out of slots)
+int SymbolTable::intern(const char *name, size_t len) {
+    uint64_t key = symbol_key(name, len);
+    int slot = find(index.load(std::memory_order_relaxed), key, name, len);
+    if (slot >= 0)
+        return slot;
+
+    if (nslots == (uint32_t) SLOT_CHUNK_SIZE * MAX_SLOT_CHUNKS)
+        return -1;
+    if (nslots % SLOT_CHUNK_SIZE == 0) {
+        Variable *chunk = new Variable[SLOT_CHUNK_SIZE];
+        chunks[nslots / SLOT_CHUNK_SIZE].store(chunk,
+                                               std::memory_order_release);
+    }
+    slot = nslots++;
+    Variable &v = var(slot);
+    v.value.store(0, std::memory_order_relaxed);
+    v.defined.store(false, std::memory_order_relaxed);
+    v.long_name = NULL;
+    v.name_len = len;
+    if (len > 8) {
+        v.long_name = new char[len];
+        memcpy(v.long_name, name, len);
+    }
+
+    // keep the load factor at or below 1/2
+    if (2 * (nslots + 1) > index.load(std::memory_order_relaxed)->capacity)
+        grow();
+    insert_entry(index.load(std::memory_order_relaxed), key, slot);
+    published.store(nslots, std::memory_order_release);
+    return slot;
+}
+
+// States of a flat combining publication record
+enum {
+    FC_FREE,        // unowned
+    FC_CLAIMED,     // owned by a thread that is filling it in
+    FC_PENDING,     // assignment published, waiting for a combiner
+    FC_DONE         // applied; ok and result are valid
+};
+
+// A thread's published assignment, padded to its own cache line
+struct FcRecord {
+    std::atomic<int> state;
+    const CompiledExpr *compiled;
+    int result;
+    bool ok;
+    char pad[64 - sizeof(std::atomic<int>) - sizeof(const CompiledExpr *) -
+             sizeof(int) - sizeof(bool)];
+};
 
 struct Calc {
 };
@@ -17,161 +523,1197 @@ struct Calc {
 // implementation of Calc
 class CalcImpl : public Calc {
 public:
-  CalcImpl () {
+  CalcImpl (CalcLockMode mode) : mode(mode) {
       pthread_mutex_init(&lock, NULL);
+      for (unsigned i = 0; i < FC_RECORDS; i++)
+          records[i].state.store(FC_FREE, std::memory_order_relaxed);
     }
     ~CalcImpl () {
       pthread_mutex_destroy(&lock);
     }
     int evalExpr(const char *expr, int *result);
+    void evalBatch(const char *const *exprs, size_t n, int *results,
+                   int *ok);
+    void cacheStats(struct CalcCacheStats *stats) { cache.stats(stats); }
+    int resolve(const char *name, size_t len);
+    int lookup(const char *name, size_t len) {
+        return symbols.lookup(name, len);
+    }
+    int varId(const char *name, size_t len);
+    bool getVar(int id, int *value);
+    bool setVar(int id, int value);
 private:
-    VariableList varlist;
+    SymbolTable symbols;
     pthread_mutex_t lock;
+    ExprCache cache;
+    CalcLockMode mode;
+    FcRecord records[FC_RECORDS];
+
+    bool compile(const char *text, CompiledExpr *compiled, Instr *code,
+                 uint32_t capacity, bool intern_operands);
+    bool execute(const CompiledExpr &compiled, int self_slot, int self_value,
+                 int *result);
+    bool update_atomically(const CompiledExpr &compiled, int *result);
+    bool assign_locked(const CompiledExpr &compiled, int *result);
+    void combine();
+    bool assign_combining(const CompiledExpr &compiled, int *result);
+    bool run(const CompiledExpr &compiled, int *result);
+    bool prepare(const char *expr, CompiledExpr *compiled,
+                 std::vector<Instr> &long_code);
+    static bool needs_lock(const CompiledExpr &compiled);
 
-    bool parse_op(std::string token, char *result);
-    bool parse_operand(std::string token, int *result);
-    bool evaluate(std::vector<std::string> tokens, int *result);
+    friend class ColumnsImpl;
+    friend class StatementImpl;
 };
 
-std::vector<std::string> tokenize(const std::string &expr) {
-    std::vector<std::string> vec;
-    std::stringstream s(expr);
+// Copy expr into buf with surrounding whitespace dropped and every
+// run of inner whitespace collapsed to one space, hashing (FNV-1a)
+// the normalized text on the way. Returns false if it doesn't fit.
+bool normalize(const char *expr, char *buf, uint32_t *len, uint64_t *hash) {
+    uint64_t h = 14695981039346656037ULL;
+    uint32_t n = 0;
+    const char *p = expr;
+    while (isspace((unsigned char) *p)) p++;
+    while (*p != '\0') {
+        char c = *p++;
+        if (isspace((unsigned char) c)) {
+            while (isspace((unsigned char) *p)) p++;
+            if (*p == '\0') break;
+            c = ' ';
+        }
+        if (n == CACHE_KEY_MAX - 1) return false; // keep room for the NUL
+        buf[n++] = c;
+        h = (h ^ (unsigned char) c) * 1099511628211ULL;
+    }
+    buf[n] = '\0';
+    *len = n;
+    *hash = h;
+    return true;
+}
+
+// Scan the token starting at *p, and advance *p past it
+Token next_token(const char **p) {
+    const char *s = *p;
+    while (isspace((unsigned char) *s)) s++;
+    Token t;
+    t.str = s;
+    t.len = 1;
+    if (*s == '\0') {
+        t.kind = TOK_END;
+        t.len = 0;
+    } else if (isdigit((unsigned char) *s)) {
+        t.kind = TOK_NUMBER;
+        while (isdigit((unsigned char) s[t.len])) t.len++;
+    } else if (isalpha((unsigned char) *s)) {
+        t.kind = TOK_NAME;
+        while (isalpha((unsigned char) s[t.len])) t.len++;
+    } else if (*s == '+' || *s == '-' || *s == '*' || *s == '/') {
+        t.kind = TOK_OP;
+    } else if (*s == '(') {
+        t.kind = TOK_LPAREN;
+    } else if (*s == ')') {
+        t.kind = TOK_RPAREN;
+    } else if (*s == '=') {
+        t.kind = TOK_ASSIGN;
+    } else {
+        t.kind = TOK_ERROR;
+    }
+    *p = s + t.len;
+    return t;
+}
+
+// Whether all 8 bytes of x (loaded little-endian) are ASCII digits:
+// each byte must have 0x3 in its high nibble, and must not carry into
+// the high nibble when 6 is added to it
+static inline bool swar_all_digits(uint64_t x) {
+    return (x & 0xF0F0F0F0F0F0F0F0ULL) == 0x3030303030303030ULL &&
+           ((x + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) ==
+               0x3030303030303030ULL;
+}
+
+// Value of the 8 digits in x (loaded little-endian, so the first digit
+// is the low byte), combining neighbouring digits, then pairs, then
+// quadruples with one multiply each
+static inline uint32_t swar_eight_digits(uint64_t x) {
+    x -= 0x3030303030303030ULL;
+    x = (x * 10) + (x >> 8);
+    x = (((x & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32))) +
+         (((x >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32)))) >> 32;
+    return (uint32_t) x;
+}
+
+// Parse the decimal digits s[0..len), negated if negative, into *value.
+// Leading zeros are fine; anything but digits, no digits at all, or a
+// number outside the range of int makes it return false.
+static bool parse_digits(const char *s, size_t len, bool negative,
+                         int *value) {
+    while (len > 1 && *s == '0') {
+        s++;
+        len--;
+    }
+    if (len == 0 || len > 10)
+        return false; // no digits, or more significant ones than fit
+    uint64_t val = 0;
+    size_t i = 0;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if (len >= 8) {
+        uint64_t chunk;
+        memcpy(&chunk, s, 8);
+        if (!swar_all_digits(chunk)) return false;
+        val = swar_eight_digits(chunk);
+        i = 8;
+    }
+#endif
+    for (; i < len; i++) {
+        unsigned d = (unsigned char) s[i] - '0';
+        if (d > 9) return false;
+        val = val * 10 + d;
+    }
+    if (val > (uint64_t) INT_MAX + negative) return false;
+    *value = negative ? (int) (0 - (unsigned) val) : (int) val;
+    return true;
+}
+
+// Pairs of decimal digits "00" to "99", for formatting two at a time
+static const char digit_pairs[201] =
+    "0001020304050607080910111213141516171819202122232425262728293031"
+    "3233343536373839404142434445464748495051525354555657585960616263"
+    "6465666768697071727374757677787980818283848586878889909192939495"
+    "96979899";
 
-    std::string tok;
-    while (s >> tok) {
-        vec.push_back(tok);
+// Decimal digits in v
+static inline size_t count_digits(uint32_t v) {
+    size_t n = 1;
+    for (;;) {
+        if (v < 10) return n;
+        if (v < 100) return n + 1;
+        if (v < 1000) return n + 2;
+        if (v < 10000) return n + 3;
+        v /= 10000;
+        n += 4;
     }
+}
+
+// Arithmetic shared by the compiler (constant folding) and the VM.
+// Results wrap on overflow; division by zero and INT_MIN / -1 have
+// no result.
+static inline int wrap_add(int a, int b) {
+    return (int) ((unsigned) a + (unsigned) b);
+}
+
+static inline int wrap_sub(int a, int b) {
+    return (int) ((unsigned) a - (unsigned) b);
+}
+
+static inline int wrap_mul(int a, int b) {
+    return (int) ((unsigned) a * (unsigned) b);
+}
+
+static inline bool checked_div(int a, int b, int *result) {
+    if (b == 0) return false;
+    if (a == INT_MIN && b == -1) return false;
+    *result = a / b;
+    return true;
+}
 
-    return vec;
+// Apply a binary operator given as its ADD/SUB/MUL/DIV opcode
+static bool apply_op(int op, int a, int b, int *result) {
+    switch (op) {
+    case OP_ADD: *result = wrap_add(a, b); return true;
+    case OP_SUB: *result = wrap_sub(a, b); return true;
+    case OP_MUL: *result = wrap_mul(a, b); return true;
+    case OP_DIV: return checked_div(a, b, result);
+    default: return false;
+    }
 }
 
-bool has_only_digits(const std::string s) {
-    return s.find_first_not_of("0123456789") == std::string::npos;
+// Apply a K or RK instruction to the value x of its register operand
+static bool apply_k(const Instr &ins, int x, int *result) {
+    switch (ins.op) {
+    case OP_ADDK: *result = wrap_add(x, ins.imm); return true;
+    case OP_SUBK: *result = wrap_sub(x, ins.imm); return true;
+    case OP_MULK: *result = wrap_mul(x, ins.imm); return true;
+    case OP_DIVK: return checked_div(x, ins.imm, result);
+    case OP_RSUBK: *result = wrap_sub(ins.imm, x); return true;
+    case OP_RDIVK: return checked_div(ins.imm, x, result);
+    default: return false;
+    }
 }
 
-bool is_integer(const std::string s) {
-    if (s.empty())
+// Intermediate result while compiling: a constant (folded at compile
+// time) or the register holding the value
+struct Value {
+    bool is_const;
+    int k;
+    int reg;
+};
+
+// Recursive descent compiler from expression text to register bytecode:
+//
+//   statement := name '=' expr | expr
+//   expr      := term (('+' | '-') term)*
+//   term      := unary (('*' | '/') unary)*
+//   unary     := '-' unary | primary
+//   primary   := number | name | '(' expr ')'
+//
+// Registers are allocated as a stack, so every subexpression leaves its
+// value in the lowest register it used. Constant subexpressions are
+// folded, and constant operands are encoded in the instruction.
+//
+// The target of an assignment is interned, but an operand is only
+// looked up unless intern_operands is set, so that merely reading a
+// name never creates a variable. A name without a slot fails the
+// compile only once the rest of the text has parsed, so that
+// missing_slot tells a statement that may compile later from an
+// invalid one.
+class Compiler {
+public:
+    Compiler(CalcImpl *calc, const char *text, Instr *code, uint32_t capacity,
+             bool intern_operands)
+        : missing_slot(false), calc(calc), p(text), code(code),
+          capacity(capacity), ncode(0), nregs(0), depth(0),
+          intern_operands(intern_operands) {
+        advance();
+    }
+    bool statement(CompiledExpr *compiled);
+    bool missing_slot;      // valid but for a name without a slot
+private:
+    CalcImpl *calc;
+    const char *p;          // text after cur
+    Token cur;
+    Instr *code;
+    uint32_t capacity;
+    uint32_t ncode;
+    int nregs;              // registers in use
+    int depth;              // enclosing parentheses and unary minuses
+    bool intern_operands;
+
+    void advance() { cur = next_token(&p); }
+    bool emit(int op, int dst, int a, int b, int32_t imm);
+    bool new_reg(int *reg);
+    bool materialize(Value *v);
+    bool binary(int op, Value l, Value r, Value *out);
+    bool literal(bool negative, Value *out);
+    bool expr(Value *out);
+    bool term(Value *out);
+    bool unary(Value *out);
+    bool primary(Value *out);
+};
+
+bool Compiler::emit(int op, int dst, int a, int b, int32_t imm) {
+    if (ncode == capacity)
         return false;
-    if (s[0] == '-')
-        return has_only_digits(s.substr(1));
-    else
-        return has_only_digits(s);
+    Instr &ins = code[ncode++];
+    ins.op = op;
+    ins.dst = dst;
+    ins.a = a;
+    ins.b = b;
+    ins.imm = imm;
+    return true;
 }
 
-bool has_only_alpha(const std::string s){
-  return s.find_first_not_of(\
-    "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ")==std::string::npos;
+bool Compiler::new_reg(int *reg) {
+    if (nregs == MAX_REGS)
+        return false; // nested too deeply
+    *reg = nregs++;
+    return true;
 }
 
-// Helper function to parse a single operand
-bool CalcImpl::parse_operand(std::string token, int *result) {
-    // Integer
-    if (is_integer(token)) {
-        *result = std::stoi(token);
+// Make sure v is in a register
+bool Compiler::materialize(Value *v) {
+    if (!v->is_const)
         return true;
+    v->is_const = false;
+    return new_reg(&v->reg) && emit(OP_LOADK, v->reg, 0, 0, v->k);
+}
+
+bool Compiler::binary(int op, Value l, Value r, Value *out) {
+    static const int k_form[] = { OP_ADDK, OP_SUBK, OP_MULK, OP_DIVK };
+    static const int rk_form[] = { OP_ADDK, OP_RSUBK, OP_MULK, OP_RDIVK };
+    int i = op - OP_ADD;
+
+    if (l.is_const && r.is_const) {
+        out->is_const = true;
+        if (apply_op(op, l.k, r.k, &out->k))
+            return true;
+        // no value (e.g. division by zero): fail when evaluated
+        if (!materialize(&l))
+            return false;
+    }
+    if (r.is_const) {
+        *out = l;
+        return emit(k_form[i], l.reg, l.reg, 0, r.k);
+    }
+    if (l.is_const) {
+        *out = r;
+        return emit(rk_form[i], r.reg, r.reg, 0, l.k);
+    }
+    // r is on top of the register stack, right above l
+    *out = l;
+    nregs = l.reg + 1;
+    return emit(op, l.reg, l.reg, r.reg, 0);
+}
+
+// Parse the number in cur, negated if there was a minus sign before it
+bool Compiler::literal(bool negative, Value *out) {
+    if (!parse_digits(cur.str, cur.len, negative, &out->k))
+        return false; // literal doesn't fit in an int
+    out->is_const = true;
+    advance();
+    return true;
+}
+
+bool Compiler::expr(Value *out) {
+    if (!term(out))
+        return false;
+    while (cur.kind == TOK_OP && (cur.str[0] == '+' || cur.str[0] == '-')) {
+        int op = cur.str[0] == '+' ? OP_ADD : OP_SUB;
+        Value r;
+        advance();
+        if (!term(&r) || !binary(op, *out, r, out))
+            return false;
+    }
+    return true;
+}
+
+bool Compiler::term(Value *out) {
+    if (!unary(out))
+        return false;
+    while (cur.kind == TOK_OP && (cur.str[0] == '*' || cur.str[0] == '/')) {
+        int op = cur.str[0] == '*' ? OP_MUL : OP_DIV;
+        Value r;
+        advance();
+        if (!unary(&r) || !binary(op, *out, r, out))
+            return false;
     }
-    // Variable
-    if (has_only_alpha(token)) {
-        if (varlist.find(token) == varlist.end()) {
-	        return false;
-        } // variable is undefined
-        *result = varlist[token];
+    return true;
+}
+
+bool Compiler::unary(Value *out) {
+    if (cur.kind != TOK_OP || cur.str[0] != '-')
+        return primary(out);
+    advance();
+    if (cur.kind == TOK_NUMBER)
+        return literal(true, out); // so that INT_MIN can be written
+    if (depth == MAX_NESTING)
+        return false; // nested too deeply
+    depth++;
+    bool ok = unary(out);
+    depth--;
+    if (!ok)
+        return false;
+    if (out->is_const) {
+        out->k = wrap_sub(0, out->k);
         return true;
     }
-    // Mixed number and alpha, not allowed
-    return false;
+    return emit(OP_NEG, out->reg, out->reg, 0, 0);
+}
+
+bool Compiler::primary(Value *out) {
+    if (cur.kind == TOK_NUMBER)
+        return literal(false, out);
+    if (cur.kind == TOK_NAME) {
+        int slot = intern_operands ? calc->resolve(cur.str, cur.len)
+                                   : calc->lookup(cur.str, cur.len);
+        if (slot < 0)
+            missing_slot = true;
+        out->is_const = false;
+        advance();
+        return new_reg(&out->reg) && emit(OP_LOADV, out->reg, 0, 0, slot);
+    }
+    if (cur.kind == TOK_LPAREN) {
+        if (depth == MAX_NESTING)
+            return false; // nested too deeply
+        advance();
+        depth++;
+        bool ok = expr(out);
+        depth--;
+        if (!ok || cur.kind != TOK_RPAREN)
+            return false;
+        advance();
+        return true;
+    }
+    return false; // missing operand
+}
+
+bool Compiler::statement(CompiledExpr *compiled) {
+    const char *after_name = p;
+    Token target = cur;
+    if (cur.kind == TOK_NAME && next_token(&after_name).kind == TOK_ASSIGN) {
+        // is an assignment operation
+        compiled->has_target = true;
+        p = after_name;
+        advance();
+    }
+
+    Value v;
+    if (!expr(&v) || cur.kind != TOK_END) {
+        missing_slot = false; // invalid whatever names are known
+        return false;
+    }
+    if (missing_slot)
+        return false;
+    if (!materialize(&v) || !emit(OP_RET, 0, v.reg, 0, 0))
+        return false;
+    if (compiled->has_target) {
+        // interned only now, so that a statement that doesn't compile
+        // leaves no variable behind
+        compiled->target = calc->resolve(target.str, target.len);
+        if (compiled->target < 0) {
+            missing_slot = true;
+            return false;
+        }
+    }
+    compiled->ncode = ncode;
+    return true;
+}
+
+// Slot for a variable name. Names already known are found without
+// locking; only the first sighting of a name takes the lock to intern it.
+int CalcImpl::resolve(const char *name, size_t len) {
+    int slot = symbols.lookup(name, len);
+    if (slot < 0) {
+        pthread_mutex_lock(&lock);
+        slot = symbols.intern(name, len);
+        pthread_mutex_unlock(&lock);
+    }
+    return slot;
+}
+
+int CalcImpl::varId(const char *name, size_t len) {
+    if (len == 0)
+        return -1;
+    for (size_t i = 0; i < len; i++) {
+        if (!isalpha((unsigned char) name[i]))
+            return -1;
+    }
+    return symbols.lookup(name, len);
 }
 
-// Helper function to parse operator
-bool CalcImpl::parse_op(std::string token, char *result) {
-    if (token.length() != 1) return false;
-    char op = token.c_str()[0];
-    if ((op == '+') || (op == '-') || (op == '*') || (op == '/')) {
-        *result = op;
+bool CalcImpl::getVar(int id, int *value) {
+    if (!symbols.has(id))
+        return false;
+    Variable &v = symbols.var(id);
+    if (!v.defined.load(std::memory_order_acquire))
+        return false;
+    *value = v.value.load(std::memory_order_relaxed);
+    return true;
+}
+
+// The stores of assign_locked() for "name = value", which need no lock
+// since nothing is computed from what the variable held
+bool CalcImpl::setVar(int id, int value) {
+    if (!symbols.has(id))
+        return false;
+    Variable &v = symbols.var(id);
+    v.value.store(value, std::memory_order_relaxed);
+    v.defined.store(true, std::memory_order_release);
+    return true;
+}
+
+// Compile text into compiled, emitting its code into code, and interning
+// the variables it assigns (and those it reads, with intern_operands). An
+// invalid expression still compiles (with valid == false) so that it can
+// be cached as well. Returns false if it is invalid only because a name
+// had no slot: the same text may compile once the variable exists, so
+// that result must not be cached.
+bool CalcImpl::compile(const char *text, CompiledExpr *compiled, Instr *code,
+                       uint32_t capacity, bool intern_operands) {
+    compiled->has_target = false;
+    compiled->reads_target = false;
+    compiled->atomic_update = false;
+    compiled->ncode = 0;
+    compiled->code = code;
+    Compiler compiler(this, text, code, capacity, intern_operands);
+    compiled->valid = compiler.statement(compiled);
+    if (!compiled->valid) {
+        compiled->ncode = 0;
+        return !compiler.missing_slot;
+    }
+    if (!compiled->has_target)
         return true;
+
+    for (uint32_t i = 0; i < compiled->ncode; i++) {
+        if (code[i].op == OP_LOADV && code[i].imm == compiled->target)
+            compiled->reads_target = true;
     }
-    else return false;
+    // "x = x op c" and "x = c op x" compile to LOADV x; <K op>; RET
+    compiled->atomic_update = compiled->ncode == 3 &&
+        code[0].op == OP_LOADV && code[0].imm == compiled->target &&
+        code[1].op >= OP_ADDK && code[1].op <= OP_RDIVK;
+    return true;
 }
 
-// Evaluate non-assignment type expressions
-bool CalcImpl::evaluate(std::vector<std::string> tokens, int *result) {
-    int operand1, operand2;
-    char op;
-    if (tokens.size() == 1) {
-        // [operand]
-        if (parse_operand(tokens[0], &operand1)) {
-            *result = operand1;
+// Run the bytecode of a compiled expression. If it reads the variable
+// in self_slot, self_value is used in place of its current value.
+bool CalcImpl::execute(const CompiledExpr &compiled, int self_slot,
+                       int self_value, int *result) {
+    int regs[MAX_REGS];
+    for (const Instr *ins = compiled.code; ; ins++) {
+        switch (ins->op) {
+        case OP_LOADK:
+            regs[ins->dst] = ins->imm;
+            break;
+        case OP_LOADV: {
+            if (ins->imm == self_slot) {
+                regs[ins->dst] = self_value;
+                break;
+            }
+            Variable &v = symbols.var(ins->imm);
+            if (!v.defined.load(std::memory_order_acquire))
+                return false; // variable is undefined
+            regs[ins->dst] = v.value.load(std::memory_order_relaxed);
+            break;
+        }
+        case OP_NEG:
+            regs[ins->dst] = wrap_sub(0, regs[ins->a]);
+            break;
+        case OP_ADD:
+            regs[ins->dst] = wrap_add(regs[ins->a], regs[ins->b]);
+            break;
+        case OP_SUB:
+            regs[ins->dst] = wrap_sub(regs[ins->a], regs[ins->b]);
+            break;
+        case OP_MUL:
+            regs[ins->dst] = wrap_mul(regs[ins->a], regs[ins->b]);
+            break;
+        case OP_DIV:
+            if (!checked_div(regs[ins->a], regs[ins->b], &regs[ins->dst]))
+                return false;
+            break;
+        case OP_RET:
+            *result = regs[ins->a];
             return true;
-        } 
-        else return false;
-    } else if (tokens.size() == 3) {
-      
-      // [operand op operand]
-        if (parse_operand(tokens[0], &operand1) && 
-            parse_op(tokens[1], &op) && 
-            parse_operand(tokens[2], &operand2)) {
-            switch (op) {
-            case '+':
-                *result = operand1+operand2;
-                return true;
-            case '-':
-                *result = operand1-operand2;
-                return true;
-            case '*':
-                *result = operand1*operand2;
-                return true;
-            case '/':
-                if (operand2 == 0) return false;
-                *result = operand1/operand2;
-                return true;    
-            default:
+        default:
+            // K and RK forms
+            if (!apply_k(*ins, regs[ins->a], &regs[ins->dst]))
                 return false;
-            }
+            break;
         }
-        else return false;
     }
-    else return false;
 }
 
-int CalcImpl::evalExpr(const char *expr, int *result) {
-    std::string expr_str(expr);
-    std::vector<std::string> tokens = tokenize(expr_str);
-    std::string equality_sign("=");
+// Perform "x = x op c" or "x = c op x" directly on x's storage without
+// the lock: a single fetch-add for additions and subtractions of x,
+// and a CAS loop for everything else
+bool CalcImpl::update_atomically(const CompiledExpr &compiled, int *result) {
+    Variable &target = symbols.var(compiled.target);
+    if (!target.defined.load(std::memory_order_acquire))
+        return false; // variable is undefined
 
-    if (std::find(tokens.begin(), tokens.end(), equality_sign)==tokens.end()) {
-        // not an assignment operation
-        return evaluate(tokens, result);
-    } else {
-        // is an assignment operation
-        if (tokens.size() < 3)
-            return false;
-        if (!has_only_alpha(tokens[0]) || tokens[1] != equality_sign)
+    const Instr &ins = compiled.code[1];
+    if (ins.op == OP_ADDK || ins.op == OP_SUBK) {
+        unsigned delta = ins.op == OP_ADDK ? (unsigned) ins.imm
+                                           : -(unsigned) ins.imm;
+        unsigned old = (unsigned) target.value.fetch_add(
+            (int) delta, std::memory_order_relaxed);
+        *result = (int) (old + delta);
+        return true;
+    }
+
+    int old = target.value.load(std::memory_order_relaxed);
+    int updated;
+    do {
+        if (!apply_k(ins, old, &updated))
             return false;
-        std::vector<std::string> new_tokens;
-        for (unsigned i = 2; i < tokens.size(); i++) {
-            // get subvector starting at index 2
-            new_tokens.push_back(tokens[i]);
+    } while (!target.value.compare_exchange_weak(old, updated,
+                                                 std::memory_order_relaxed));
+    *result = updated;
+    return true;
+}
+
+// Whether running compiled takes the lock: only assignments that can't
+// be applied atomically do
+bool CalcImpl::needs_lock(const CompiledExpr &compiled) {
+    return compiled.valid && compiled.has_target && !compiled.atomic_update;
+}
+
+bool CalcImpl::run(const CompiledExpr &compiled, int *result) {
+    if (!compiled.valid)
+        return false;
+    if (!compiled.has_target)
+        return execute(compiled, -1, 0, result);
+    if (compiled.atomic_update)
+        return update_atomically(compiled, result);
+    if (mode == CALC_LOCK_FLAT_COMBINING)
+        return assign_combining(compiled, result);
+
+    pthread_mutex_lock(&lock);
+    bool ok = assign_locked(compiled, result);
+    pthread_mutex_unlock(&lock);
+    return ok;
+}
+
+// Perform an assignment; the caller holds the lock
+bool CalcImpl::assign_locked(const CompiledExpr &compiled, int *result) {
+    int temp_result;
+    bool ok;
+    Variable &target = symbols.var(compiled.target);
+    // compute the right-hand side first
+    // then do assignment if there is a valid result
+    if (!compiled.reads_target) {
+        ok = execute(compiled, -1, 0, &temp_result);
+        if (ok) {
+            target.value.store(temp_result, std::memory_order_relaxed);
+            target.defined.store(true, std::memory_order_release);
         }
+    } else {
+        // update_atomically() changes variables without the lock, so
+        // only store if the target still holds the value we computed from
+        int old = target.value.load(std::memory_order_relaxed);
+        do {
+            ok = target.defined.load(std::memory_order_acquire) &&
+                 execute(compiled, compiled.target, old, &temp_result);
+        } while (ok && !target.value.compare_exchange_weak(
+                           old, temp_result, std::memory_order_relaxed));
+    }
+    if (ok)
+        *result = temp_result;
+    return ok;
+}
 
-        int temp_result;
-        // treat the subvector as a non-assigment operation fisrt
-        // then do assignment if there is a valid result
-        pthread_mutex_lock(&lock);
-        if (evaluate(new_tokens, &temp_result)){
-            varlist[tokens[0]] = temp_result; // assign to varlist
+// Apply every published assignment; the caller holds the lock
+void CalcImpl::combine() {
+    for (unsigned i = 0; i < FC_RECORDS; i++) {
+        FcRecord &r = records[i];
+        if (r.state.load(std::memory_order_acquire) != FC_PENDING)
+            continue;
+        r.ok = assign_locked(*r.compiled, &r.result);
+        r.state.store(FC_DONE, std::memory_order_release);
+    }
+}
+
+// Flat combining: publish the assignment in a record, then either take
+// the lock and apply everyone's pending assignments (including ours)
+// while their data is hot in this core's cache, or wait for the thread
+// that holds the lock to apply ours.
+bool CalcImpl::assign_combining(const CompiledExpr &compiled, int *result) {
+    // start probing for a free record at a per-thread position
+    static std::atomic<unsigned> next_thread(0);
+    static thread_local unsigned home =
+        next_thread.fetch_add(1, std::memory_order_relaxed);
+    FcRecord *r = NULL;
+    for (unsigned i = home; r == NULL; i++) {
+        FcRecord &candidate = records[i % FC_RECORDS];
+        int expected = FC_FREE;
+        if (candidate.state.compare_exchange_strong(
+                expected, FC_CLAIMED, std::memory_order_acquire))
+            r = &candidate;
+        else if (i - home >= FC_RECORDS)
+            sched_yield(); // all records in use
+    }
+    r->compiled = &compiled;
+    r->state.store(FC_PENDING, std::memory_order_release);
+
+    for (unsigned spins = 0;
+         r->state.load(std::memory_order_acquire) != FC_DONE; spins++) {
+        if (pthread_mutex_trylock(&lock) == 0) {
+            combine();
             pthread_mutex_unlock(&lock);
-            *result = temp_result;
-            return true;
+        } else if (spins >= FC_SPINS) {
+            sched_yield();
         }
-        else {
+    }
+
+    bool ok = r->ok;
+    if (ok)
+        *result = r->result;
+    r->state.store(FC_FREE, std::memory_order_release);
+    return ok;
+}
+
+// Find the compiled form of expr in the cache, or compile it. An
+// expression too long to cache is compiled straight from the input into
+// long_code, a buffer that only grows; then this returns true, and the
+// code stays valid until long_code is used again.
+bool CalcImpl::prepare(const char *expr, CompiledExpr *compiled,
+                       std::vector<Instr> &long_code) {
+    char key[CACHE_KEY_MAX];
+    uint32_t len;
+    uint64_t hash;
+
+    if (!normalize(expr, key, &len, &hash)) {
+        size_t capacity = strlen(expr) + 1;
+        if (long_code.size() < capacity)
+            long_code.resize(capacity);
+        compile(expr, compiled, &long_code[0], capacity, false);
+        return true;
+    }
+    if (!cache.lookup(key, len, hash, compiled) &&
+            compile(key, compiled, compiled->inline_code, MAX_INLINE_CODE,
+                    false))
+        cache.insert(key, len, hash, *compiled);
+    return false;
+}
+
+int CalcImpl::evalExpr(const char *expr, int *result) {
+    static thread_local std::vector<Instr> long_code;
+    CompiledExpr compiled;
+
+    prepare(expr, &compiled, long_code);
+    return run(compiled, result);
+}
+
+// Evaluate exprs in order, a chunk at a time: every expression of the
+// chunk is compiled (or found in the cache) first, since interning a
+// new name takes the lock, and then they run one after another. A run
+// of consecutive assignments that need the lock shares one acquisition
+// of it.
+void CalcImpl::evalBatch(const char *const *exprs, size_t n, int *results,
+                         int *ok) {
+    static thread_local std::vector<Instr> long_code;
+    CompiledExpr chunk[BATCH_CHUNK];
+    size_t i = 0;
+
+    while (i < n) {
+        size_t count = 0;
+        while (count < BATCH_CHUNK && i + count < n) {
+            // only one long expression per chunk, as they share long_code
+            bool is_long = prepare(exprs[i + count], &chunk[count],
+                                   long_code);
+            count++;
+            if (is_long)
+                break;
+        }
+
+        for (size_t j = 0; j < count; ) {
+            if (!needs_lock(chunk[j])) {
+                ok[i + j] = run(chunk[j], &results[i + j]);
+                j++;
+                continue;
+            }
+            pthread_mutex_lock(&lock);
+            do {
+                ok[i + j] = assign_locked(chunk[j], &results[i + j]);
+                j++;
+            } while (j < count && needs_lock(chunk[j]));
+            if (mode == CALC_LOCK_FLAT_COMBINING)
+                combine(); // help threads waiting on the lock
             pthread_mutex_unlock(&lock);
-            return false;
+        }
+        i += count;
+    }
+}
+
+//
+// Columnar evaluation
+//
+// The bytecode of one expression is run over a block of rows at a time:
+// every register holds COLUMN_BLOCK values, and every instruction is a
+// loop over the block. Operands are pointers, so a variable bound to a
+// column or a constant is read in place, and only arithmetic writes to
+// register storage. The loops for the four operators come in a scalar,
+// an SSE4.1 and an AVX2 version, picked by what the CPU supports.
+//
+
+// dst[i] = a[i] op b[i] for i < n. A division sets err[i] to -1 where it
+// fails (and dst[i] to 0), and leaves err alone elsewhere.
+typedef void (*ColumnKernel)(int32_t *dst, const int32_t *a,
+                             const int32_t *b, int32_t *err, size_t n);
+
+struct ColumnKernels {
+    CalcSimdLevel level;
+    ColumnKernel op[4];     // indexed by opcode - OP_ADD
+};
+
+static void add_scalar(int32_t *dst, const int32_t *a, const int32_t *b,
+                       int32_t *, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        dst[i] = wrap_add(a[i], b[i]);
+}
+
+static void sub_scalar(int32_t *dst, const int32_t *a, const int32_t *b,
+                       int32_t *, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        dst[i] = wrap_sub(a[i], b[i]);
+}
+
+static void mul_scalar(int32_t *dst, const int32_t *a, const int32_t *b,
+                       int32_t *, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        dst[i] = wrap_mul(a[i], b[i]);
+}
+
+static void div_scalar(int32_t *dst, const int32_t *a, const int32_t *b,
+                       int32_t *err, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        int q;
+        if (checked_div(a[i], b[i], &q)) {
+            dst[i] = q;
+        } else {
+            dst[i] = 0;
+            err[i] = -1;
+        }
+    }
+}
+
+static const ColumnKernels scalar_kernels = {
+    CALC_SIMD_SCALAR, { add_scalar, sub_scalar, mul_scalar, div_scalar }
+};
+
+#ifdef HAVE_X86_KERNELS
+
+// There is no integer division in SSE or AVX, but converting to double,
+// dividing and truncating is exact for 32-bit operands: a non-integer
+// quotient is at least 1/|b| away from an integer, which is more than
+// the rounding error of a double quotient below 2^31 / |b|. Lanes that
+// would fail (zero divisor, INT_MIN / -1) divide by 1 instead and are
+// flagged in err.
+
+__attribute__((target("sse4.1")))
+static void add_sse4(int32_t *dst, const int32_t *a, const int32_t *b,
+                     int32_t *err, size_t n) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i va = _mm_loadu_si128((const __m128i *) (a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *) (b + i));
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_add_epi32(va, vb));
+    }
+    add_scalar(dst + i, a + i, b + i, err + i, n - i);
+}
+
+__attribute__((target("sse4.1")))
+static void sub_sse4(int32_t *dst, const int32_t *a, const int32_t *b,
+                     int32_t *err, size_t n) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i va = _mm_loadu_si128((const __m128i *) (a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *) (b + i));
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_sub_epi32(va, vb));
+    }
+    sub_scalar(dst + i, a + i, b + i, err + i, n - i);
+}
+
+__attribute__((target("sse4.1")))
+static void mul_sse4(int32_t *dst, const int32_t *a, const int32_t *b,
+                     int32_t *err, size_t n) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i va = _mm_loadu_si128((const __m128i *) (a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *) (b + i));
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_mullo_epi32(va, vb));
+    }
+    mul_scalar(dst + i, a + i, b + i, err + i, n - i);
+}
+
+__attribute__((target("sse4.1")))
+static void div_sse4(int32_t *dst, const int32_t *a, const int32_t *b,
+                     int32_t *err, size_t n) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi32(1);
+    const __m128i minus_one = _mm_set1_epi32(-1);
+    const __m128i int_min = _mm_set1_epi32(INT_MIN);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i va = _mm_loadu_si128((const __m128i *) (a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *) (b + i));
+        __m128i bad = _mm_or_si128(
+            _mm_cmpeq_epi32(vb, zero),
+            _mm_and_si128(_mm_cmpeq_epi32(va, int_min),
+                          _mm_cmpeq_epi32(vb, minus_one)));
+        vb = _mm_blendv_epi8(vb, one, bad);
+        __m128i lo = _mm_cvttpd_epi32(_mm_div_pd(_mm_cvtepi32_pd(va),
+                                                 _mm_cvtepi32_pd(vb)));
+        __m128i hi = _mm_cvttpd_epi32(_mm_div_pd(
+            _mm_cvtepi32_pd(_mm_unpackhi_epi64(va, va)),
+            _mm_cvtepi32_pd(_mm_unpackhi_epi64(vb, vb))));
+        __m128i q = _mm_andnot_si128(bad, _mm_unpacklo_epi64(lo, hi));
+        _mm_storeu_si128((__m128i *) (dst + i), q);
+        __m128i e = _mm_loadu_si128((const __m128i *) (err + i));
+        _mm_storeu_si128((__m128i *) (err + i), _mm_or_si128(e, bad));
+    }
+    div_scalar(dst + i, a + i, b + i, err + i, n - i);
+}
+
+static const ColumnKernels sse4_kernels = {
+    CALC_SIMD_SSE4, { add_sse4, sub_sse4, mul_sse4, div_sse4 }
+};
+
+__attribute__((target("avx2")))
+static void add_avx2(int32_t *dst, const int32_t *a, const int32_t *b,
+                     int32_t *err, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i va = _mm256_loadu_si256((const __m256i *) (a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *) (b + i));
+        _mm256_storeu_si256((__m256i *) (dst + i), _mm256_add_epi32(va, vb));
+    }
+    add_scalar(dst + i, a + i, b + i, err + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void sub_avx2(int32_t *dst, const int32_t *a, const int32_t *b,
+                     int32_t *err, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i va = _mm256_loadu_si256((const __m256i *) (a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *) (b + i));
+        _mm256_storeu_si256((__m256i *) (dst + i), _mm256_sub_epi32(va, vb));
+    }
+    sub_scalar(dst + i, a + i, b + i, err + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void mul_avx2(int32_t *dst, const int32_t *a, const int32_t *b,
+                     int32_t *err, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i va = _mm256_loadu_si256((const __m256i *) (a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *) (b + i));
+        _mm256_storeu_si256((__m256i *) (dst + i),
+                            _mm256_mullo_epi32(va, vb));
+    }
+    mul_scalar(dst + i, a + i, b + i, err + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void div_avx2(int32_t *dst, const int32_t *a, const int32_t *b,
+                     int32_t *err, size_t n) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i minus_one = _mm256_set1_epi32(-1);
+    const __m256i int_min = _mm256_set1_epi32(INT_MIN);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i va = _mm256_loadu_si256((const __m256i *) (a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *) (b + i));
+        __m256i bad = _mm256_or_si256(
+            _mm256_cmpeq_epi32(vb, zero),
+            _mm256_and_si256(_mm256_cmpeq_epi32(va, int_min),
+                             _mm256_cmpeq_epi32(vb, minus_one)));
+        vb = _mm256_blendv_epi8(vb, one, bad);
+        __m128i lo = _mm256_cvttpd_epi32(_mm256_div_pd(
+            _mm256_cvtepi32_pd(_mm256_castsi256_si128(va)),
+            _mm256_cvtepi32_pd(_mm256_castsi256_si128(vb))));
+        __m128i hi = _mm256_cvttpd_epi32(_mm256_div_pd(
+            _mm256_cvtepi32_pd(_mm256_extracti128_si256(va, 1)),
+            _mm256_cvtepi32_pd(_mm256_extracti128_si256(vb, 1))));
+        __m256i q = _mm256_andnot_si256(
+            bad, _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1));
+        _mm256_storeu_si256((__m256i *) (dst + i), q);
+        __m256i e = _mm256_loadu_si256((const __m256i *) (err + i));
+        _mm256_storeu_si256((__m256i *) (err + i), _mm256_or_si256(e, bad));
+    }
+    div_scalar(dst + i, a + i, b + i, err + i, n - i);
+}
+
+static const ColumnKernels avx2_kernels = {
+    CALC_SIMD_AVX2, { add_avx2, sub_avx2, mul_avx2, div_avx2 }
+};
+
+#endif // HAVE_X86_KERNELS
+
+// The kernels for level, or NULL if this CPU can't run them
+static const ColumnKernels *column_kernels(CalcSimdLevel level) {
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    bool avx2 = __builtin_cpu_supports("avx2");
+    bool sse4 = __builtin_cpu_supports("sse4.1");
+    switch (level) {
+    case CALC_SIMD_AUTO:
+        return avx2 ? &avx2_kernels : sse4 ? &sse4_kernels : &scalar_kernels;
+    case CALC_SIMD_AVX2:
+        return avx2 ? &avx2_kernels : NULL;
+    case CALC_SIMD_SSE4:
+        return sse4 ? &sse4_kernels : NULL;
+    default:
+        break;
+    }
+#endif
+    if (level == CALC_SIMD_AUTO || level == CALC_SIMD_SCALAR)
+        return &scalar_kernels;
+    return NULL;
+}
+
+struct CalcStatement {
+};
+
+// A prepared statement: the expression compiled once, with its
+// variables already resolved to slots, so that running it skips
+// normalizing, hashing and the cache lookup that calc_eval starts with.
+// A statement that reads a name no variable has yet is kept as text and
+// compiled again by each exec until it can be; until then it fails, as
+// reading an undefined variable does.
+class StatementImpl : public CalcStatement {
+public:
+    StatementImpl(CalcImpl *calc) : calc(calc) {}
+    // false if expr is not a valid statement
+    bool compile(const char *expr) {
+        text.assign(expr, expr + strlen(expr) + 1);
+        return build() || unresolved;
+    }
+    int exec(int *result) {
+        if (unresolved && !build())
+            return 0;
+        return calc->run(compiled, result);
+    }
+private:
+    CalcImpl *calc;
+    CompiledExpr compiled;
+    std::vector<Instr> code;
+    std::vector<char> text;     // kept while unresolved
+    bool unresolved;            // compiled, but for a name without a slot
+
+    bool build() {
+        size_t capacity = text.size();
+        code.resize(capacity);
+        unresolved = !calc->compile(text.data(), &compiled, code.data(),
+                                    capacity, false);
+        code.resize(compiled.ncode);
+        compiled.code = code.data();
+        if (!unresolved)
+            std::vector<char>().swap(text);
+        return compiled.valid;
+    }
+};
+
+struct CalcColumns {
+};
+
+class ColumnsImpl : public CalcColumns {
+public:
+    ColumnsImpl(CalcImpl *calc)
+        : calc(calc), kernels(column_kernels(CALC_SIMD_AUTO)) {}
+    bool compile(const char *expr);
+    int bind(const char *name, const int32_t *values);
+    size_t eval(size_t n, int32_t *results, int *ok);
+    bool setSimd(CalcSimdLevel level);
+private:
+    CalcImpl *calc;
+    const ColumnKernels *kernels;
+    CompiledExpr compiled;
+    std::vector<Instr> code;
+    // per instruction: the column bound to a LOADV, and a block filled
+    // with the constant operand of a K form (or an unbound variable's
+    // value while evaluating)
+    std::vector<const int32_t *> columns;
+    std::vector<int32_t> consts;
+    int32_t regs[MAX_REGS][COLUMN_BLOCK];
+    int32_t zero[COLUMN_BLOCK];
+    int32_t err[COLUMN_BLOCK];
+
+    int32_t *const_block(uint32_t pc) { return &consts[pc * COLUMN_BLOCK]; }
+    void run_block(size_t row, size_t n, int32_t *results);
+};
+
+// Operands are interned: bind() finds them by slot, and a variable
+// meant to be bound to a column is usually never assigned at all
+bool ColumnsImpl::compile(const char *expr) {
+    size_t capacity = strlen(expr) + 1;
+    code.resize(capacity);
+    calc->compile(expr, &compiled, code.data(), capacity, true);
+    if (!compiled.valid)
+        return false;
+    code.resize(compiled.ncode);
+    compiled.code = code.data();
+    columns.assign(compiled.ncode, NULL);
+    consts.assign(compiled.ncode * COLUMN_BLOCK, 0);
+    for (uint32_t pc = 0; pc < compiled.ncode; pc++) {
+        const Instr &ins = code[pc];
+        if (ins.op == OP_LOADK || (ins.op >= OP_ADDK && ins.op <= OP_RDIVK))
+            std::fill_n(const_block(pc), COLUMN_BLOCK, ins.imm);
+    }
+    memset(zero, 0, sizeof(zero));
+    return true;
+}
+
+int ColumnsImpl::bind(const char *name, const int32_t *values) {
+    int slot = calc->symbols.lookup(name, strlen(name));
+    int found = 0;
+    for (uint32_t pc = 0; slot >= 0 && pc < compiled.ncode; pc++) {
+        if (code[pc].op == OP_LOADV && code[pc].imm == slot) {
+            columns[pc] = values;
+            found = 1;
+        }
+    }
+    return found;
+}
+
+bool ColumnsImpl::setSimd(CalcSimdLevel level) {
+    const ColumnKernels *k = column_kernels(level);
+    if (k == NULL)
+        return false;
+    kernels = k;
+    return true;
+}
+
+// Evaluate rows [row, row + n) into results, flagging failures in err
+void ColumnsImpl::run_block(size_t row, size_t n, int32_t *results) {
+    const int32_t *operand[MAX_REGS];
+    for (uint32_t pc = 0; ; pc++) {
+        const Instr &ins = code[pc];
+        switch (ins.op) {
+        case OP_LOADK:
+            operand[ins.dst] = const_block(pc);
+            break;
+        case OP_LOADV:
+            operand[ins.dst] = columns[pc] ? columns[pc] + row
+                                           : const_block(pc);
+            break;
+        case OP_NEG:
+            kernels->op[OP_SUB - OP_ADD](regs[ins.dst], zero, operand[ins.a],
+                                         err, n);
+            operand[ins.dst] = regs[ins.dst];
+            break;
+        case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV:
+            kernels->op[ins.op - OP_ADD](regs[ins.dst], operand[ins.a],
+                                         operand[ins.b], err, n);
+            operand[ins.dst] = regs[ins.dst];
+            break;
+        case OP_ADDK: case OP_SUBK: case OP_MULK: case OP_DIVK:
+            kernels->op[ins.op - OP_ADDK](regs[ins.dst], operand[ins.a],
+                                          const_block(pc), err, n);
+            operand[ins.dst] = regs[ins.dst];
+            break;
+        case OP_RSUBK: case OP_RDIVK:
+            kernels->op[ins.op == OP_RSUBK ? OP_SUB - OP_ADD : OP_DIV - OP_ADD](
+                regs[ins.dst], const_block(pc), operand[ins.a], err, n);
+            operand[ins.dst] = regs[ins.dst];
+            break;
+        case OP_RET:
+            memcpy(results + row, operand[ins.a], n * sizeof(int32_t));
+            return;
         }
     }
 }
 
+size_t ColumnsImpl::eval(size_t n, int32_t *results, int *ok) {
+    // variables without a column have the same value in every row
+    for (uint32_t pc = 0; pc < compiled.ncode; pc++) {
+        if (code[pc].op != OP_LOADV || columns[pc] != NULL)
+            continue;
+        Variable &v = calc->symbols.var(code[pc].imm);
+        if (!v.defined.load(std::memory_order_acquire)) {
+            // variable is undefined: every row fails
+            memset(results, 0, n * sizeof(int32_t));
+            memset(ok, 0, n * sizeof(int));
+            return 0;
+        }
+        std::fill_n(const_block(pc), COLUMN_BLOCK,
+                    v.value.load(std::memory_order_relaxed));
+    }
+
+    size_t nok = 0;
+    for (size_t row = 0; row < n; row += COLUMN_BLOCK) {
+        size_t len = n - row < COLUMN_BLOCK ? n - row : COLUMN_BLOCK;
+        memset(err, 0, len * sizeof(int32_t));
+        run_block(row, len, results);
+        for (size_t i = 0; i < len; i++) {
+            ok[row + i] = err[i] == 0;
+            nok += err[i] == 0;
+            if (err[i] != 0)
+                results[row + i] = 0;
+        }
+    }
+    return nok;
+}
+
 extern "C" struct Calc *calc_create(void) {
-    return new CalcImpl();
+    return new CalcImpl(CALC_LOCK_MUTEX);
+}
+
+extern "C" struct Calc *calc_create_mode(enum CalcLockMode mode) {
+    return new CalcImpl(mode);
 }
 
 extern "C" void calc_destroy(struct Calc *calc) {
@@ -183,3 +1725,108 @@ extern "C" int calc_eval(struct Calc *calc, const char *expr, int *result) {
     CalcImpl *obj = static_cast<CalcImpl *>(calc);
     return obj->evalExpr(expr, result);
 }
+
+extern "C" void calc_eval_batch(struct Calc *calc, const char *const *exprs,
+                                size_t n, int *results, int *ok) {
+    CalcImpl *obj = static_cast<CalcImpl *>(calc);
+    obj->evalBatch(exprs, n, results, ok);
+}
+
+extern "C" int calc_var_id(struct Calc *calc, const char *name, size_t len) {
+    CalcImpl *obj = static_cast<CalcImpl *>(calc);
+    return obj->varId(name, len);
+}
+
+extern "C" int calc_get_var(struct Calc *calc, int id, int *value) {
+    CalcImpl *obj = static_cast<CalcImpl *>(calc);
+    return obj->getVar(id, value);
+}
+
+extern "C" int calc_set_var(struct Calc *calc, int id, int value) {
+    CalcImpl *obj = static_cast<CalcImpl *>(calc);
+    return obj->setVar(id, value);
+}
+
+extern "C" int calc_parse_int(const char *s, size_t len, int *value) {
+    bool negative = len > 0 && s[0] == '-';
+    return parse_digits(s + negative, len - negative, negative, value);
+}
+
+extern "C" size_t calc_format_int(int value, char *buf) {
+    uint32_t v = value < 0 ? 0 - (uint32_t) value : (uint32_t) value;
+    size_t len = (value < 0) + count_digits(v);
+    char *p = buf + len;
+    while (v >= 100) {
+        unsigned pair = (v % 100) * 2;
+        v /= 100;
+        p -= 2;
+        memcpy(p, digit_pairs + pair, 2);
+    }
+    if (v >= 10) {
+        p -= 2;
+        memcpy(p, digit_pairs + v * 2, 2);
+    } else {
+        *--p = (char) ('0' + v);
+    }
+    if (value < 0) buf[0] = '-';
+    return len;
+}
+
+extern "C" void calc_cache_stats(struct Calc *calc,
+                                 struct CalcCacheStats *stats) {
+    CalcImpl *obj = static_cast<CalcImpl *>(calc);
+    obj->cacheStats(stats);
+}
+
+extern "C" struct CalcColumns *calc_columns_create(struct Calc *calc,
+                                                   const char *expr) {
+    ColumnsImpl *cols = new ColumnsImpl(static_cast<CalcImpl *>(calc));
+    if (!cols->compile(expr)) {
+        delete cols;
+        return NULL;
+    }
+    return cols;
+}
+
+extern "C" void calc_columns_destroy(struct CalcColumns *cols) {
+    ColumnsImpl *obj = static_cast<ColumnsImpl *>(cols);
+    delete obj;
+}
+
+extern "C" int calc_columns_bind(struct CalcColumns *cols, const char *name,
+                                 const int32_t *values) {
+    ColumnsImpl *obj = static_cast<ColumnsImpl *>(cols);
+    return obj->bind(name, values);
+}
+
+extern "C" int calc_columns_set_simd(struct CalcColumns *cols,
+                                     enum CalcSimdLevel level) {
+    ColumnsImpl *obj = static_cast<ColumnsImpl *>(cols);
+    return obj->setSimd(level);
+}
+
+extern "C" size_t calc_columns_eval(struct CalcColumns *cols, size_t n,
+                                    int32_t *results, int *ok) {
+    ColumnsImpl *obj = static_cast<ColumnsImpl *>(cols);
+    return obj->eval(n, results, ok);
+}
+
+extern "C" struct CalcStatement *calc_statement_create(struct Calc *calc,
+                                                       const char *expr) {
+    StatementImpl *stmt = new StatementImpl(static_cast<CalcImpl *>(calc));
+    if (!stmt->compile(expr)) {
+        delete stmt;
+        return NULL;
+    }
+    return stmt;
+}
+
+extern "C" void calc_statement_destroy(struct CalcStatement *stmt) {
+    StatementImpl *obj = static_cast<StatementImpl *>(stmt);
+    delete obj;
+}
+
+extern "C" int calc_statement_exec(struct CalcStatement *stmt, int *result) {
+    StatementImpl *obj = static_cast<StatementImpl *>(stmt);
+    return obj->exec(result);
+}
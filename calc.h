@@ -2,12 +2,53 @@
 #define CALC_H
 
 /*
- * Note: you should NOT need to modify anything in this header file.
+ * calc_create, calc_destroy and calc_eval are the interface the
+ * assignment specified; everything else here extends it, and the
+ * extensions are documented where they are declared.
  */
 
+#include <stddef.h>
+#include <stdint.h>
+
 /* Forward declaration of the struct Calc data type. */
 struct Calc;
 
+/* One expression evaluated over columns of values (see calc_columns_create). */
+struct CalcColumns;
+
+/* An expression compiled once to be run many times (see calc_statement_create). */
+struct CalcStatement;
+
+/* Counters of the compiled-expression cache (see calc_cache_stats). */
+struct CalcCacheStats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+};
+
+/*
+ * How assignments that need the calculator lock are serialized
+ * (see calc_create_mode).
+ */
+enum CalcLockMode {
+	/* every thread takes the lock itself */
+	CALC_LOCK_MUTEX,
+	/*
+	 * flat combining: threads publish their assignment, and whichever
+	 * thread holds the lock applies all published assignments
+	 */
+	CALC_LOCK_FLAT_COMBINING
+};
+
+/* Vector instructions used by columnar evaluation. */
+enum CalcSimdLevel {
+	/* the best this CPU supports (the default) */
+	CALC_SIMD_AUTO,
+	CALC_SIMD_SCALAR,
+	CALC_SIMD_SSE4,
+	CALC_SIMD_AVX2
+};
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -22,6 +63,105 @@ struct Calc *calc_create(void);
 void calc_destroy(struct Calc *calc);
 int calc_eval(struct Calc *calc, const char *expr, int *result);
 
+/* Like calc_create, choosing how assignments are serialized. */
+struct Calc *calc_create_mode(enum CalcLockMode mode);
+
+/*
+ * Evaluate exprs[0..n-1] in order, with the same results as calling
+ * calc_eval on each in turn: ok[i] is set to calc_eval's return value
+ * and results[i] to the result when ok[i] is nonzero. Consecutive
+ * assignments share one acquisition of the calculator lock.
+ */
+void calc_eval_batch(struct Calc *calc, const char *const *exprs, size_t n,
+                     int *results, int *ok);
+
+/*
+ * Variables by number, for clients that name a variable once and then
+ * refer to it by its id. calc_var_id returns the id of the variable
+ * name[0..len) (letters only, not NUL-terminated), or -1 if name isn't
+ * a variable name or no variable of that name has been assigned yet
+ * (it doesn't create one). Ids are small non-negative integers that
+ * stay valid until calc is destroyed.
+ */
+int calc_var_id(struct Calc *calc, const char *name, size_t len);
+
+/*
+ * Set *value to the variable's value; returns 0 if it is undefined or
+ * id isn't an id from calc_var_id.
+ */
+int calc_get_var(struct Calc *calc, int id, int *value);
+
+/*
+ * Assign value to the variable, as "name = value" would; returns 0 if
+ * id isn't an id from calc_var_id.
+ */
+int calc_set_var(struct Calc *calc, int id, int value);
+
+/*
+ * Integer literals as the calculator reads them: s[0..len) is an
+ * optional '-' and decimal digits, leading zeros allowed. Returns 0,
+ * leaving *value alone, if there is anything else or the number is
+ * outside the range of int; it never throws or reads past s + len.
+ */
+int calc_parse_int(const char *s, size_t len, int *value);
+
+/* Longest decimal text of an int: "-2147483648" */
+#define CALC_INT_TEXT_MAX 11
+
+/*
+ * Write value in decimal at buf (which must have room for
+ * CALC_INT_TEXT_MAX bytes), without a NUL; returns the length.
+ */
+size_t calc_format_int(int value, char *buf);
+
+/*
+ * Expressions are compiled once and cached by their text (with
+ * whitespace normalized); repeated expressions skip parsing.
+ * This reports the cache's hit/miss/eviction counts so far.
+ */
+void calc_cache_stats(struct Calc *calc, struct CalcCacheStats *stats);
+
+/*
+ * Columnar evaluation: compile expr once, bind some of its variables to
+ * arrays with one value per row, and evaluate it for every row. Each
+ * row gives the same result calc_eval would if the bound variables held
+ * that row's values; unbound variables take their current value in
+ * calc. For an assignment, the right-hand side is evaluated but nothing
+ * is assigned. Returns NULL if expr is invalid.
+ */
+struct CalcColumns *calc_columns_create(struct Calc *calc, const char *expr);
+void calc_columns_destroy(struct CalcColumns *cols);
+
+/*
+ * Bind the variable name to values[0..n-1] for calc_columns_eval.
+ * Returns 0 if the expression doesn't use name.
+ */
+int calc_columns_bind(struct CalcColumns *cols, const char *name,
+                      const int32_t *values);
+
+/* Returns 0 if this CPU doesn't support level. */
+int calc_columns_set_simd(struct CalcColumns *cols, enum CalcSimdLevel level);
+
+/*
+ * Evaluate rows 0..n-1: ok[i] is set as calc_eval would return, and
+ * results[i] to the result (0 where ok[i] is 0, e.g. on division by
+ * zero). Returns the number of rows that succeeded.
+ */
+size_t calc_columns_eval(struct CalcColumns *cols, size_t n,
+                         int32_t *results, int *ok);
+
+/*
+ * Prepared statements: compile expr once, with its variables resolved,
+ * and run it any number of times with calc_statement_exec, which
+ * returns what calc_eval(calc, expr, result) would at that moment but
+ * skips parsing and the cache lookup. Returns NULL if expr is invalid.
+ * A statement must be destroyed before its calculator.
+ */
+struct CalcStatement *calc_statement_create(struct Calc *calc,
+                                            const char *expr);
+void calc_statement_destroy(struct CalcStatement *stmt);
+int calc_statement_exec(struct CalcStatement *stmt, int *result);
+
 #ifdef __cplusplus
 }
 #endif
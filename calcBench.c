@@ -0,0 +1,577 @@
+/*
+ * Benchmarks for the calculator library.
+ *
+ * Usage: ./calcBench [benchmark name]
+ * With no argument, every benchmark is run.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdint.h>
+#include "calc.h"
+#include "csapp.h"
+#include "linereader.h"
+
+typedef struct {
+	const char *name;
+	void (*run)(void);
+} Benchmark;
+
+void benchCache(void);
+void benchReadScaling(void);
+void benchIncrements(void);
+void benchCombining(void);
+void benchExprLength(void);
+void benchBatch(void);
+void benchColumns(void);
+void benchLines(void);
+void benchIntCodec(void);
+void benchPrepared(void);
+
+static const Benchmark benchmarks[] = {
+	{ "cache", benchCache },
+	{ "reads", benchReadScaling },
+	{ "incr", benchIncrements },
+	{ "combining", benchCombining },
+	{ "exprlen", benchExprLength },
+	{ "batch", benchBatch },
+	{ "columns", benchColumns },
+	{ "lines", benchLines },
+	{ "intcodec", benchIntCodec },
+	{ "prepared", benchPrepared },
+	{ NULL, NULL }
+};
+
+int main(int argc, char **argv) {
+	int found = 0;
+
+	for (const Benchmark *b = benchmarks; b->name != NULL; b++) {
+		if (argc < 2 || strcmp(argv[1], b->name) == 0) {
+			printf("== %s\n", b->name);
+			b->run();
+			found = 1;
+		}
+	}
+	if (!found) {
+		fprintf(stderr, "Unknown benchmark %s\n", argv[1]);
+		return 1;
+	}
+	return 0;
+}
+
+/* monotonic time in seconds */
+double now_sec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define CACHE_ITERS 2000000
+/* more distinct expressions than the cache can hold */
+#define COLD_EXPRS 65536
+
+void benchCache(void) {
+	struct Calc *calc = calc_create();
+	struct CalcCacheStats stats;
+	int result;
+	double start, elapsed;
+
+	calc_eval(calc, "k = 0", &result);
+
+	/* hot: one expression over and over */
+	start = now_sec();
+	for (int i = 0; i < CACHE_ITERS; i++) {
+		calc_eval(calc, "k = k + 1", &result);
+	}
+	elapsed = now_sec() - start;
+	calc_cache_stats(calc, &stats);
+	printf("hot:  %6.1f ns/eval (hits %lu, misses %lu, evictions %lu)\n",
+		elapsed * 1e9 / CACHE_ITERS, stats.hits, stats.misses, stats.evictions);
+
+	/* cold: cycle through expressions that never stay cached */
+	char (*exprs)[32] = malloc(COLD_EXPRS * sizeof(*exprs));
+	for (int i = 0; i < COLD_EXPRS; i++) {
+		snprintf(exprs[i], sizeof(exprs[i]), "k = k + %d", i);
+	}
+	start = now_sec();
+	for (int i = 0; i < CACHE_ITERS; i++) {
+		calc_eval(calc, exprs[i % COLD_EXPRS], &result);
+	}
+	elapsed = now_sec() - start;
+	struct CalcCacheStats hot = stats;
+	calc_cache_stats(calc, &stats);
+	printf("cold: %6.1f ns/eval (hits %lu, misses %lu, evictions %lu)\n",
+		elapsed * 1e9 / CACHE_ITERS, stats.hits - hot.hits,
+		stats.misses - hot.misses, stats.evictions - hot.evictions);
+
+	free(exprs);
+	calc_destroy(calc);
+}
+
+#define READ_ITERS 1000000
+
+typedef struct {
+	struct Calc *calc;
+	int *stop;
+} ReadArg;
+
+void *read_worker(void *arg) {
+	ReadArg *ra = arg;
+	int result;
+	for (int i = 0; i < READ_ITERS; i++) {
+		calc_eval(ra->calc, "a * b", &result);
+	}
+	return NULL;
+}
+
+/* keeps creating variables (and so growing the symbol table) */
+void *write_worker(void *arg) {
+	ReadArg *ra = arg;
+	char expr[32];
+	int result;
+	for (int i = 0; !__atomic_load_n(ra->stop, __ATOMIC_RELAXED); i++) {
+		snprintf(expr, sizeof(expr), "w%c%c%c%c = %d",
+			'a' + i % 26, 'a' + i / 26 % 26, 'a' + i / 676 % 26,
+			'a' + i / 17576 % 26, i);
+		calc_eval(ra->calc, expr, &result);
+	}
+	return NULL;
+}
+
+/* total read throughput with nthreads readers, optionally plus a writer */
+double read_rate(int nthreads, int with_writer) {
+	struct Calc *calc = calc_create();
+	pthread_t readers[nthreads], writer;
+	int stop = 0;
+	ReadArg arg = { calc, &stop };
+	int result;
+
+	calc_eval(calc, "a = 6", &result);
+	calc_eval(calc, "b = 7", &result);
+	if (with_writer)
+		pthread_create(&writer, NULL, write_worker, &arg);
+	double start = now_sec();
+	for (int i = 0; i < nthreads; i++)
+		pthread_create(&readers[i], NULL, read_worker, &arg);
+	for (int i = 0; i < nthreads; i++)
+		pthread_join(readers[i], NULL);
+	double elapsed = now_sec() - start;
+	if (with_writer) {
+		__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+		pthread_join(writer, NULL);
+	}
+	calc_destroy(calc);
+	return (double) nthreads * READ_ITERS / elapsed;
+}
+
+void benchReadScaling(void) {
+	int ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	printf("threads  reads/s (Mops)  with a writer (Mops)\n");
+	for (int n = 1; ; n *= 2) {
+		if (n > ncpus) n = ncpus;
+		printf("%7d  %14.2f  %20.2f\n", n,
+			read_rate(n, 0) / 1e6, read_rate(n, 1) / 1e6);
+		if (n == ncpus) break;
+	}
+}
+
+#define INCR_ITERS 500000
+
+typedef struct {
+	struct Calc *calc;
+	const char *expr;
+} IncrArg;
+
+void *incr_worker(void *arg) {
+	IncrArg *ia = arg;
+	int result;
+	for (int i = 0; i < INCR_ITERS; i++) {
+		calc_eval(ia->calc, ia->expr, &result);
+	}
+	return NULL;
+}
+
+/* increments/s with nthreads threads (one per connection in calcServer) */
+double incr_rate(int nthreads, const char *expr) {
+	struct Calc *calc = calc_create();
+	pthread_t threads[nthreads];
+	IncrArg arg = { calc, expr };
+	int result;
+
+	calc_eval(calc, "k = 0", &result);
+	calc_eval(calc, "one = 1", &result);
+	double start = now_sec();
+	for (int i = 0; i < nthreads; i++)
+		pthread_create(&threads[i], NULL, incr_worker, &arg);
+	for (int i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	double elapsed = now_sec() - start;
+	calc_destroy(calc);
+	return (double) nthreads * INCR_ITERS / elapsed;
+}
+
+void benchIncrements(void) {
+	printf("threads  k = k + 1 (Mops, atomic)  k = k + one (Mops, locked)\n");
+	for (int n = 1; n <= 16; n *= 2) {
+		printf("%7d  %24.2f  %26.2f\n", n,
+			incr_rate(n, "k = k + 1") / 1e6, incr_rate(n, "k = k + one") / 1e6);
+	}
+}
+
+#define COMBINING_ITERS 200000
+#define NAMED_EXPRS 4096
+
+/* "xyz = n" assignments like client 3 of test_server_concurrent_stress.sh */
+static char named_exprs[NAMED_EXPRS][32];
+
+typedef struct {
+	struct Calc *calc;
+	const char *incr_expr;  /* NULL: assign random variables instead */
+} CombiningArg;
+
+void *combining_worker(void *arg) {
+	CombiningArg *ca = arg;
+	int result;
+	for (int i = 0; i < COMBINING_ITERS; i++) {
+		calc_eval(ca->calc,
+			ca->incr_expr ? ca->incr_expr : named_exprs[i % NAMED_EXPRS],
+			&result);
+	}
+	return NULL;
+}
+
+/*
+ * Assignments/s with nthreads threads, two of every three of which
+ * evaluate incr_expr while the rest assign random variables.
+ */
+double combining_rate(enum CalcLockMode mode, int nthreads,
+		const char *incr_expr) {
+	struct Calc *calc = calc_create_mode(mode);
+	pthread_t threads[nthreads];
+	CombiningArg args[nthreads];
+	int result;
+
+	calc_eval(calc, "k = 0", &result);
+	calc_eval(calc, "one = 1", &result);
+	double start = now_sec();
+	for (int i = 0; i < nthreads; i++) {
+		args[i].calc = calc;
+		args[i].incr_expr = i % 3 == 2 ? NULL : incr_expr;
+		pthread_create(&threads[i], NULL, combining_worker, &args[i]);
+	}
+	for (int i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	double elapsed = now_sec() - start;
+	calc_destroy(calc);
+	return (double) nthreads * COMBINING_ITERS / elapsed;
+}
+
+void benchCombining(void) {
+	const char *incr_exprs[] = { "k = k + 1", "k = k + one" };
+
+	srand(1);
+	for (int i = 0; i < NAMED_EXPRS; i++) {
+		snprintf(named_exprs[i], sizeof(named_exprs[i]), "%c%c%c = %d",
+			'a' + rand() % 26, 'a' + rand() % 26, 'a' + rand() % 26,
+			rand() % 1000);
+	}
+
+	/* the three-client stress pattern, and a 64 connection variant */
+	const int nthreads[] = { 3, 64 };
+
+	printf("threads  increment      mutex (Mops)  flat combining (Mops)\n");
+	for (int t = 0; t < 2; t++) {
+		for (int e = 0; e < 2; e++) {
+			int n = nthreads[t];
+			printf("%7d  %-12s  %12.2f  %21.2f\n", n, incr_exprs[e],
+				combining_rate(CALC_LOCK_MUTEX, n, incr_exprs[e]) / 1e6,
+				combining_rate(CALC_LOCK_FLAT_COMBINING, n, incr_exprs[e]) / 1e6);
+		}
+	}
+}
+
+#define EXPRLEN_ITERS 500000
+
+void benchExprLength(void) {
+	struct Calc *calc = calc_create();
+	const char *operands[] = { "a", "b", "c" };
+	const char *ops[] = { " + ", " * ", " - " };
+	char expr[1024];
+	int result;
+
+	calc_eval(calc, "a = 3", &result);
+	calc_eval(calc, "b = 5", &result);
+	calc_eval(calc, "c = 7", &result);
+
+	printf("operands  chars  ns/eval\n");
+	for (int n = 1; n <= 128; n *= 2) {
+		int len = sprintf(expr, "%s", operands[0]);
+		for (int i = 1; i < n; i++)
+			len += sprintf(expr + len, "%s%s", ops[i % 3], operands[i % 3]);
+		double start = now_sec();
+		for (int i = 0; i < EXPRLEN_ITERS; i++)
+			calc_eval(calc, expr, &result);
+		double elapsed = now_sec() - start;
+		/* expressions of 64 characters or more aren't cached */
+		printf("%8d  %5d  %7.1f%s\n", n, len, elapsed * 1e9 / EXPRLEN_ITERS,
+			len < 64 ? "" : "  (not cached)");
+	}
+	calc_destroy(calc);
+}
+
+#define BATCH_MAX 4096
+/* expressions evaluated by each thread, whatever the batch size */
+#define BATCH_TOTAL 262144
+#define BATCH_THREADS 4
+
+/* three assignments that take the lock, then a read */
+static const char *batch_pattern[] = {
+	"k = k + one", "a = k * 2", "b = a - k", "b"
+};
+
+typedef struct {
+	struct Calc *calc;
+	int batch_size;  /* 0: calc_eval one at a time */
+} BatchArg;
+
+void *batch_worker(void *arg) {
+	BatchArg *ba = arg;
+	const char *exprs[BATCH_MAX];
+	static __thread int results[BATCH_MAX], ok[BATCH_MAX];
+
+	for (int i = 0; i < BATCH_MAX; i++)
+		exprs[i] = batch_pattern[i % 4];
+	if (ba->batch_size == 0) {
+		for (int i = 0; i < BATCH_TOTAL; i++)
+			calc_eval(ba->calc, exprs[i % BATCH_MAX], &results[0]);
+		return NULL;
+	}
+	for (int i = 0; i < BATCH_TOTAL; i += ba->batch_size)
+		calc_eval_batch(ba->calc, exprs, ba->batch_size, results, ok);
+	return NULL;
+}
+
+/* expressions/s with nthreads threads evaluating batches of batch_size */
+double batch_rate(int nthreads, int batch_size) {
+	struct Calc *calc = calc_create();
+	pthread_t threads[nthreads];
+	BatchArg arg = { calc, batch_size };
+	int result;
+
+	calc_eval(calc, "k = 0", &result);
+	calc_eval(calc, "one = 1", &result);
+	double start = now_sec();
+	for (int i = 0; i < nthreads; i++)
+		pthread_create(&threads[i], NULL, batch_worker, &arg);
+	for (int i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	double elapsed = now_sec() - start;
+	calc_destroy(calc);
+	return (double) nthreads * BATCH_TOTAL / elapsed;
+}
+
+void benchBatch(void) {
+	printf("batch size  1 thread (Mexprs/s)  %d threads (Mexprs/s)\n",
+		BATCH_THREADS);
+	printf("calc_eval   %19.2f  %20.2f\n",
+		batch_rate(1, 0) / 1e6, batch_rate(BATCH_THREADS, 0) / 1e6);
+	for (int n = 1; n <= BATCH_MAX; n *= 4) {
+		printf("%10d  %19.2f  %20.2f\n", n,
+			batch_rate(1, n) / 1e6, batch_rate(BATCH_THREADS, n) / 1e6);
+	}
+}
+
+#define COLUMN_ROWS 65536
+#define COLUMN_PASSES 200
+#define ROW_ITERS 1000000
+
+void benchColumns(void) {
+	static const char *exprs[] = { "p = q * r", "q * r + q / 7 - r" };
+	static const char *levels[] = { "auto", "scalar", "sse4.1", "avx2" };
+	static int32_t q[COLUMN_ROWS], r[COLUMN_ROWS], results[COLUMN_ROWS];
+	static int ok[COLUMN_ROWS];
+	struct Calc *calc = calc_create();
+	int result;
+
+	srand(1);
+	for (int i = 0; i < COLUMN_ROWS; i++) {
+		q[i] = rand() - RAND_MAX / 2;
+		r[i] = rand() % 1000 + 1;
+	}
+	calc_eval(calc, "q = 12345", &result);
+	calc_eval(calc, "r = 678", &result);
+
+	printf("%-20s  %-10s  Melements/s\n", "expression", "kernels");
+	for (int e = 0; e < 2; e++) {
+		/* one calc_eval per row, as without columnar evaluation */
+		double start = now_sec();
+		for (int i = 0; i < ROW_ITERS; i++)
+			calc_eval(calc, exprs[e], &result);
+		double elapsed = now_sec() - start;
+		printf("%-20s  %-10s  %11.1f\n", exprs[e], "calc_eval",
+			ROW_ITERS / elapsed / 1e6);
+
+		struct CalcColumns *cols = calc_columns_create(calc, exprs[e]);
+		calc_columns_bind(cols, "q", q);
+		calc_columns_bind(cols, "r", r);
+		for (int level = CALC_SIMD_AUTO; level <= CALC_SIMD_AVX2; level++) {
+			if (!calc_columns_set_simd(cols, level))
+				continue;
+			start = now_sec();
+			for (int pass = 0; pass < COLUMN_PASSES; pass++)
+				calc_columns_eval(cols, COLUMN_ROWS, results, ok);
+			elapsed = now_sec() - start;
+			printf("%-20s  %-10s  %11.1f\n", exprs[e], levels[level],
+				(double) COLUMN_PASSES * COLUMN_ROWS / elapsed / 1e6);
+		}
+		calc_columns_destroy(cols);
+	}
+	calc_destroy(calc);
+}
+
+#define LINES_BYTES (64 << 20)
+#define LINES_PASSES 3
+
+/* a file of LINES_BYTES of lines of line_len bytes (newline included) */
+int lines_file(int line_len) {
+	char path[] = "/tmp/calcBenchXXXXXX";
+	char line[1024];
+	int fd = mkstemp(path);
+	unlink(path);
+	for (int i = 0; i < line_len - 1; i++)
+		line[i] = "k = k + 1 * 23 - "[i % 17];
+	line[line_len - 1] = '\n';
+	for (long written = 0; written < LINES_BYTES; written += line_len)
+		rio_writen(fd, line, line_len);
+	return fd;
+}
+
+/* bytes of lines read with rio_readlineb */
+long rio_lines(int fd) {
+	rio_t rio;
+	char buf[1024];
+	long total = 0;
+	ssize_t n;
+	lseek(fd, 0, SEEK_SET);
+	rio_readinitb(&rio, fd);
+	while ((n = rio_readlineb(&rio, buf, sizeof(buf))) > 0)
+		total += n;
+	return total;
+}
+
+/* bytes of lines read with a LineReader */
+long reader_lines(int fd) {
+	struct LineReader r;
+	char *line;
+	size_t len;
+	long total = 0;
+	lseek(fd, 0, SEEK_SET);
+	reader_init(&r, DEFAULT_MAX_LINE);
+	while (reader_fill(&r, fd) > 0) {
+		while (reader_next(&r, &line, &len) == FRAME_LINE)
+			total += len + 1;
+	}
+	reader_free(&r);
+	return total;
+}
+
+void benchLines(void) {
+	static const int lengths[] = { 10, 64, 512 };
+	printf("%-10s  %-14s  GB/s\n", "line bytes", "reader");
+	for (int l = 0; l < 3; l++) {
+		int fd = lines_file(lengths[l]);
+		for (int which = 0; which < 2; which++) {
+			long total = 0;
+			double start = now_sec();
+			for (int pass = 0; pass < LINES_PASSES; pass++)
+				total += which == 0 ? rio_lines(fd) : reader_lines(fd);
+			double elapsed = now_sec() - start;
+			printf("%-10d  %-14s  %5.2f\n", lengths[l],
+				which == 0 ? "rio_readlineb" : "LineReader", total / elapsed / 1e9);
+		}
+		close(fd);
+	}
+}
+
+#define CODEC_INTS 4096
+#define CODEC_PASSES 500
+
+/* Mints/s of parsing or formatting CODEC_INTS values of up to digits digits */
+void benchIntCodec(void) {
+	static char texts[CODEC_INTS][16];
+	static size_t lens[CODEC_INTS];
+	static int values[CODEC_INTS];
+	static const int digits[] = { 3, 10 };
+	char out[32];
+	long sum = 0;
+
+	printf("%-7s  %-16s  Mints/s\n", "digits", "function");
+	for (int d = 0; d < 2; d++) {
+		long range = d == 0 ? 1000 : 2147483647L;
+		srand(16);
+		for (int i = 0; i < CODEC_INTS; i++) {
+			values[i] = (int) ((((long) rand() << 16) ^ rand()) % range);
+			if (i % 2)
+				values[i] = -values[i];
+			lens[i] = snprintf(texts[i], sizeof(texts[i]), "%d", values[i]);
+		}
+		for (int f = 0; f < 5; f++) {
+			static const char *names[] = {
+				"strtol", "atoi", "calc_parse_int", "snprintf", "calc_format_int"
+			};
+			double start = now_sec();
+			for (int pass = 0; pass < CODEC_PASSES; pass++) {
+				for (int i = 0; i < CODEC_INTS; i++) {
+					int v = 0;
+					switch (f) {
+					case 0: v = (int) strtol(texts[i], NULL, 10); break;
+					case 1: v = atoi(texts[i]); break;
+					case 2: calc_parse_int(texts[i], lens[i], &v); break;
+					case 3: v = snprintf(out, sizeof(out), "%d", values[i]); break;
+					case 4: v = (int) calc_format_int(values[i], out); break;
+					}
+					sum += v;
+				}
+			}
+			double elapsed = now_sec() - start;
+			printf("%-7d  %-16s  %7.1f\n", digits[d], names[f],
+				(double) CODEC_PASSES * CODEC_INTS / elapsed / 1e6);
+		}
+	}
+	if (sum == 42)
+		printf("\n"); /* keep the results live */
+}
+
+#define PREPARED_ITERS 5000000
+
+/* ns per run of an expression by calc_eval and as a prepared statement */
+void benchPrepared(void) {
+	static const char *exprs[] = {
+		"k = k + 1", "j = 2 * (k + j) - 1", "k / 3 + j * 7 - (k - j) * 2"
+	};
+	struct Calc *calc = calc_create();
+	int result;
+
+	printf("%-30s  %9s  %9s\n", "expression", "calc_eval", "prepared");
+	for (int e = 0; e < 3; e++) {
+		calc_eval(calc, "k = 0", &result);
+		calc_eval(calc, "j = 0", &result);
+		struct CalcStatement *stmt = calc_statement_create(calc, exprs[e]);
+		double start = now_sec();
+		for (int i = 0; i < PREPARED_ITERS; i++)
+			calc_eval(calc, exprs[e], &result);
+		double eval_ns = (now_sec() - start) * 1e9 / PREPARED_ITERS;
+		start = now_sec();
+		for (int i = 0; i < PREPARED_ITERS; i++)
+			calc_statement_exec(stmt, &result);
+		double exec_ns = (now_sec() - start) * 1e9 / PREPARED_ITERS;
+		printf("%-30s  %9.1f  %9.1f\n", exprs[e], eval_ns, exec_ns);
+		calc_statement_destroy(stmt);
+	}
+	calc_destroy(calc);
+}
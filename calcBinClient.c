@@ -0,0 +1,271 @@
+/*
+ * Reference client for calcServer's binary protocol (calcproto.h).
+ *
+ * Usage: ./calcBinClient [-b count] <host> <port>
+ *
+ * Reads lines from standard input and prints what the server answers,
+ * one line per reply, just like a text connection would:
+ *
+ *   get <name>            VAR, then GET
+ *   set <name> <value>    VAR, then ASSIGN (EVAL of "name = value" if
+ *                         VAR finds no such variable yet)
+ *   shutdown              SHUTDOWN
+ *   quit                  closes the connection
+ *   anything else         EVAL of the line
+ *
+ * With -b, up to count consecutive expressions are sent together as
+ * one BATCH request instead.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include "calcproto.h"
+
+/* a request or reply frame */
+typedef struct {
+	unsigned char *data;	/* header, then opcode or status and payload */
+	size_t len, cap;
+} Frame;
+
+int server_fd;
+
+void usage(void) {
+	fprintf(stderr, "Usage: calcBinClient [-b count] <host> <port>\n");
+	exit(1);
+}
+
+void fail(const char *what) {
+	fprintf(stderr, "%s\n", what);
+	exit(1);
+}
+
+int connect_to(const char *host, const char *port) {
+	struct addrinfo hints, *list, *p;
+	int fd = -1;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &list) != 0)
+		return -1;
+	for (p = list; p != NULL; p = p->ai_next) {
+		fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(list);
+	return fd;
+}
+
+void write_all(const void *buf, size_t n) {
+	const char *p = buf;
+	while (n > 0) {
+		ssize_t sent = write(server_fd, p, n);
+		if (sent <= 0) {
+			/* a server that turned us away has said so already */
+			char reply[sizeof(CALC_BUSY_REPLY) - 1];
+			if (recv(server_fd, reply, sizeof(reply), MSG_DONTWAIT) ==
+					sizeof(reply) &&
+					memcmp(reply, CALC_BUSY_REPLY, sizeof(reply)) == 0)
+				fail("The server is busy");
+			fail("Write failed");
+		}
+		p += sent;
+		n -= sent;
+	}
+}
+
+void read_all(void *buf, size_t n) {
+	char *p = buf;
+	while (n > 0) {
+		ssize_t got = read(server_fd, p, n);
+		if (got <= 0)
+			fail("Server closed the connection");
+		p += got;
+		n -= got;
+	}
+}
+
+/* make room for n more bytes in the frame */
+void frame_reserve(Frame *f, size_t n) {
+	if (f->len + n > f->cap) {
+		f->cap = f->cap ? f->cap : 256;
+		while (f->cap < f->len + n)
+			f->cap *= 2;
+		f->data = realloc(f->data, f->cap);
+		if (f->data == NULL)
+			fail("Out of memory");
+	}
+}
+
+/* add n bytes at data to the frame */
+void frame_add(Frame *f, const void *data, size_t n) {
+	frame_reserve(f, n);
+	memcpy(f->data + f->len, data, n);
+	f->len += n;
+}
+
+/* start a request with opcode op */
+void frame_start(Frame *f, int op) {
+	unsigned char header[CALC_FRAME_HEADER + 1];
+	f->len = 0;
+	frame_add(f, header, calc_put_header(header, 0, op));
+}
+
+/* fill in the length of a request and send it */
+void frame_send(Frame *f) {
+	calc_put_u32(f->data, f->len - CALC_FRAME_HEADER);
+	write_all(f->data, f->len);
+}
+
+/* read a reply into f; returns its status */
+int frame_receive(Frame *f) {
+	unsigned char header[CALC_FRAME_HEADER];
+	read_all(header, CALC_FRAME_HEADER);
+	if (memcmp(header, CALC_BUSY_REPLY, CALC_FRAME_HEADER) == 0)
+		fail("The server is busy");
+	uint32_t len = calc_get_u32(header);
+	if (len == 0)
+		fail("Bad reply");
+	f->len = 0;
+	frame_add(f, header, CALC_FRAME_HEADER);
+	frame_reserve(f, len);
+	read_all(f->data + CALC_FRAME_HEADER, len);
+	f->len += len;
+	if (f->data[CALC_FRAME_HEADER] == CALC_BAD_FRAME)
+		fail("The server refused a request");
+	return f->data[CALC_FRAME_HEADER];
+}
+
+/* the i32 of a reply to EVAL, GET, ASSIGN or VAR */
+int32_t reply_value(const Frame *f) {
+	return (int32_t) calc_get_u32(f->data + CALC_FRAME_HEADER + 1);
+}
+
+/* send a request whose reply carries a value, and print the reply */
+void value_request(Frame *f) {
+	frame_send(f);
+	if (frame_receive(f) == CALC_OK)
+		printf("%d\n", (int) reply_value(f));
+	else
+		printf("Error\n");
+}
+
+/* id of the variable name, or -1 if the server refuses it */
+long var_id(Frame *f, const char *name) {
+	frame_start(f, CALC_OP_VAR);
+	frame_add(f, name, strlen(name));
+	frame_send(f);
+	if (frame_receive(f) != CALC_OK)
+		return -1;
+	return (uint32_t) reply_value(f);
+}
+
+/* send the expressions of a BATCH request and print the replies */
+void batch_request(Frame *f, int count) {
+	if (count == 0)
+		return;
+	frame_send(f);
+	frame_receive(f);
+	const unsigned char *p = f->data + CALC_FRAME_HEADER + 1;
+	uint32_t n = calc_get_u32(p);
+	for (p += 4; n > 0; n--, p += 5) {
+		if (p[0] == CALC_OK)
+			printf("%d\n", (int) (int32_t) calc_get_u32(p + 1));
+		else
+			printf("Error\n");
+	}
+}
+
+int main(int argc, char **argv) {
+	int opt, batch_max = 0;
+	while ((opt = getopt(argc, argv, "b:")) != -1) {
+		if (opt == 'b' && atoi(optarg) > 0)
+			batch_max = atoi(optarg);
+		else
+			usage();
+	}
+	if (optind != argc - 2)
+		usage();
+
+	/* writes to a server that hung up fail instead of killing us */
+	signal(SIGPIPE, SIG_IGN);
+	server_fd = connect_to(argv[optind], argv[optind + 1]);
+	if (server_fd < 0)
+		fail("Could not connect");
+	unsigned char magic = CALC_PROTO_MAGIC;
+	write_all(&magic, 1);
+
+	Frame req = { NULL, 0, 0 }, batch = { NULL, 0, 0 };
+	int batched = 0;
+	char *line = NULL, name[64];
+	size_t cap = 0;
+	ssize_t len;
+	int value;
+	while ((len = getline(&line, &cap, stdin)) >= 0) {
+		if (len > 0 && line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (len > 0 && line[len - 1] == '\r')
+			line[--len] = '\0';
+		int expression = sscanf(line, "get %63s", name) != 1 &&
+			sscanf(line, "set %63s %d", name, &value) != 2 &&
+			strcmp(line, "shutdown") != 0 && strcmp(line, "quit") != 0;
+		if (batch_max > 0 && expression) {
+			if (batched == 0)
+				frame_start(&batch, CALC_OP_BATCH);
+			frame_add(&batch, line, len + 1);
+			if (++batched == batch_max) {
+				batch_request(&batch, batched);
+				batched = 0;
+			}
+			continue;
+		}
+		batch_request(&batch, batched);
+		batched = 0;
+
+		long id;
+		if (expression) {
+			frame_start(&req, CALC_OP_EVAL);
+			frame_add(&req, line, len + 1);
+			value_request(&req);
+		} else if (strcmp(line, "quit") == 0) {
+			break;
+		} else if (strcmp(line, "shutdown") == 0) {
+			frame_start(&req, CALC_OP_SHUTDOWN);
+			frame_send(&req);
+			break;
+		} else if ((id = var_id(&req, name)) < 0 && line[0] == 's') {
+			/* VAR only finds variables: create it by assigning it */
+			char assign[96];
+			frame_start(&req, CALC_OP_EVAL);
+			frame_add(&req, assign, snprintf(assign, sizeof(assign),
+				"%s = %d", name, value) + 1);
+			value_request(&req);
+		} else if (id < 0) {
+			printf("Error\n");
+		} else {
+			unsigned char payload[8];
+			calc_put_u32(payload, id);
+			calc_put_u32(payload + 4, (uint32_t) value);
+			frame_start(&req, line[0] == 'g' ? CALC_OP_GET : CALC_OP_ASSIGN);
+			frame_add(&req, payload, line[0] == 'g' ? 4 : 8);
+			value_request(&req);
+		}
+	}
+	batch_request(&batch, batched);
+
+	free(line);
+	free(req.data);
+	free(batch.data);
+	close(server_fd);
+	return 0;
+}
@@ -0,0 +1,164 @@
+/*
+ * Throughput of calcServer through the client library (calc_client.h).
+ *
+ * Usage: ./calcClientBench [-S] [-c threads] [-d seconds] [-e expression]
+ *                          [-P depth] <host> <port>
+ *
+ * Evaluates "k = 0" once, then each thread takes a connection from one
+ * shared CalcClient pool of as many connections as threads and, for
+ * the given number of seconds, submits depth copies of the -e
+ * expression (default "k = k + 1") with a callback each and waits for
+ * all of their replies, over and over. With -S, the threads call the
+ * synchronous calc_client_eval instead, one expression at a time on a
+ * connection borrowed from the pool for each. Reports replies/s,
+ * requests that failed, and the median and 99th percentile of a round
+ * trip (submitting the requests to getting the last reply).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "calc_client.h"
+
+typedef struct {
+	pthread_t thread;
+	long replies, errors;
+	double *samples;	/* round trips */
+	size_t nsamples, cap;
+} Worker;
+
+struct CalcClient *client;
+const char *expr = "k = k + 1";
+int depth = 1, sync_calls = 0;
+double end_time;
+
+/* monotonic time in seconds */
+double now_sec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int compare_doubles(const void *a, const void *b) {
+	double x = *(const double *) a, y = *(const double *) b;
+	return x < y ? -1 : x > y;
+}
+
+void usage(void) {
+	fprintf(stderr, "Usage: calcClientBench [-S] [-c threads] [-d seconds] "
+		"[-e expression] [-P depth] <host> <port>\n");
+	exit(1);
+}
+
+void add_sample(Worker *w, double t) {
+	if (w->nsamples == w->cap) {
+		w->cap = w->cap ? w->cap * 2 : 4096;
+		w->samples = realloc(w->samples, w->cap * sizeof(double));
+		if (w->samples == NULL)
+			exit(1);
+	}
+	w->samples[w->nsamples++] = t;
+}
+
+void count_reply(void *arg, int status, int value) {
+	Worker *w = arg;
+	(void) value;
+	if (status == CALC_CLIENT_OK)
+		w->replies++;
+	else
+		w->errors++;
+}
+
+void *run_worker(void *arg) {
+	Worker *w = arg;
+	int status, value;
+	struct CalcConn *conn = NULL;
+	if (!sync_calls && (conn = calc_client_acquire(client, &status)) == NULL) {
+		fprintf(stderr, "%s\n", calc_client_strerror(status));
+		exit(1);
+	}
+	while (now_sec() < end_time) {
+		double sent = now_sec();
+		if (sync_calls) {
+			count_reply(w, calc_client_eval(client, expr, &value), value);
+		} else {
+			for (int i = 0; i < depth; i++)
+				calc_conn_submit(conn, expr, count_reply, w);
+			if ((status = calc_conn_wait(conn, 0)) != CALC_CLIENT_OK) {
+				fprintf(stderr, "%s\n", calc_client_strerror(status));
+				exit(1);
+			}
+		}
+		add_sample(w, now_sec() - sent);
+	}
+	if (conn != NULL)
+		calc_client_release(client, conn);
+	return NULL;
+}
+
+int main(int argc, char **argv) {
+	int opt, nthreads = 1, seconds = 5, value;
+	while ((opt = getopt(argc, argv, "Sc:d:e:P:")) != -1) {
+		switch (opt) {
+		case 'S': sync_calls = 1; break;
+		case 'c': nthreads = atoi(optarg); break;
+		case 'd': seconds = atoi(optarg); break;
+		case 'e': expr = optarg; break;
+		case 'P': depth = atoi(optarg); break;
+		default: usage();
+		}
+	}
+	if (optind != argc - 2 || nthreads <= 0 || depth <= 0 ||
+			(sync_calls && depth != 1))
+		usage();
+
+	client = calc_client_create(argv[optind], argv[optind + 1], nthreads);
+	if (client == NULL) {
+		fprintf(stderr, "Unknown host %s\n", argv[optind]);
+		return 1;
+	}
+	int status = calc_client_eval(client, "k = 0", &value);
+	if (status != CALC_CLIENT_OK) {
+		fprintf(stderr, "Evaluating k = 0 failed: %s\n",
+			calc_client_strerror(status));
+		return 1;
+	}
+
+	Worker *workers = calloc(nthreads, sizeof(Worker));
+	double start = now_sec();
+	end_time = start + seconds;
+	for (int i = 0; i < nthreads; i++)
+		pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+	long replies = 0, errors = 0;
+	size_t nsamples = 0;
+	for (int i = 0; i < nthreads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		replies += workers[i].replies;
+		errors += workers[i].errors;
+		nsamples += workers[i].nsamples;
+	}
+	double elapsed = now_sec() - start;
+
+	double *samples = malloc((nsamples + 1) * sizeof(double));
+	size_t n = 0;
+	for (int i = 0; i < nthreads; i++) {
+		memcpy(samples + n, workers[i].samples,
+			workers[i].nsamples * sizeof(double));
+		n += workers[i].nsamples;
+		free(workers[i].samples);
+	}
+	qsort(samples, n, sizeof(double), compare_doubles);
+	printf("threads %d  depth %d%s  replies/s %.0f  errors %ld", nthreads,
+		depth, sync_calls ? " (sync)" : "", replies / elapsed, errors);
+	if (n > 0)
+		printf("  p50 %.0fus  p99 %.0fus", samples[n / 2] * 1e6,
+			samples[(size_t) (n * 0.99)] * 1e6);
+	printf("\n");
+	free(samples);
+	free(workers);
+	calc_client_destroy(client);
+	return 0;
+}
@@ -5,12 +5,10 @@
  * and tested your calc_ functions
  */
 
-#include <stdio.h>      /* for snprintf */
+#include <stdio.h>
 #include "csapp.h"      /* for rio_ functions */
 #include "calc.h"
-
-/* buffer size for reading lines of input from user */
-#define LINEBUF_SIZE 1024
+#include "linereader.h"
 
 void chat_with_client(struct Calc *calc, int infd, int outfd);
 
@@ -25,12 +23,28 @@ int main(void) {
 	return 0;
 }
 
+/* evaluate one line and print the result */
+void reply_to_line(struct Calc *calc, const char *line, int outfd) {
+	int result;
+	if (line == NULL || calc_eval(calc, line, &result) == 0) {
+		/* expression couldn't be evaluated (or the line was too long) */
+		rio_writen(outfd, "Error\n", 6);
+	} else {
+		/* output result */
+		char reply[CALC_INT_TEXT_MAX + 1];
+		size_t len = calc_format_int(result, reply);
+		reply[len++] = '\n';
+		rio_writen(outfd, reply, len);
+	}
+}
+
 void chat_with_client(struct Calc *calc, int infd, int outfd) {
-	rio_t in;
-	char linebuf[LINEBUF_SIZE];
+	struct LineReader in;
+	char *line;
+	size_t len;
+	enum FrameStatus status;
 
-	/* wrap standard input (which is file descriptor 0) */
-	rio_readinitb(&in, infd);
+	reader_init(&in, DEFAULT_MAX_LINE);
 
 	/*
 	 * Read lines of input, evaluate them as calculator expressions,
@@ -39,26 +53,22 @@ void chat_with_client(struct Calc *calc, int infd, int outfd) {
 	 */
 	int done = 0;
 	while (!done) {
-		ssize_t n = rio_readlineb(&in, linebuf, LINEBUF_SIZE);
-		if (n <= 0) {
-			/* error or end of input */
-			done = 1;
-		} else if (strcmp(linebuf, "quit\n") == 0 || strcmp(linebuf, "quit\r\n") == 0) {
-			/* quit command */
+		if (reader_fill(&in, infd) <= 0) {
+			/* error or end of input: a last line without newline */
+			status = reader_rest(&in, &line, &len);
+			if (status != FRAME_MORE)
+				reply_to_line(calc, status == FRAME_LINE ? line : NULL, outfd);
 			done = 1;
-		} else {
-			/* process input line */
-			int result;
-			if (calc_eval(calc, linebuf, &result) == 0) {
-				/* expression couldn't be evaluated */
-				rio_writen(outfd, "Error\n", 6);
+		}
+		while (!done && (status = reader_next(&in, &line, &len)) != FRAME_MORE) {
+			if (status == FRAME_LINE && strcmp(line, "quit") == 0) {
+				/* quit command */
+				done = 1;
 			} else {
-				/* output result */
-				int len = snprintf(linebuf, LINEBUF_SIZE, "%d\n", result);
-				if (len < LINEBUF_SIZE) {
-					rio_writen(outfd, linebuf, len);
-				}
+				/* process input line */
+				reply_to_line(calc, status == FRAME_LINE ? line : NULL, outfd);
 			}
 		}
 	}
+	reader_free(&in);
 }
@@ -0,0 +1,655 @@
+/*
+ * Load generator for calcServer.
+ *
+ * Usage: ./calcLoad [-s | -I] [-B] [-X] [-c connections] [-d seconds] [-e expression]
+ *                   [-i expression] [-P depth] [-p server pid]
+ *                   <host> <port> | -U socket path
+ *
+ * Opens the connections and evaluates the -i expression (default
+ * "k = 0") once. Then on each connection it sends the -e expression and
+ * waits for the reply, over and over, for the given number of seconds.
+ * With -P, it sends depth copies of the expression at once and waits
+ * for all their replies (pipelining). With -B, the connections speak
+ * the binary protocol (calcproto.h), sending EVAL requests. With -X,
+ * each connection PREPAREs the expression once and then sends
+ * "EXEC <handle>" instead.
+ * Reports replies/s, the TCP segments carrying them per reply (from
+ * TCP_INFO, so 1.000 means a packet for every reply), the median and
+ * 99th percentile latency of a round trip (sending the requests to
+ * getting the last reply), and the server's resident memory if its pid
+ * is given. Connections the server turns away (answering "Busy", or
+ * closing them before any reply) are counted as rejected and dropped;
+ * the others go on. Runs on a single thread with epoll, so that it can hold far
+ * more connections than the server has threads.
+ *
+ * With -U, the connections go to the server's AF_UNIX socket (calcServer
+ * -u) instead of a TCP port; there are no TCP segments to count then.
+ *
+ * With -s, connections are short-lived instead, like the one-shot
+ * clients of test_server.sh: each of the -c clients connects, sends
+ * "k" and "quit", waits for the server to close, and starts over.
+ * Reports connections/s.
+ *
+ * With -I, the connections stay idle instead. After the given number
+ * of seconds, another connection sends "shutdown", and it reports how
+ * long the server took to close the idle connections (giving up after
+ * IDLE_WAIT seconds) and, with -p, the server's CPU time while they were
+ * idle and when it exited.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <linux/tcp.h>
+#include "calcproto.h"
+
+#define MAX_EVENTS 1024
+/* longest wait for the server to close idle connections after shutdown */
+#define IDLE_WAIT 10
+/* connections from one loopback source address (ephemeral ports run out) */
+#define CONNS_PER_SOURCE 20000
+
+/* where the server listens: a TCP port or an AF_UNIX socket */
+typedef struct {
+	struct sockaddr_storage sa;
+	socklen_t len;
+} Address;
+
+typedef struct {
+	int fd;		/* -1 once rejected */
+	int pending;	/* replies still expected */
+	int index;
+	int replied;	/* got a reply yet */
+	double sent;	/* when the outstanding requests were sent */
+	/* binary protocol: the start of a reply not read in full yet */
+	unsigned char partial[CALC_VALUE_REPLY];
+	int partial_len;
+} LoadConn;
+
+/* monotonic time in seconds */
+double now_sec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* VmRSS of process pid in kB, or -1 */
+long rss_kb(int pid) {
+	char path[64], line[256];
+	long kb = -1;
+	snprintf(path, sizeof(path), "/proc/%d/status", pid);
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "VmRSS: %ld", &kb) == 1)
+			break;
+	}
+	fclose(f);
+	return kb;
+}
+
+/* data segments received so far on the connections */
+long data_segs_in(const LoadConn *conns, int nconns) {
+	long segs = 0;
+	for (int i = 0; i < nconns; i++) {
+		struct tcp_info info;
+		socklen_t len = sizeof(info);
+		if (getsockopt(conns[i].fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0)
+			segs += info.tcpi_data_segs_in;
+	}
+	return segs;
+}
+
+/* depth copies of expr as requests, in the text or binary protocol */
+char *make_request(const char *expr, int depth, int binary, int *len) {
+	int expr_len = strlen(expr);
+	int one_len = binary ? CALC_FRAME_HEADER + 1 + expr_len + 1 : expr_len + 1;
+	char *request = malloc((size_t) one_len * depth);
+	for (int i = 0; i < depth; i++) {
+		char *p = request + (size_t) i * one_len;
+		if (binary) {
+			p += calc_put_header(p, one_len - CALC_FRAME_HEADER, CALC_OP_EVAL);
+			memcpy(p, expr, expr_len + 1);
+		} else {
+			memcpy(p, expr, expr_len);
+			p[expr_len] = '\n';
+		}
+	}
+	*len = one_len * depth;
+	return request;
+}
+
+/*
+ * Count the binary replies in buf[0..len) (which may end in the middle
+ * of one, kept in c->partial until the rest comes); returns how many
+ * there were and adds the errors to *errors
+ */
+long count_frames(LoadConn *c, const char *buf, ssize_t len, long *errors) {
+	long replies = 0;
+	for (ssize_t i = 0; i < len; i++) {
+		c->partial[c->partial_len++] = buf[i];
+		if (c->partial_len < CALC_FRAME_HEADER + 1)
+			continue;
+		uint32_t need = CALC_FRAME_HEADER + calc_get_u32(c->partial);
+		if (need > CALC_VALUE_REPLY) {
+			fprintf(stderr, "Bad reply\n");
+			exit(1);
+		}
+		if ((uint32_t) c->partial_len == need) {
+			*errors += c->partial[CALC_FRAME_HEADER] != CALC_OK;
+			replies++;
+			c->partial_len = 0;
+		}
+	}
+	return replies;
+}
+
+/* round-trip latencies in seconds */
+typedef struct {
+	double *values;
+	size_t n, cap;
+} Samples;
+
+void add_sample(Samples *s, double value) {
+	if (s->n == s->cap) {
+		s->cap = s->cap ? 2 * s->cap : 4096;
+		s->values = realloc(s->values, s->cap * sizeof(double));
+		if (s->values == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+	s->values[s->n++] = value;
+}
+
+int compare_doubles(const void *a, const void *b) {
+	double x = *(const double *) a, y = *(const double *) b;
+	return x < y ? -1 : x > y;
+}
+
+/* the p-th percentile of the samples (sorting them), 0 if none */
+double percentile(Samples *s, double p) {
+	if (s->n == 0)
+		return 0;
+	qsort(s->values, s->n, sizeof(double), compare_doubles);
+	size_t i = (size_t) (p / 100 * s->n);
+	return s->values[i < s->n ? i : s->n - 1];
+}
+
+long rejected;
+
+/* the server turned c away: stop using it */
+void reject(LoadConn *c) {
+	close(c->fd); /* also takes it out of the epoll set */
+	c->fd = -1;
+	rejected++;
+}
+
+/* whether the server's first answer on c, len bytes at buf, turns it
+   away */
+int turned_away(const LoadConn *c, const char *buf, ssize_t len) {
+	return !c->replied && (len <= 0 || buf[0] == CALC_BUSY_REPLY[0]);
+}
+
+void usage(void) {
+	fprintf(stderr, "Usage: calcLoad [-s | -I] [-c connections] [-d seconds] "
+		"[-e expression] [-i expression] [-P depth] [-p server pid] [-B] [-X] "
+		"<host> <port> | -U socket path\n");
+	exit(1);
+}
+
+/*
+ * Connect to addr. Many connections to a loopback address are spread
+ * over several source addresses, since each one only has ports for
+ * about 28000 connections to the same destination.
+ */
+int connect_to(const Address *addr, int index, int nonblocking) {
+	const struct sockaddr_in *in = (const struct sockaddr_in *) &addr->sa;
+	int fd = socket(addr->sa.ss_family,
+		SOCK_STREAM | (nonblocking ? SOCK_NONBLOCK : 0), 0);
+	if (fd < 0)
+		return -1;
+	if (addr->sa.ss_family == AF_INET &&
+			(ntohl(in->sin_addr.s_addr) >> 24) == 127) {
+		struct sockaddr_in src;
+		int one = 1;
+		memset(&src, 0, sizeof(src));
+		src.sin_family = AF_INET;
+		src.sin_addr.s_addr = htonl(0x7f000001 + index / CONNS_PER_SOURCE);
+		setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+		if (bind(fd, (struct sockaddr *) &src, sizeof(src)) < 0) {
+			close(fd);
+			return -1;
+		}
+	}
+	if (connect(fd, (const struct sockaddr *) &addr->sa, addr->len) < 0 &&
+			!(nonblocking && errno == EINPROGRESS)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* start a short-lived connection for client c */
+void short_start(int epfd, const Address *addr, LoadConn *c) {
+	c->fd = connect_to(addr, c->index, 1);
+	if (c->fd < 0) {
+		fprintf(stderr, "Connection failed: %s\n", strerror(errno));
+		exit(1);
+	}
+	c->pending = 1; /* the request, once connected */
+	struct epoll_event ev;
+	ev.events = EPOLLOUT | EPOLLIN;
+	ev.data.ptr = c;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+}
+
+/* connections/s of nclients one-shot clients running for seconds */
+void run_short(const Address *addr, int nclients, int seconds,
+		const char *init) {
+	static const char request[] = "k\nquit\n";
+	int epfd = epoll_create1(0);
+	LoadConn *clients = calloc(nclients, sizeof(LoadConn));
+	struct epoll_event events[MAX_EVENTS];
+	char buf[1024];
+	long done = 0, errors = 0;
+
+	int fd = connect_to(addr, 0, 0);
+	int len = snprintf(buf, sizeof(buf), "%s\nquit\n", init);
+	if (fd < 0 || write(fd, buf, len) != len || read(fd, buf, sizeof(buf)) <= 0) {
+		fprintf(stderr, "Evaluating %s failed\n", init);
+		exit(1);
+	}
+	close(fd);
+
+	for (int i = 0; i < nclients; i++) {
+		clients[i].index = i;
+		short_start(epfd, addr, &clients[i]);
+	}
+	double start = now_sec(), end = start + seconds;
+	while (now_sec() < end) {
+		int n = epoll_wait(epfd, events, MAX_EVENTS, 100);
+		for (int i = 0; i < n; i++) {
+			LoadConn *c = events[i].data.ptr;
+			if (c->pending && (events[i].events & EPOLLOUT)) {
+				/* connected */
+				if (write(c->fd, request, sizeof(request) - 1) < 0) {
+					errors++;
+				}
+				c->pending = 0;
+				struct epoll_event ev;
+				ev.events = EPOLLIN;
+				ev.data.ptr = c;
+				epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+				continue;
+			}
+			ssize_t len = read(c->fd, buf, sizeof(buf));
+			if (len > 0) {
+				errors += buf[0] == 'E';
+				continue;
+			}
+			/* the server closed after quit: next connection */
+			if (len < 0 && errno == EAGAIN)
+				continue;
+			if (len < 0)
+				errors++;
+			else
+				done++;
+			close(c->fd);
+			short_start(epfd, addr, c);
+		}
+	}
+	double elapsed = now_sec() - start;
+	printf("clients %d  connections/s %.0f  errors %ld\n",
+		nclients, done / elapsed, errors);
+	for (int i = 0; i < nclients; i++)
+		close(clients[i].fd);
+	free(clients);
+	close(epfd);
+}
+
+/* user and system CPU time of process pid in clock ticks, or -1 */
+long cpu_ticks(int pid) {
+	char path[64];
+	long utime, stime;
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+	/* the command name may contain spaces, so skip past its ')' */
+	int ok = fscanf(f, "%*d (%*[^)]) %*c %*d %*d %*d %*d %*d %*u %*u %*u "
+		"%*u %*u %ld %ld", &utime, &stime) == 2;
+	fclose(f);
+	return ok ? utime + stime : -1;
+}
+
+/* whether process pid has exited (it may still wait to be reaped) */
+int exited(int pid) {
+	char path[64], state = 'Z';
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return 1;
+	if (fscanf(f, "%*d (%*[^)]) %c", &state) != 1)
+		state = 'Z';
+	fclose(f);
+	return state == 'Z' || state == 'X';
+}
+
+/*
+ * Hold nconns idle connections for seconds, then send shutdown and
+ * time how long the server takes to close them and to exit
+ */
+void run_idle(const Address *addr, int nconns, int seconds,
+		int server_pid) {
+	int epfd = epoll_create1(0);
+	int *fds = malloc(nconns * sizeof(int));
+	struct epoll_event events[MAX_EVENTS];
+	char buf[256];
+
+	for (int i = 0; i < nconns; i++) {
+		fds[i] = connect_to(addr, i, 0);
+		if (fds[i] < 0) {
+			fprintf(stderr, "Connection %d failed: %s\n", i, strerror(errno));
+			exit(1);
+		}
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.fd = fds[i];
+		epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i], &ev);
+	}
+	/* let the server take them all in before measuring */
+	sleep(1);
+	long ticks = server_pid ? cpu_ticks(server_pid) : -1;
+	sleep(seconds);
+	if (server_pid)
+		ticks = cpu_ticks(server_pid) - ticks;
+
+	int fd = connect_to(addr, nconns, 0);
+	double start = now_sec(), closed_at = -1, exited_at = -1;
+	if (fd < 0 || write(fd, "shutdown\n", 9) != 9) {
+		fprintf(stderr, "Sending shutdown failed\n");
+		exit(1);
+	}
+	int open = nconns;
+	while (open > 0 && now_sec() < start + IDLE_WAIT) {
+		int n = epoll_wait(epfd, events, MAX_EVENTS, 100);
+		for (int i = 0; i < n; i++) {
+			if (read(events[i].data.fd, buf, sizeof(buf)) > 0)
+				continue;
+			epoll_ctl(epfd, EPOLL_CTL_DEL, events[i].data.fd, NULL);
+			open--;
+		}
+	}
+	if (open == 0)
+		closed_at = now_sec() - start;
+	/* the server may only exit once these are closed */
+	for (int i = 0; i < nconns; i++)
+		close(fds[i]);
+	close(fd);
+	while (server_pid && now_sec() < start + IDLE_WAIT) {
+		if (exited(server_pid)) {
+			exited_at = now_sec() - start;
+			break;
+		}
+		usleep(1000);
+	}
+
+	printf("connections %d", nconns);
+	if (server_pid)
+		printf("  idle CPU %.1f%%", 100.0 * ticks / sysconf(_SC_CLK_TCK) / seconds);
+	if (closed_at >= 0)
+		printf("  all closed after %.3fs", closed_at);
+	else
+		printf("  %d still open after %ds", open, IDLE_WAIT);
+	if (exited_at >= 0)
+		printf("  server exited after %.3fs", exited_at);
+	printf("\n");
+	free(fds);
+	close(epfd);
+}
+
+int main(int argc, char **argv) {
+	int nconns = 100, seconds = 5, server_pid = 0, short_lived = 0, depth = 1;
+	int binary = 0, prepared = 0, idle = 0;
+	int opt;
+	const char *expr = "k = k + 1", *init = "k = 0", *unix_path = NULL;
+
+	while ((opt = getopt(argc, argv, "sIBXc:d:e:i:P:p:U:")) != -1) {
+		switch (opt) {
+		case 's': short_lived = 1; break;
+		case 'B': binary = 1; break;
+		case 'X': prepared = 1; break;
+		case 'I': idle = 1; break;
+		case 'c': nconns = atoi(optarg); break;
+		case 'd': seconds = atoi(optarg); break;
+		case 'e': expr = optarg; break;
+		case 'i': init = optarg; break;
+		case 'P': depth = atoi(optarg); break;
+		case 'p': server_pid = atoi(optarg); break;
+		case 'U': unix_path = optarg; break;
+		default: usage();
+		}
+	}
+	if (optind != argc - (unix_path ? 0 : 2) || nconns < !idle || depth <= 0)
+		usage();
+	/* the server may hang up on connections it turns away */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* one descriptor per connection, plus a few */
+	struct rlimit rl;
+	getrlimit(RLIMIT_NOFILE, &rl);
+	if (rl.rlim_cur < (rlim_t) nconns + 64) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	Address addr;
+	memset(&addr, 0, sizeof(addr));
+	if (unix_path) {
+		struct sockaddr_un *un = (struct sockaddr_un *) &addr.sa;
+		if (strlen(unix_path) >= sizeof(un->sun_path))
+			usage();
+		un->sun_family = AF_UNIX;
+		strcpy(un->sun_path, unix_path);
+		addr.len = sizeof(*un);
+	} else {
+		struct addrinfo hints, *ai;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_STREAM;
+		if (getaddrinfo(argv[optind], argv[optind + 1], &hints, &ai) != 0) {
+			fprintf(stderr, "Unknown host %s\n", argv[optind]);
+			return 1;
+		}
+		memcpy(&addr.sa, ai->ai_addr, ai->ai_addrlen);
+		addr.len = ai->ai_addrlen;
+		freeaddrinfo(ai);
+	}
+
+	if ((short_lived || prepared) && binary)
+		usage();
+	if (idle) {
+		run_idle(&addr, nconns, seconds, server_pid);
+		return 0;
+	}
+	if (short_lived) {
+		run_short(&addr, nconns, seconds, init);
+		return 0;
+	}
+
+	int epfd = epoll_create1(0);
+	LoadConn *conns = calloc(nconns, sizeof(LoadConn));
+	double start = now_sec();
+	for (int i = 0; i < nconns; i++) {
+		conns[i].fd = connect_to(&addr, i, 0);
+		if (conns[i].fd < 0) {
+			fprintf(stderr, "Connection %d failed: %s\n", i, strerror(errno));
+			return 1;
+		}
+		unsigned char magic = CALC_PROTO_MAGIC;
+		if (binary && write(conns[i].fd, &magic, 1) != 1) {
+			reject(&conns[i]);
+			continue;
+		}
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = &conns[i];
+		epoll_ctl(epfd, EPOLL_CTL_ADD, conns[i].fd, &ev);
+	}
+	double connect_time = now_sec() - start;
+	long idle_rss = server_pid ? rss_kb(server_pid) : -1;
+
+	char buf[4096];
+	int request_len;
+	char *request = make_request(init, 1, binary, &request_len);
+	/* on the first connection that the server takes */
+	for (int i = 0; ; i++) {
+		ssize_t len = -1;
+		if (i == nconns) {
+			fprintf(stderr, "Evaluating %s failed\n", init);
+			return 1;
+		}
+		if (conns[i].fd < 0)
+			continue;
+		if (write(conns[i].fd, request, request_len) == request_len)
+			len = read(conns[i].fd, buf, sizeof(buf));
+		if (!turned_away(&conns[i], buf, len)) {
+			conns[i].replied = 1;
+			break;
+		}
+		reject(&conns[i]);
+	}
+	free(request);
+
+	char exec[64];
+	for (int i = 0; prepared && i < nconns; i++) {
+		/* a new connection's first statement gets handle 0 */
+		char *prepare;
+		if (conns[i].fd < 0)
+			continue;
+		if (asprintf(&prepare, "PREPARE %s\n", expr) < 0)
+			return 1;
+		ssize_t len = strlen(prepare);
+		if (write(conns[i].fd, prepare, len) != len)
+			len = -1;
+		else
+			len = read(conns[i].fd, buf, sizeof(buf));
+		if (turned_away(&conns[i], buf, len)) {
+			reject(&conns[i]);
+			free(prepare);
+			continue;
+		}
+		if (buf[0] == 'E') {
+			fprintf(stderr, "Preparing %s failed\n", expr);
+			return 1;
+		}
+		conns[i].replied = 1;
+		snprintf(exec, sizeof(exec), "EXEC %.*s", (int) strcspn(buf, "\n"), buf);
+		free(prepare);
+	}
+	if (prepared)
+		expr = exec;
+	request = make_request(expr, depth, binary, &request_len);
+
+	/* every connection has depth requests outstanding at all times */
+	for (int i = 0; i < nconns; i++) {
+		if (conns[i].fd < 0)
+			continue;
+		if (write(conns[i].fd, request, request_len) != request_len) {
+			if (conns[i].replied) {
+				fprintf(stderr, "Write failed\n");
+				return 1;
+			}
+			reject(&conns[i]);
+			continue;
+		}
+		conns[i].pending = depth;
+		conns[i].sent = now_sec();
+	}
+
+	struct epoll_event events[MAX_EVENTS];
+	long replies = 0, errors = 0;
+	Samples latency = { NULL, 0, 0 };
+	start = now_sec();
+	long segs = data_segs_in(conns, nconns);
+	double end = start + seconds;
+	while (now_sec() < end) {
+		int n = epoll_wait(epfd, events, MAX_EVENTS, 100);
+		for (int i = 0; i < n; i++) {
+			LoadConn *c = events[i].data.ptr;
+			if (c->fd < 0)
+				continue; /* rejected earlier in this batch of events */
+			ssize_t len = read(c->fd, buf, sizeof(buf));
+			if (len < 0 && errno == EAGAIN)
+				continue;
+			if (turned_away(c, buf, len)) {
+				reject(c);
+				continue;
+			}
+			if (len <= 0) {
+				fprintf(stderr, "Server closed a connection\n");
+				return 1;
+			}
+			c->replied = 1;
+			if (binary) {
+				long got = count_frames(c, buf, len, &errors);
+				c->pending -= got;
+				replies += got;
+			}
+			for (ssize_t j = 0; j < len && !binary; j++) {
+				if (buf[j] == '\n') {
+					c->pending--;
+					replies++;
+				} else if (buf[j] == 'E') {
+					errors++;
+				}
+			}
+			if (c->pending == 0) {
+				double t = now_sec();
+				add_sample(&latency, t - c->sent);
+				if (write(c->fd, request, request_len) != request_len) {
+					fprintf(stderr, "Write failed\n");
+					return 1;
+				}
+				c->pending = depth;
+				c->sent = t;
+			}
+		}
+	}
+	double elapsed = now_sec() - start;
+	segs = data_segs_in(conns, nconns) - segs;
+	long busy_rss = server_pid ? rss_kb(server_pid) : -1;
+
+	printf("connections %d  connect %.2fs  replies/s %.0f  segments/reply %.3f"
+		"  errors %ld  rejected %ld", nconns, connect_time, replies / elapsed,
+		replies ? (double) segs / replies : 0.0, errors, rejected);
+	printf("  p50 %.0fus  p99 %.0fus", percentile(&latency, 50) * 1e6,
+		percentile(&latency, 99) * 1e6);
+	if (server_pid)
+		printf("  server RSS idle %ld kB, loaded %ld kB", idle_rss, busy_rss);
+	printf("\n");
+
+	for (int i = 0; i < nconns; i++) {
+		if (conns[i].fd >= 0)
+			close(conns[i].fd);
+	}
+	free(conns);
+	free(request);
+	free(latency.values);
+	close(epfd);
+	return 0;
+}
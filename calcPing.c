@@ -0,0 +1,186 @@
+/*
+ * Round-trip latency of single requests to calcServer.
+ *
+ * Usage: ./calcPing [-n requests] [-e expression] [-R shared memory name]
+ *                   [-U socket path] [<host> <port>]
+ *
+ * Over each transport given (the shared-memory region of calcServer -R,
+ * its AF_UNIX socket with -U, and TCP to host and port), evaluates
+ * "k = 0" once and then sends the -e expression (default "k = k + 1")
+ * the given number of times, each time waiting for the reply before
+ * sending the next. Reports requests/s and the median and 99th
+ * percentile of the round trips for each transport.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "calcshm.h"
+
+/* requests sent before any is timed, so that every side is warm */
+#define WARMUP 1000
+
+/* one transport to measure: a socket, or a slot of the region */
+typedef struct {
+	const char *name;
+	int fd;
+	struct CalcShm *shm;
+	char buf[256];
+	size_t len;
+} Target;
+
+/* monotonic time in seconds */
+double now_sec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int compare_doubles(const void *a, const void *b) {
+	double x = *(const double *) a, y = *(const double *) b;
+	return x < y ? -1 : x > y;
+}
+
+void usage(void) {
+	fprintf(stderr, "Usage: calcPing [-n requests] [-e expression] "
+		"[-R shared memory name] [-U socket path] [<host> <port>]\n");
+	exit(1);
+}
+
+int connect_tcp(const char *host, const char *port) {
+	struct addrinfo hints, *ai;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &ai) != 0)
+		return -1;
+	int fd = socket(AF_INET, SOCK_STREAM, 0), one = 1;
+	if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(ai);
+	if (fd >= 0)
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+}
+
+int connect_unix(const char *path) {
+	struct sockaddr_un addr;
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd >= 0 && connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		close(fd);
+		fd = -1;
+	}
+	return fd;
+}
+
+/* send line (with its newline) and wait for one reply line; 0 on failure */
+int round_trip(Target *t, const char *line, size_t len) {
+	if (t->shm != NULL) {
+		char reply[64];
+		return calc_shm_send(t->shm, line, len) == (ssize_t) len &&
+			calc_shm_getline(t->shm, reply, sizeof(reply)) > 0;
+	}
+	if (write(t->fd, line, len) != (ssize_t) len)
+		return 0;
+	for (;;) {
+		char *nl = memchr(t->buf, '\n', t->len);
+		if (nl != NULL) {
+			t->len -= nl + 1 - t->buf;
+			memmove(t->buf, nl + 1, t->len);
+			return 1;
+		}
+		ssize_t got = read(t->fd, t->buf + t->len, sizeof(t->buf) - t->len);
+		if (got <= 0)
+			return 0;
+		t->len += got;
+	}
+}
+
+void measure(Target *t, const char *expr, int count) {
+	char line[256];
+	int len = snprintf(line, sizeof(line), "%s\n", expr);
+	double *samples = malloc(count * sizeof(double));
+	if (!round_trip(t, "k = 0\n", 6)) {
+		fprintf(stderr, "%s: no reply\n", t->name);
+		exit(1);
+	}
+	for (int i = 0; i < WARMUP; i++)
+		round_trip(t, line, len);
+	double start = now_sec();
+	for (int i = 0; i < count; i++) {
+		double sent = now_sec();
+		if (!round_trip(t, line, len)) {
+			fprintf(stderr, "%s: no reply\n", t->name);
+			exit(1);
+		}
+		samples[i] = now_sec() - sent;
+	}
+	double elapsed = now_sec() - start;
+	qsort(samples, count, sizeof(double), compare_doubles);
+	printf("%-4s requests/s %.0f  p50 %.1fus  p99 %.1fus\n", t->name,
+		count / elapsed, samples[count / 2] * 1e6,
+		samples[(int) (count * 0.99)] * 1e6);
+	free(samples);
+}
+
+int main(int argc, char **argv) {
+	int opt, count = 100000;
+	const char *expr = "k = k + 1", *shm_name = NULL, *unix_path = NULL;
+	while ((opt = getopt(argc, argv, "n:e:R:U:")) != -1) {
+		switch (opt) {
+		case 'n': count = atoi(optarg); break;
+		case 'e': expr = optarg; break;
+		case 'R': shm_name = optarg; break;
+		case 'U': unix_path = optarg; break;
+		default: usage();
+		}
+	}
+	if ((optind != argc && optind != argc - 2) || count <= 0 ||
+			strlen(expr) > 200)
+		usage();
+
+	if (shm_name != NULL) {
+		Target t = { "shm", -1, calc_shm_open(shm_name), "", 0 };
+		if (t.shm == NULL) {
+			perror("shared memory");
+			return 1;
+		}
+		measure(&t, expr, count);
+		calc_shm_close(t.shm);
+	}
+	if (unix_path != NULL) {
+		Target t = { "unix", connect_unix(unix_path), NULL, "", 0 };
+		if (t.fd < 0) {
+			perror("unix socket");
+			return 1;
+		}
+		measure(&t, expr, count);
+		close(t.fd);
+	}
+	if (optind == argc - 2) {
+		Target t = { "tcp", connect_tcp(argv[optind], argv[optind + 1]),
+			NULL, "", 0 };
+		if (t.fd < 0) {
+			fprintf(stderr, "Could not connect\n");
+			return 1;
+		}
+		measure(&t, expr, count);
+		close(t.fd);
+	}
+	return 0;
+}
@@ -1,144 +1,385 @@
 // Authors:
 // Jack Zhang (jzhan237)
 // Tony Pan (jpan26)
-#include <stdio.h>      /* for snprintf */
+#include <stdio.h>
 #include "csapp.h"
 #include "calc.h"
-#include <sys/select.h>
-
-/* buffer size for reading lines of input from user */
-#define LINEBUF_SIZE 1024
+#include "server.h"
+#include <poll.h>
+#include <sys/eventfd.h>
 
 volatile int shut_down = 0;
-sem_t max_pthread;
+int shutdown_event = -1;
+volatile size_t max_line = DEFAULT_MAX_LINE;
+volatile size_t max_conns = DEFAULT_MAX_CONNS;
+volatile size_t max_output = DEFAULT_MAX_OUTPUT;
 
 // Information for a single connection
 struct ConnInfo {
   int clientfd;
   struct Calc *record;
+  struct ConnInfo *prev, *next; // in clients
+};
+
+// The connections being served, a thread each (threads mode)
+struct ClientList {
+  pthread_mutex_t lock;
+  pthread_cond_t done;          // signalled when the last one finishes
+  struct ConnInfo *head;
+  int count;
+};
+static struct ClientList clients = {
+  PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0
 };
+
 //worker thread for a single connection
 void *worker(void *arg);
 // wrapper for client-server interaction for a single connection
 void chat_with_client(struct Calc *calc, int infd, int outfd);
-// main server loop
-void server_loop(
-  int serverfd, int maxfd, struct timeval *p_timeout, struct Calc *calc);
+// main server loop: accept connections until shutdown
+void server_loop(const struct Listeners *listen, struct Calc *calc);
+// start a worker for every connection pending on listenfd
+void accept_clients(int listenfd, struct Calc *calc, int *reserve_fd);
+// wait for the connections still open, for at most grace seconds
+// (forever if grace < 0) before hanging up on them
+void drain_clients(int grace);
 // fatal error - terminate program
 void fatal() {
 	fprintf(stderr, "Error\n");
 	exit(1);
 }
 
+// How connections are served (-m on the command line)
+enum ServerMode {
+  MODE_THREADS,   // a thread per connection (default)
+  MODE_EPOLL,     // one event loop for all connections (reactor.c)
+  MODE_POOL,      // a fixed pool of worker threads (pool.c)
+  MODE_REUSEPORT, // an event loop per core, each with its own socket
+  MODE_URING      // one event loop doing its I/O through io_uring
+};
+
+void request_shutdown(void) {
+  uint64_t one = 1;
+  shut_down = 1;
+  shm_wake();
+  if (write(shutdown_event, &one, sizeof(one)) < 0) {
+    // already signalled often enough to overflow; still readable
+  }
+}
+
+// usage: calcServer [-m threads|epoll|pool|reuseport|uring] [-t pool threads]
+//                   [-n reactors] [-c cpu list] [-l max line] [-g grace]
+//                   [-C max connections] [-O max output]
+//                   [-u socket path] [-R shared memory name] [-S] <port>
 int main(int argc, char **argv) {
-  if (argc != 2) fatal(); // takes one command line argument
-  const char *port = argv[1];
-  int serverfd = open_listenfd((char*) port); // create server socket
-  if (serverfd < 0) fatal(); // creation faild
+  enum ServerMode mode = MODE_THREADS;
+  int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  int nreactors = 0;              // default: one per CPU
+  int cpus[MAX_REACTORS], ncpus = 0;
+  int stats = 0;                  // -S: report system calls (uring mode)
+  int grace = -1;                 // -g: seconds open connections get after
+                                  // a shutdown (threads mode); -1: no limit
+  const char *unix_path = NULL;   // -u: also listen on this AF_UNIX socket
+  const char *shm_name = NULL;    // -R: also serve this shared memory region
+  int opt;
+  while ((opt = getopt(argc, argv, "m:t:n:c:l:g:C:O:u:R:S")) != -1) {
+    if (opt == 'm' && strcmp(optarg, "threads") == 0) {
+      mode = MODE_THREADS;
+    } else if (opt == 'm' && strcmp(optarg, "epoll") == 0) {
+      mode = MODE_EPOLL;
+    } else if (opt == 'm' && strcmp(optarg, "pool") == 0) {
+      mode = MODE_POOL;
+    } else if (opt == 'm' && strcmp(optarg, "reuseport") == 0) {
+      mode = MODE_REUSEPORT;
+    } else if (opt == 'm' && strcmp(optarg, "uring") == 0) {
+      mode = MODE_URING;
+    } else if (opt == 'u') {
+      unix_path = optarg;
+    } else if (opt == 'R') {
+      shm_name = optarg;
+    } else if (opt == 'S') {
+      stats = 1;
+    } else if (opt == 't' && atoi(optarg) > 0) {
+      nthreads = atoi(optarg);
+    } else if (opt == 'l' && atol(optarg) > 0) {
+      max_line = atol(optarg);
+    } else if (opt == 'C' && atol(optarg) > 0) {
+      max_conns = atol(optarg);
+    } else if (opt == 'O' && atol(optarg) > 0) {
+      max_output = atol(optarg);
+    } else if (opt == 'g' && atoi(optarg) >= 0) {
+      grace = atoi(optarg);
+    } else if (opt == 'n' && atoi(optarg) > 0) {
+      nreactors = atoi(optarg);
+    } else if (opt == 'c' &&
+               (ncpus = parse_cpu_list(optarg, cpus, MAX_REACTORS)) > 0) {
+      // reactors are pinned to these in turn
+    } else {
+      fatal();
+    }
+  }
+  if (nthreads < 1) nthreads = 1;
+  if (optind != argc - 1) fatal(); // takes one port argument
+  const char *port = argv[optind];
+  shutdown_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (shutdown_event < 0) fatal();
+  // a client that disconnects before reading its replies must not
+  // kill the server: writes to it fail with EPIPE instead
+  Signal(SIGPIPE, SIG_IGN);
 
-  int max_iterms = 99999;
-  sem_init(&max_pthread,0 ,max_iterms);
+  struct Listeners listen = { { -1 }, 0 };
+  int unixfd = -1;
+  if (unix_path != NULL && (unixfd = open_unix_listenfd(unix_path)) < 0) {
+    fatal();
+  }
+  // every transport evaluates with the same Calc
   struct Calc *calc = calc_create();
-  struct timeval timeout = {1,0};
-  int maxfd = serverfd;
+  if (shm_name != NULL && shm_start(shm_name, calc) < 0) fatal();
 
-  server_loop(serverfd, maxfd, &timeout, calc);
+  if (mode == MODE_REUSEPORT) {
+    if (nreactors == 0) nreactors = ncpus > 0 ? ncpus : nthreads;
+    if (nreactors > MAX_REACTORS) nreactors = MAX_REACTORS;
+    int pinned[MAX_REACTORS];
+    for (int i = 0; i < nreactors && ncpus > 0; i++) {
+      pinned[i] = cpus[i % ncpus];
+    }
+    multi_reactor_run(port, unixfd, calc, nreactors,
+                      ncpus > 0 ? pinned : NULL);
+  } else {
+    int serverfd = open_listenfd((char*) port); // create server socket
+    if (serverfd < 0) fatal(); // creation faild
+    listen.fds[listen.n++] = serverfd;
+    if (unixfd >= 0) listen.fds[listen.n++] = unixfd;
 
-  for (int i = 1; i <= max_iterms; i++) {
-    sem_wait(&max_pthread);
+    if (mode == MODE_URING && uring_run(&listen, calc, stats) < 0) {
+      fprintf(stderr, "io_uring is not available, using epoll\n");
+      mode = MODE_EPOLL;
+    }
+    if (mode == MODE_EPOLL) {
+      reactor_run(&listen, calc);
+    } else if (mode == MODE_POOL) {
+      pool_run(&listen, calc, nthreads);
+    } else if (mode == MODE_THREADS) {
+      server_loop(&listen, calc);
+      drain_clients(grace);
+    }
+    close(serverfd);
   }
-  close(serverfd);
+  shm_stop();
   calc_destroy(calc);
-  sem_destroy(&max_pthread);
+
+  if (unixfd >= 0) {
+    close(unixfd);
+    unlink(unix_path);
+  }
+  close(shutdown_event);
   return 0;
 }
 
-void server_loop(
-  int serverfd, int maxfd, struct timeval *p_timeout, struct Calc *calc) {
-  fd_set readfds;
+void server_loop(const struct Listeners *listen, struct Calc *calc) {
+  // sleep until a connection comes or a client asks for a shutdown,
+  // then accept every pending connection
+  struct pollfd fds[MAX_LISTENERS + 1];
+  int reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  for (int i = 0; i < listen->n; i++) {
+    fds[i].fd = listen->fds[i];
+    fds[i].events = POLLIN;
+    set_nonblocking(listen->fds[i]);
+  }
+  fds[listen->n].fd = shutdown_event;
+  fds[listen->n].events = POLLIN;
   while (!shut_down) {
-    FD_SET(serverfd, &readfds);
-    select(maxfd + 1, &readfds, NULL, NULL, p_timeout);
-    if (FD_ISSET(serverfd, &readfds)) {
-      // Unblock accept client
-      int clientfd = Accept(serverfd, NULL, NULL);
-      if (clientfd < 0) {
-        fatal("Error accepting client connection");
+    if (poll(fds, listen->n + 1, -1) < 0) {
+      if (errno == EINTR) continue;
+      unix_error("poll error");
+    }
+    for (int i = 0; i < listen->n; i++) {
+      if (fds[i].revents & POLLIN) {
+        accept_clients(listen->fds[i], calc, &reserve_fd);
       }
+    }
+  }
+  if (reserve_fd >= 0) close(reserve_fd);
+}
 
-      // Construct connection info
-      struct ConnInfo *info = malloc(sizeof(struct ConnInfo));
-      info->clientfd = clientfd;
-      info->record = calc;
+void accept_clients(int listenfd, struct Calc *calc, int *reserve_fd) {
+  int clientfd;
+  while (!shut_down && (clientfd = accept_conn(listenfd, reserve_fd)) >= 0) {
+    set_blocking(clientfd); // the worker reads and writes blocking
 
-      pthread_t thr_id;
-      sem_wait(&max_pthread); // wait for resource
-      // run worker in a new thread
-      if (pthread_create(&thr_id, NULL, worker, info) != 0) {
-        fatal("pthread_create failed");
-      }
+    // Construct connection info
+    struct ConnInfo *info = malloc(sizeof(struct ConnInfo));
+    info->clientfd = clientfd;
+    info->record = calc;
+
+    pthread_mutex_lock(&clients.lock);
+    info->prev = NULL;
+    info->next = clients.head;
+    if (clients.head != NULL) clients.head->prev = info;
+    clients.head = info;
+    clients.count++;
+    pthread_mutex_unlock(&clients.lock);
+
+    // run worker in a new thread
+    pthread_t thr_id;
+    if (pthread_create(&thr_id, NULL, worker, info) != 0) {
+      // out of threads: turn this client away, not the others
+      info->record = NULL;
+      worker(info);
     }
   }
 }
 
 void *worker(void *arg) {
   struct ConnInfo *info = arg;
-  // detach thread, later we use semaphore to determine when the thread finish
-  pthread_detach(pthread_self());
+  if (info->record != NULL) {
+    // detach thread, drain_clients waits for the list to empty instead
+    pthread_detach(pthread_self());
+
+    // do actual stuff here
+    chat_with_client(info->record, info->clientfd, info->clientfd);
+  }
 
-  // do actual stuff here
-  chat_with_client(info->record, info->clientfd, info->clientfd);
+  // leave the list before closing, so that drain_clients never shuts
+  // down a descriptor that has been reused
+  pthread_mutex_lock(&clients.lock);
+  if (info->prev != NULL) info->prev->next = info->next;
+  else clients.head = info->next;
+  if (info->next != NULL) info->next->prev = info->prev;
+  if (--clients.count == 0) pthread_cond_broadcast(&clients.done);
+  pthread_mutex_unlock(&clients.lock);
 
   close(info->clientfd);
+  conn_release();
   free(info);
-  sem_post(&max_pthread);
   return NULL;
 }
 
+void drain_clients(int grace) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += grace;
+  pthread_mutex_lock(&clients.lock);
+  if (grace >= 0) {
+    while (clients.count > 0 &&
+           pthread_cond_timedwait(&clients.done, &clients.lock, &deadline) !=
+           ETIMEDOUT) {
+    }
+    // past the grace period: end the connections that are left, which
+    // wakes their threads up from any read or write with an error or EOF
+    for (struct ConnInfo *info = clients.head; info; info = info->next) {
+      shutdown(info->clientfd, SHUT_RDWR);
+    }
+  }
+  while (clients.count > 0) {
+    pthread_cond_wait(&clients.done, &clients.lock);
+  }
+  pthread_mutex_unlock(&clients.lock);
+}
+
 void chat_with_client(struct Calc *calc, int infd, int outfd) {
-  rio_t in;
-  char linebuf[LINEBUF_SIZE];
-  /* wrap input */
-  rio_readinitb(&in, infd);
+  struct ConnScratch *s = Malloc(sizeof(struct ConnScratch));
+  struct Conn *c = conn_create(outfd); // blocking, unlike the others
+  conn_scratch_init(s, calc);
 
   /*
-   * Read lines of input, evaluate them as calculator expressions,
-   * and (if evaluation was successful) print the result of each
-   * expression.
-   * 
+   * Read input, evaluate each line as a calculator expression, and
+   * (if evaluation was successful) print the result of each
+   * expression. Every complete line that one read brings in is
+   * evaluated as a batch. Replies are written once the input runs
+   * dry, or when OUTBUF_FLUSH bytes of them pile up while it keeps
+   * coming; a read that fills the buffer may leave more behind, so
+   * the next one doesn't block while replies wait.
+   *
    * quit - terminate the client
    * shutdown - terminate both the client and the server
    */
-  int done = 0;
-  while (!done) {
-    ssize_t n = rio_readlineb(&in, linebuf, LINEBUF_SIZE);
-    if (n <= 0) {
-      /* error or end of input */
-      done = 1;
-    } else if (
-      strcmp(linebuf, "shutdown\n") == 0 || 
-      strcmp(linebuf, "shutdown\r\n") == 0) {
-      /* shutdown */
-      done = 1;
-      shut_down = 1;
-    } else if (
-      strcmp(linebuf, "quit\n") == 0 || 
-      strcmp(linebuf, "quit\r\n") == 0) {
-      /* quit command */
-      done = 1;
-    } else {
-      /* process input line */
-      int result;
-      if (calc_eval(calc, linebuf, &result) == 0) {
-        /* expression couldn't be evaluated */
-        rio_writen(outfd, "Error\n", 6);
-      } else {
-        /* output result */
-        int len = snprintf(linebuf, LINEBUF_SIZE, "%d\n", result);
-        if (len < LINEBUF_SIZE) {
-          rio_writen(outfd, linebuf, len);
-        }
-      }
+  while (!c->closing) {
+    int waiting = s->replies_len > 0;
+    ssize_t n = reader_recv(&c->in, infd, waiting ? MSG_DONTWAIT : 0);
+    if (n > 0) {
+      conn_lines(s, c);
+    } else if (n == 0) {
+      conn_end_input(s, c);
+    } else if (errno == EINTR) {
+      continue;
+    } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      break; /* error */
+    }
+    if (!conn_flush(s, c, n < READER_FILL_SIZE)) break;
+  }
+
+  conn_scratch_cleanup(s);
+  free(s);
+  conn_free(c); // the caller closes the descriptor
+}
+
+enum LineAction line_action(const char *line, const char **arg) {
+  // anything else is an expression, so only these are compared; none
+  // of them is a valid expression (a lone "EXEC" is a variable)
+  switch (line[0]) {
+  case 's':
+    if (strcmp(line, "shutdown") == 0) return LINE_SHUTDOWN;
+    break;
+  case 'q':
+    if (strcmp(line, "quit") == 0) return LINE_QUIT;
+    break;
+  case 'P':
+    if (strncmp(line, "PREPARE ", 8) == 0) {
+      *arg = line + 8;
+      return LINE_PREPARE;
+    }
+    break;
+  case 'E':
+    if (strncmp(line, "EXEC ", 5) == 0) {
+      *arg = line + 5;
+      return LINE_EXEC;
+    }
+    break;
+  case 'D':
+    if (strncmp(line, "DEALLOCATE ", 11) == 0) {
+      *arg = line + 11;
+      return LINE_DEALLOCATE;
+    }
+    break;
+  case 'L':
+    if (strncmp(line, "LIMIT ", 6) == 0) {
+      *arg = line + 6;
+      return LINE_LIMIT;
+    }
+    break;
+  case 'S':
+    if (strncmp(line, "STATS ", 6) == 0) {
+      *arg = line + 6;
+      return LINE_STATS;
+    }
+    break;
+  }
+  return LINE_REPLY;
+}
+
+size_t format_reply(int ok, int value, char *reply) {
+  if (!ok) {
+    /* expression couldn't be evaluated */
+    memcpy(reply, "Error\n", 6);
+    return 6;
+  }
+  /* output result */
+  size_t len = calc_format_int(value, reply);
+  reply[len++] = '\n';
+  return len;
+}
+
+size_t eval_lines(
+  struct Calc *calc, const char *const *lines, size_t n, char *replies) {
+  int results[BATCH_LINES], ok[BATCH_LINES];
+  size_t len = 0;
+  for (size_t start = 0; start < n; start += BATCH_LINES) {
+    size_t count = n - start < BATCH_LINES ? n - start : BATCH_LINES;
+    calc_eval_batch(calc, lines + start, count, results, ok);
+    for (size_t i = 0; i < count; i++) {
+      len += format_reply(ok[i], results[i], replies + len);
     }
   }
+  return len;
 }
@@ -1,9 +1,29 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
 #include "tctest.h"
 
 #include "calc.h"
 
+/*
+ * Counting allocator: interposes malloc so the tests can check how
+ * many heap allocations the calculator makes (operator new ends up
+ * calling malloc as well). ThreadSanitizer needs its own malloc, so
+ * allocations aren't counted in that build.
+ */
+static unsigned long num_allocs;
+
+#ifndef __SANITIZE_THREAD__
+extern void *__libc_malloc(size_t size);
+
+void *malloc(size_t size) {
+	__atomic_fetch_add(&num_allocs, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+#endif
+
 typedef struct {
 	struct Calc *calc;
 } TestObjs;
@@ -25,6 +45,26 @@ void testComputation(TestObjs *objs);
 void testComputationAndAssignment(TestObjs *objs);
 void testUpdate(TestObjs *objs);
 void testInvalidExpr(TestObjs *objs);
+void testInvalidLiteral(TestObjs *objs);
+void testNoAllocSteadyState(TestObjs *objs);
+void testCacheStats(TestObjs *objs);
+void testManyVariables(TestObjs *objs);
+void testConcurrentReadsAndWrites(TestObjs *objs);
+void testSelfUpdate(TestObjs *objs);
+void testConcurrentMixedUpdates(TestObjs *objs);
+void testFlatCombining(TestObjs *objs);
+void testPrecedence(TestObjs *objs);
+void testUnaryMinus(TestObjs *objs);
+void testLongExpression(TestObjs *objs);
+void testSyntaxErrors(TestObjs *objs);
+void testEvalBatch(TestObjs *objs);
+void testConcurrentBatches(TestObjs *objs);
+void testColumns(TestObjs *objs);
+void testColumnsErrors(TestObjs *objs);
+void testParseInt(TestObjs *objs);
+void testFormatInt(TestObjs *objs);
+void testVarIds(TestObjs *objs);
+void testStatements(TestObjs *objs);
 
 int main(void) {
 	TEST_INIT();
@@ -35,6 +75,26 @@ int main(void) {
 	TEST(testComputationAndAssignment);
 	TEST(testUpdate);
 	TEST(testInvalidExpr);
+	TEST(testInvalidLiteral);
+	TEST(testNoAllocSteadyState);
+	TEST(testCacheStats);
+	TEST(testManyVariables);
+	TEST(testConcurrentReadsAndWrites);
+	TEST(testSelfUpdate);
+	TEST(testConcurrentMixedUpdates);
+	TEST(testFlatCombining);
+	TEST(testPrecedence);
+	TEST(testUnaryMinus);
+	TEST(testLongExpression);
+	TEST(testSyntaxErrors);
+	TEST(testEvalBatch);
+	TEST(testConcurrentBatches);
+	TEST(testColumns);
+	TEST(testColumnsErrors);
+	TEST(testParseInt);
+	TEST(testFormatInt);
+	TEST(testVarIds);
+	TEST(testStatements);
 
 	TEST_FINI();
 }
@@ -138,3 +198,878 @@ void testInvalidExpr(TestObjs *objs) {
 	/* attempt to divide by 0 */
 	ASSERT(0 == calc_eval(objs->calc, "4 / 0", &result));
 }
+
+void testInvalidLiteral(TestObjs *objs) {
+	int result;
+
+	/* a lone minus sign is not an integer */
+	ASSERT(0 == calc_eval(objs->calc, "-", &result));
+	/* literal doesn't fit in an int */
+	ASSERT(0 == calc_eval(objs->calc, "99999999999", &result));
+	ASSERT(0 == calc_eval(objs->calc, "a = 1 + 99999999999", &result));
+
+	result = 0;
+	ASSERT(0 != calc_eval(objs->calc, "-2147483648", &result));
+	ASSERT(-2147483648 == (long) result);
+}
+
+void testNoAllocSteadyState(TestObjs *objs) {
+	int result;
+	unsigned long before;
+
+	ASSERT(0 != calc_eval(objs->calc, "k = 0", &result));
+	ASSERT(0 != calc_eval(objs->calc, "step = 2", &result));
+
+	/*
+	 * The first round is a warm up: it may intern names, fill the
+	 * expression cache and size per-thread buffers.
+	 */
+	before = num_allocs;
+	for (int i = 0; i <= 1000; i++) {
+		if (i == 1) before = num_allocs;
+		ASSERT(0 != calc_eval(objs->calc, "k = k + 1", &result));
+		ASSERT(0 != calc_eval(objs->calc, "k", &result));
+		ASSERT(0 != calc_eval(objs->calc, "step * k", &result));
+		ASSERT(0 != calc_eval(objs->calc, "  k   =  step  ", &result));
+		ASSERT(0 == calc_eval(objs->calc, "undefined + 1", &result));
+		ASSERT(0 == calc_eval(objs->calc, "k / 0", &result));
+	}
+	ASSERT(before == num_allocs);
+}
+
+void testCacheStats(TestObjs *objs) {
+	int result;
+	struct CalcCacheStats stats;
+	char expr[32];
+
+	ASSERT(0 != calc_eval(objs->calc, "a = 1", &result));
+	calc_cache_stats(objs->calc, &stats);
+	ASSERT(0 == stats.hits);
+	ASSERT(1 == stats.misses);
+
+	/* same expression modulo whitespace hits the cache */
+	ASSERT(0 != calc_eval(objs->calc, "a = a + 1", &result));
+	ASSERT(0 != calc_eval(objs->calc, "  a\t=  a + 1\n", &result));
+	ASSERT(3 == result);
+	calc_cache_stats(objs->calc, &stats);
+	ASSERT(1 == stats.hits);
+	ASSERT(2 == stats.misses);
+
+	/* invalid expressions are cached too, and still fail */
+	ASSERT(0 == calc_eval(objs->calc, "a +", &result));
+	ASSERT(0 == calc_eval(objs->calc, "a +", &result));
+	calc_cache_stats(objs->calc, &stats);
+	ASSERT(2 == stats.hits);
+	ASSERT(0 == stats.evictions);
+
+	/* reading a name no variable has isn't cached: it may be assigned */
+	ASSERT(0 == calc_eval(objs->calc, "b + 1", &result));
+	ASSERT(0 == calc_eval(objs->calc, "b + 1", &result));
+	calc_cache_stats(objs->calc, &stats);
+	ASSERT(2 == stats.hits);
+	ASSERT(5 == stats.misses);
+	ASSERT(0 != calc_eval(objs->calc, "b = 4", &result));
+	ASSERT(0 != calc_eval(objs->calc, "b + 1", &result));
+	ASSERT(5 == result);
+
+	/* the cache is bounded: many distinct expressions evict entries */
+	for (int i = 0; i < 10000; i++) {
+		snprintf(expr, sizeof(expr), "a + %d", i);
+		ASSERT(0 != calc_eval(objs->calc, expr, &result));
+		ASSERT(3 + i == result);
+	}
+	calc_cache_stats(objs->calc, &stats);
+	ASSERT(stats.evictions > 0);
+}
+
+/* write a letters-only variable name for n, after the given prefix */
+void make_name(char *buf, const char *prefix, int n) {
+	size_t len = strlen(prefix);
+	memcpy(buf, prefix, len);
+	do {
+		buf[len++] = 'a' + n % 26;
+		n /= 26;
+	} while (n > 0);
+	buf[len] = '\0';
+}
+
+void testManyVariables(TestObjs *objs) {
+	int result;
+	char name[64], expr[128];
+	/* short names fit in one word, long names don't */
+	const char *prefixes[] = { "p", "q", "averylongvariablename" };
+
+	for (int p = 0; p < 3; p++) {
+		for (int i = 0; i < 5000; i++) {
+			make_name(name, prefixes[p], i);
+			snprintf(expr, sizeof(expr), "%s = %d", name, i * 3 + p);
+			ASSERT(0 != calc_eval(objs->calc, expr, &result));
+		}
+	}
+	for (int p = 0; p < 3; p++) {
+		for (int i = 0; i < 5000; i++) {
+			make_name(name, prefixes[p], i);
+			result = -1;
+			ASSERT(0 != calc_eval(objs->calc, name, &result));
+			ASSERT(i * 3 + p == result);
+		}
+	}
+
+	/* names on either side of the packing limit are distinct */
+	ASSERT(0 != calc_eval(objs->calc, "abcdefgh = 8", &result));
+	ASSERT(0 != calc_eval(objs->calc, "abcdefghi = 9", &result));
+	ASSERT(0 != calc_eval(objs->calc, "abcdefgh", &result));
+	ASSERT(8 == result);
+	ASSERT(0 != calc_eval(objs->calc, "abcdefghi", &result));
+	ASSERT(9 == result);
+	ASSERT(0 == calc_eval(objs->calc, "abcdefg", &result));
+	ASSERT(0 == calc_eval(objs->calc, "abcdefghij", &result));
+}
+
+#define STRESS_VARS 20000
+#define STRESS_INCRS 20000
+
+typedef struct {
+	struct Calc *calc;
+	int failed;
+} StressArg;
+
+static int stress_done;
+
+/* creates STRESS_VARS new variables, growing the symbol table */
+void *stress_creator(void *arg) {
+	StressArg *sa = arg;
+	char name[32], expr[64];
+	int result;
+
+	for (int i = 0; i < STRESS_VARS; i++) {
+		make_name(name, "s", i);
+		snprintf(expr, sizeof(expr), "%s = %d", name, i);
+		if (calc_eval(sa->calc, expr, &result) == 0 || result != i)
+			sa->failed = 1;
+	}
+	return NULL;
+}
+
+void *stress_incrementer(void *arg) {
+	StressArg *sa = arg;
+	int result;
+
+	for (int i = 0; i < STRESS_INCRS; i++) {
+		if (calc_eval(sa->calc, "k = k + 1", &result) == 0)
+			sa->failed = 1;
+	}
+	return NULL;
+}
+
+/* reads variables while they are being created and updated */
+void *stress_reader(void *arg) {
+	StressArg *sa = arg;
+	char name[32];
+	int result, last_k = 0;
+
+	for (int i = 0; !__atomic_load_n(&stress_done, __ATOMIC_ACQUIRE); i++) {
+		int n = (i * 7919) % STRESS_VARS;
+		make_name(name, "s", n);
+		/* either not created yet, or holds its final value */
+		if (calc_eval(sa->calc, name, &result) != 0 && result != n)
+			sa->failed = 1;
+		/* k only ever goes up */
+		if (calc_eval(sa->calc, "k", &result) == 0 || result < last_k)
+			sa->failed = 1;
+		last_k = result;
+	}
+	return NULL;
+}
+
+void testConcurrentReadsAndWrites(TestObjs *objs) {
+	void *(*workers[])(void *) = {
+		stress_creator, stress_incrementer, stress_incrementer,
+		stress_reader, stress_reader
+	};
+	const int nworkers = sizeof(workers) / sizeof(workers[0]);
+	pthread_t threads[nworkers];
+	StressArg args[nworkers];
+	char name[32];
+	int result;
+
+	ASSERT(0 != calc_eval(objs->calc, "k = 0", &result));
+	__atomic_store_n(&stress_done, 0, __ATOMIC_RELEASE);
+	for (int i = 0; i < nworkers; i++) {
+		args[i].calc = objs->calc;
+		args[i].failed = 0;
+		ASSERT(0 == pthread_create(&threads[i], NULL, workers[i], &args[i]));
+	}
+	/* writers first, then stop the readers */
+	for (int i = 0; i < 3; i++)
+		pthread_join(threads[i], NULL);
+	__atomic_store_n(&stress_done, 1, __ATOMIC_RELEASE);
+	for (int i = 3; i < nworkers; i++)
+		pthread_join(threads[i], NULL);
+
+	for (int i = 0; i < nworkers; i++)
+		ASSERT(0 == args[i].failed);
+	ASSERT(0 != calc_eval(objs->calc, "k", &result));
+	ASSERT(2 * STRESS_INCRS == result);
+	for (int i = 0; i < STRESS_VARS; i++) {
+		make_name(name, "s", i);
+		ASSERT(0 != calc_eval(objs->calc, name, &result));
+		ASSERT(i == result);
+	}
+}
+
+void testSelfUpdate(TestObjs *objs) {
+	int result;
+
+	ASSERT(0 != calc_eval(objs->calc, "x = 10", &result));
+	ASSERT(0 != calc_eval(objs->calc, "x = x - 3", &result));
+	ASSERT(7 == result);
+	ASSERT(0 != calc_eval(objs->calc, "x = 2 + x", &result));
+	ASSERT(9 == result);
+	ASSERT(0 != calc_eval(objs->calc, "x = 20 - x", &result));
+	ASSERT(11 == result);
+	ASSERT(0 != calc_eval(objs->calc, "x = x * 3", &result));
+	ASSERT(33 == result);
+	ASSERT(0 != calc_eval(objs->calc, "x = x / 2", &result));
+	ASSERT(16 == result);
+	ASSERT(0 != calc_eval(objs->calc, "x = 64 / x", &result));
+	ASSERT(4 == result);
+
+	/* failed updates leave the variable alone */
+	ASSERT(0 == calc_eval(objs->calc, "x = x / 0", &result));
+	ASSERT(0 != calc_eval(objs->calc, "x = x - 4", &result));
+	ASSERT(0 == result);
+	ASSERT(0 == calc_eval(objs->calc, "x = 5 / x", &result));
+	ASSERT(0 != calc_eval(objs->calc, "x", &result));
+	ASSERT(0 == result);
+
+	/* the variable has to exist already */
+	ASSERT(0 == calc_eval(objs->calc, "y = y + 1", &result));
+	ASSERT(0 == calc_eval(objs->calc, "y", &result));
+
+	/* arithmetic wraps around */
+	ASSERT(0 != calc_eval(objs->calc, "x = 2147483647", &result));
+	ASSERT(0 != calc_eval(objs->calc, "x = x + 1", &result));
+	ASSERT(-2147483647 - 1 == result);
+}
+
+typedef struct {
+	struct Calc *calc;
+	const char *expr;
+	int failed;
+} UpdateArg;
+
+void *stress_updater(void *arg) {
+	UpdateArg *ua = arg;
+	int result;
+
+	for (int i = 0; i < STRESS_INCRS; i++) {
+		if (calc_eval(ua->calc, ua->expr, &result) == 0)
+			ua->failed = 1;
+	}
+	return NULL;
+}
+
+/*
+ * Lock-free updates and updates under the lock of the same
+ * variable must not lose each other's increments.
+ */
+void check_mixed_updates(struct Calc *calc) {
+	const char *exprs[] = {
+		"k = k + 1", "k = 1 + k", "k = k + one", "k = k * one", "k = k - 1"
+	};
+	const int nthreads = sizeof(exprs) / sizeof(exprs[0]);
+	pthread_t threads[nthreads];
+	UpdateArg args[nthreads];
+	int result;
+
+	ASSERT(0 != calc_eval(calc, "k = 0", &result));
+	ASSERT(0 != calc_eval(calc, "one = 1", &result));
+	for (int i = 0; i < nthreads; i++) {
+		args[i].calc = calc;
+		args[i].expr = exprs[i];
+		args[i].failed = 0;
+		ASSERT(0 == pthread_create(&threads[i], NULL, stress_updater, &args[i]));
+	}
+	for (int i = 0; i < nthreads; i++) {
+		pthread_join(threads[i], NULL);
+		ASSERT(0 == args[i].failed);
+	}
+	ASSERT(0 != calc_eval(calc, "k", &result));
+	ASSERT(2 * STRESS_INCRS == result);
+}
+
+void testConcurrentMixedUpdates(TestObjs *objs) {
+	check_mixed_updates(objs->calc);
+}
+
+void testFlatCombining(TestObjs *objs) {
+	struct Calc *calc = calc_create_mode(CALC_LOCK_FLAT_COMBINING);
+	int result;
+
+	(void) objs;
+	ASSERT(0 != calc_eval(calc, "a = 4", &result));
+	ASSERT(0 != calc_eval(calc, "b = a * 3", &result));
+	ASSERT(12 == result);
+	ASSERT(0 != calc_eval(calc, "a = a + b", &result));
+	ASSERT(16 == result);
+	ASSERT(0 == calc_eval(calc, "b = a / 0", &result));
+	ASSERT(0 == calc_eval(calc, "c = d", &result));
+	ASSERT(0 != calc_eval(calc, "b", &result));
+	ASSERT(12 == result);
+
+	check_mixed_updates(calc);
+	calc_destroy(calc);
+}
+
+void testPrecedence(TestObjs *objs) {
+	int result;
+
+	ASSERT(0 != calc_eval(objs->calc, "b = 3", &result));
+	ASSERT(0 != calc_eval(objs->calc, "c = 4", &result));
+	ASSERT(0 != calc_eval(objs->calc, "d = 10", &result));
+	ASSERT(0 != calc_eval(objs->calc, "e = 1", &result));
+
+	ASSERT(0 != calc_eval(objs->calc, "a = b * c + d - e", &result));
+	ASSERT(21 == result);
+	ASSERT(0 != calc_eval(objs->calc, "d - b * c / 2", &result));
+	ASSERT(4 == result);
+	ASSERT(0 != calc_eval(objs->calc, "b * (c + d) - e", &result));
+	ASSERT(41 == result);
+	ASSERT(0 != calc_eval(objs->calc, "((d - b) - (c - e)) * 2", &result));
+	ASSERT(8 == result);
+	/* left associative */
+	ASSERT(0 != calc_eval(objs->calc, "d - b - e", &result));
+	ASSERT(6 == result);
+	ASSERT(0 != calc_eval(objs->calc, "100 / d / 5", &result));
+	ASSERT(2 == result);
+	/* whitespace is optional */
+	ASSERT(0 != calc_eval(objs->calc, "a=(b+c)*d", &result));
+	ASSERT(70 == result);
+	ASSERT(0 != calc_eval(objs->calc, "a", &result));
+	ASSERT(70 == result);
+	/* constants are folded, but division by zero still fails */
+	ASSERT(0 != calc_eval(objs->calc, "2 * 3 + 4 * 5", &result));
+	ASSERT(26 == result);
+	ASSERT(0 == calc_eval(objs->calc, "b / (c - 4)", &result));
+	ASSERT(0 == calc_eval(objs->calc, "1 + 2 / 0", &result));
+}
+
+void testUnaryMinus(TestObjs *objs) {
+	int result;
+
+	ASSERT(0 != calc_eval(objs->calc, "a = 5", &result));
+	ASSERT(0 != calc_eval(objs->calc, "-a", &result));
+	ASSERT(-5 == result);
+	ASSERT(0 != calc_eval(objs->calc, "- -a * 2", &result));
+	ASSERT(10 == result);
+	ASSERT(0 != calc_eval(objs->calc, "3 - -a", &result));
+	ASSERT(8 == result);
+	ASSERT(0 != calc_eval(objs->calc, "-(a + 1) * -2", &result));
+	ASSERT(12 == result);
+	ASSERT(0 != calc_eval(objs->calc, "b = -a", &result));
+	ASSERT(-5 == result);
+	ASSERT(0 != calc_eval(objs->calc, "- 2147483648", &result));
+	ASSERT(-2147483647 - 1 == result);
+	ASSERT(0 == calc_eval(objs->calc, "-(2147483648)", &result));
+}
+
+void testLongExpression(TestObjs *objs) {
+	char expr[2048];
+	int result, len;
+
+	/* too long to be cached */
+	ASSERT(0 != calc_eval(objs->calc, "a = 1", &result));
+	len = sprintf(expr, "a");
+	for (int i = 0; i < 200; i++)
+		len += sprintf(expr + len, " + a * 2");
+	ASSERT(0 != calc_eval(objs->calc, expr, &result));
+	ASSERT(401 == result);
+	ASSERT(0 != calc_eval(objs->calc, expr, &result));
+	ASSERT(401 == result);
+
+	/* nesting on the right needs a register per level */
+	len = 0;
+	for (int i = 0; i < 20; i++)
+		len += sprintf(expr + len, "a - (");
+	len += sprintf(expr + len, "a");
+	for (int i = 0; i < 20; i++)
+		len += sprintf(expr + len, ")");
+	ASSERT(0 != calc_eval(objs->calc, expr, &result));
+	ASSERT(1 == result);
+	len = 0;
+	for (int i = 0; i < 100; i++)
+		len += sprintf(expr + len, "a - (");
+	len += sprintf(expr + len, "a");
+	for (int i = 0; i < 100; i++)
+		len += sprintf(expr + len, ")");
+	ASSERT(0 == calc_eval(objs->calc, expr, &result));
+
+	/* parentheses and minuses that need no register nest up to a limit */
+	len = 0;
+	for (int i = 0; i < 100; i++)
+		len += sprintf(expr + len, "(-");
+	len += sprintf(expr + len, "a");
+	for (int i = 0; i < 100; i++)
+		len += sprintf(expr + len, ")");
+	ASSERT(0 != calc_eval(objs->calc, expr, &result));
+	ASSERT(1 == result);
+
+	/* and fail, rather than overflow the stack, beyond it */
+	int depth = 32700;
+	char *deep = malloc(2 * depth + 2);
+	memset(deep, '(', depth);
+	deep[depth] = '1';
+	memset(deep + depth + 1, ')', depth);
+	deep[2 * depth + 1] = '\0';
+	ASSERT(0 == calc_eval(objs->calc, deep, &result));
+	memset(deep, '-', depth);
+	deep[depth] = 'a';
+	deep[depth + 1] = '\0';
+	ASSERT(0 == calc_eval(objs->calc, deep, &result));
+	free(deep);
+}
+
+void testSyntaxErrors(TestObjs *objs) {
+	int result;
+
+	ASSERT(0 != calc_eval(objs->calc, "a = 1", &result));
+	ASSERT(0 == calc_eval(objs->calc, "", &result));
+	ASSERT(0 == calc_eval(objs->calc, "(a + 1", &result));
+	ASSERT(0 == calc_eval(objs->calc, "a + 1)", &result));
+	ASSERT(0 == calc_eval(objs->calc, "()", &result));
+	ASSERT(0 == calc_eval(objs->calc, "a a", &result));
+	ASSERT(0 == calc_eval(objs->calc, "2 * + 3", &result));
+	ASSERT(0 == calc_eval(objs->calc, "b = c = 1", &result));
+	ASSERT(0 == calc_eval(objs->calc, "b =", &result));
+	ASSERT(0 == calc_eval(objs->calc, "= 1", &result));
+	ASSERT(0 == calc_eval(objs->calc, "1 = 1", &result));
+	ASSERT(0 == calc_eval(objs->calc, "3a", &result));
+	ASSERT(0 == calc_eval(objs->calc, "a % 2", &result));
+	ASSERT(0 == calc_eval(objs->calc, "b", &result));
+}
+
+#define BATCH_LEN 100
+
+void testEvalBatch(TestObjs *objs) {
+	static const char *pattern[] = {
+		"a = 1", "b = a + 1", "a", "c = a * b + c", "c = 0",
+		"c = c + a * b", "c = c + 1", "a = a + b", "d = a / (b - 2)",
+		"e = d", "b = b + 1",
+		"a + b + c + a + b + c + a + b + c + a + b + c + a + b + c + a + b",
+		"c = a + b + c + a + b + c + a + b + c + a + b + c + a + b + c + a",
+		"b = b * 2 - a + (c - c) * a - (a - a) * b + (b - b) / 1 - 0 + 0",
+	};
+	const int npattern = sizeof(pattern) / sizeof(pattern[0]);
+	struct Calc *seq = calc_create();
+	const char *exprs[BATCH_LEN];
+	int results[BATCH_LEN], ok[BATCH_LEN];
+	int result;
+
+	for (int i = 0; i < BATCH_LEN; i++)
+		exprs[i] = pattern[(i * 5) % npattern];
+
+	/* same outcome as evaluating one at a time */
+	calc_eval_batch(objs->calc, exprs, BATCH_LEN, results, ok);
+	for (int i = 0; i < BATCH_LEN; i++) {
+		int expected_ok = calc_eval(seq, exprs[i], &result);
+		ASSERT(expected_ok == ok[i]);
+		if (ok[i])
+			ASSERT(result == results[i]);
+	}
+	ASSERT(0 != calc_eval(objs->calc, "c", &result));
+	int c = result;
+	ASSERT(0 != calc_eval(seq, "c", &result));
+	ASSERT(c == result);
+	calc_destroy(seq);
+
+	/* empty batch */
+	calc_eval_batch(objs->calc, exprs, 0, results, ok);
+
+	/* names first seen in the middle of a batch */
+	exprs[0] = "fresh = 5";
+	exprs[1] = "other = fresh + 1";
+	exprs[2] = "unset";
+	exprs[3] = "fresh = other * fresh";
+	calc_eval_batch(objs->calc, exprs, 4, results, ok);
+	ASSERT(ok[0] && 5 == results[0]);
+	ASSERT(ok[1] && 6 == results[1]);
+	ASSERT(!ok[2]);
+	ASSERT(ok[3] && 30 == results[3]);
+}
+
+#define BATCH_ROUNDS 500
+
+void *batch_updater(void *arg) {
+	UpdateArg *ua = arg;
+	const char *exprs[BATCH_LEN];
+	int results[BATCH_LEN], ok[BATCH_LEN];
+
+	/* runs of locked updates broken up by lock-free ones */
+	for (int i = 0; i < BATCH_LEN; i++)
+		exprs[i] = i % 7 == 6 ? "k = k + 1" : ua->expr;
+	for (int round = 0; round < BATCH_ROUNDS; round++) {
+		calc_eval_batch(ua->calc, exprs, BATCH_LEN, results, ok);
+		for (int i = 0; i < BATCH_LEN; i++) {
+			if (!ok[i])
+				ua->failed = 1;
+		}
+	}
+	return NULL;
+}
+
+void check_batch_updates(struct Calc *calc) {
+	const char *exprs[] = { "k = k + one", "k = one + k", "k = k + 1" };
+	const int nthreads = sizeof(exprs) / sizeof(exprs[0]);
+	pthread_t threads[nthreads];
+	UpdateArg args[nthreads], single = { calc, "k = k + one", 0 };
+	int result;
+
+	ASSERT(0 != calc_eval(calc, "k = 0", &result));
+	ASSERT(0 != calc_eval(calc, "one = 1", &result));
+	for (int i = 0; i < nthreads; i++) {
+		args[i].calc = calc;
+		args[i].expr = exprs[i];
+		args[i].failed = 0;
+		ASSERT(0 == pthread_create(&threads[i], NULL, batch_updater, &args[i]));
+	}
+	/* and this thread updating one expression at a time */
+	stress_updater(&single);
+	ASSERT(0 == single.failed);
+	for (int i = 0; i < nthreads; i++) {
+		pthread_join(threads[i], NULL);
+		ASSERT(0 == args[i].failed);
+	}
+	ASSERT(0 != calc_eval(calc, "k", &result));
+	ASSERT(nthreads * BATCH_ROUNDS * BATCH_LEN + STRESS_INCRS == result);
+}
+
+void testConcurrentBatches(TestObjs *objs) {
+	struct Calc *calc = calc_create_mode(CALC_LOCK_FLAT_COMBINING);
+
+	check_batch_updates(objs->calc);
+	check_batch_updates(calc);
+	calc_destroy(calc);
+}
+
+/* not a multiple of any vector width or of the block size */
+#define COLUMN_ROWS 1003
+
+static const char *column_exprs[] = {
+	"p = q * r", "q / r", "q - r * 3 + 7 / r", "-q / -1", "100 / q - r",
+	"q * q * q", "s + q * s", "(q + r) / (q - r)", "1 - q / 0 + r",
+};
+
+/*
+ * Every SIMD level gives exactly what calc_eval gives row by row,
+ * including which rows fail.
+ */
+void testColumns(TestObjs *objs) {
+	static int32_t q[COLUMN_ROWS], r[COLUMN_ROWS], results[COLUMN_ROWS];
+	static int ok[COLUMN_ROWS];
+	const int32_t edges[] = { 0, 1, -1, 2, -2, 7, 2147483647, -2147483647 - 1 };
+	const int nedges = sizeof(edges) / sizeof(edges[0]);
+	const int nexprs = sizeof(column_exprs) / sizeof(column_exprs[0]);
+	struct Calc *ref = calc_create();
+	char expr[64];
+	int result;
+
+	srand(42);
+	for (int i = 0; i < COLUMN_ROWS; i++) {
+		/* every pair of edge values, then random ones */
+		if (i < nedges * nedges) {
+			q[i] = edges[i / nedges];
+			r[i] = edges[i % nedges];
+		} else {
+			q[i] = (int32_t) ((unsigned) rand() * 2654435761u);
+			r[i] = i % 3 == 0 ? rand() % 21 - 10 : rand() - RAND_MAX / 2;
+		}
+	}
+	ASSERT(0 != calc_eval(objs->calc, "s = 3", &result));
+	ASSERT(0 != calc_eval(ref, "s = 3", &result));
+
+	for (int e = 0; e < nexprs; e++) {
+		struct CalcColumns *cols = calc_columns_create(objs->calc, column_exprs[e]);
+		ASSERT(cols != NULL);
+		ASSERT(1 == calc_columns_bind(cols, "q", q));
+		calc_columns_bind(cols, "r", r);
+		ASSERT(0 == calc_columns_bind(cols, "zz", r));
+
+		for (int level = CALC_SIMD_AUTO; level <= CALC_SIMD_AVX2; level++) {
+			if (!calc_columns_set_simd(cols, level))
+				continue; /* not supported by this CPU */
+			size_t nok = calc_columns_eval(cols, COLUMN_ROWS, results, ok);
+			size_t expected_nok = 0;
+			for (int i = 0; i < COLUMN_ROWS; i++) {
+				snprintf(expr, sizeof(expr), "q = %d", q[i]);
+				ASSERT(0 != calc_eval(ref, expr, &result));
+				snprintf(expr, sizeof(expr), "r = %d", r[i]);
+				ASSERT(0 != calc_eval(ref, expr, &result));
+				int expected_ok = calc_eval(ref, column_exprs[e], &result);
+				ASSERT(expected_ok == ok[i]);
+				ASSERT((expected_ok ? result : 0) == results[i]);
+				expected_nok += expected_ok != 0;
+			}
+			ASSERT(expected_nok == nok);
+		}
+		calc_columns_destroy(cols);
+	}
+	calc_destroy(ref);
+
+	/* scalar is always available */
+	struct CalcColumns *cols = calc_columns_create(objs->calc, "q");
+	ASSERT(0 != calc_columns_set_simd(cols, CALC_SIMD_SCALAR));
+	calc_columns_destroy(cols);
+}
+
+void testColumnsErrors(TestObjs *objs) {
+	int32_t q[3] = { 1, 2, 3 }, results[3];
+	int ok[3];
+	struct CalcColumns *cols;
+	int result;
+
+	ASSERT(NULL == calc_columns_create(objs->calc, "q +"));
+	ASSERT(NULL == calc_columns_create(objs->calc, "a = b = q"));
+
+	/* an unbound variable that isn't defined fails every row */
+	cols = calc_columns_create(objs->calc, "q + u");
+	ASSERT(cols != NULL);
+	calc_columns_bind(cols, "q", q);
+	ASSERT(0 == calc_columns_eval(cols, 3, results, ok));
+	ASSERT(!ok[0] && !ok[1] && !ok[2]);
+	/* until it is defined */
+	ASSERT(0 != calc_eval(objs->calc, "u = 10", &result));
+	ASSERT(3 == calc_columns_eval(cols, 3, results, ok));
+	ASSERT(11 == results[0] && 12 == results[1] && 13 == results[2]);
+	calc_columns_destroy(cols);
+
+	/* assignments aren't performed */
+	cols = calc_columns_create(objs->calc, "u = q * 2");
+	calc_columns_bind(cols, "q", q);
+	ASSERT(3 == calc_columns_eval(cols, 3, results, ok));
+	ASSERT(6 == results[2]);
+	ASSERT(0 != calc_eval(objs->calc, "u", &result));
+	ASSERT(10 == result);
+	calc_columns_destroy(cols);
+}
+
+/* calc_parse_int of the whole string s */
+int parse_str(const char *s, int *value) {
+	return calc_parse_int(s, strlen(s), value);
+}
+
+/* the values on either side of every power of ten, and the int limits */
+int boundary_values(long long *values) {
+	int n = 0;
+	for (long long p = 1; p <= 10000000000LL; p *= 10) {
+		for (long long d = -1; d <= 1; d++) {
+			values[n++] = p + d;
+			values[n++] = -(p + d);
+		}
+	}
+	values[n++] = INT_MAX;
+	values[n++] = (long long) INT_MAX + 1;
+	values[n++] = INT_MIN;
+	values[n++] = (long long) INT_MIN - 1;
+	values[n++] = 4294967296LL;
+	return n;
+}
+
+#define RANDOM_INTS 1000000
+
+void testParseInt(TestObjs *objs) {
+	long long values[80];
+	char text[32];
+	int value;
+
+	/* around every power of ten, in and out of range */
+	int n = boundary_values(values);
+	for (int i = 0; i < n; i++) {
+		snprintf(text, sizeof(text), "%lld", values[i]);
+		int fits = values[i] >= INT_MIN && values[i] <= INT_MAX;
+		value = 12345;
+		ASSERT(fits == parse_str(text, &value));
+		ASSERT(fits ? value == values[i] : value == 12345);
+	}
+
+	ASSERT(parse_str("2147483647", &value) && value == INT_MAX);
+	ASSERT(parse_str("-2147483648", &value) && value == INT_MIN);
+	ASSERT(!parse_str("2147483648", &value));
+	ASSERT(!parse_str("-2147483649", &value));
+	ASSERT(!parse_str("99999999999999999999999", &value));
+
+	/* zeros */
+	ASSERT(parse_str("-0", &value) && value == 0);
+	ASSERT(parse_str("0000", &value) && value == 0);
+	ASSERT(parse_str("007", &value) && value == 7);
+	ASSERT(parse_str("-000000000000002147483648", &value) && value == INT_MIN);
+	ASSERT(parse_str("00000000000000002147483647", &value) && value == INT_MAX);
+	ASSERT(!parse_str("00000000000000002147483648", &value));
+
+	/* not integers */
+	ASSERT(!parse_str("", &value));
+	ASSERT(!parse_str("-", &value));
+	ASSERT(!parse_str("+1", &value));
+	ASSERT(!parse_str("--1", &value));
+	ASSERT(!parse_str("1 2", &value));
+	ASSERT(!parse_str("12a", &value));
+	/* a non-digit in each position of an 8-digit block, including the
+	 * characters right before '0' and after '9' */
+	for (int pos = 0; pos < 10; pos++) {
+		for (int k = 0; k < 3; k++) {
+			strcpy(text, "1234567890");
+			text[pos] = "/:a"[k];
+			ASSERT(!parse_str(text, &value));
+		}
+	}
+
+	/* only len bytes are read */
+	ASSERT(calc_parse_int("123456789", 3, &value) && value == 123);
+	ASSERT(calc_parse_int("-12x", 3, &value) && value == -12);
+
+	/* the same as strtol for arbitrary values */
+	srand(16);
+	for (int i = 0; i < RANDOM_INTS; i++) {
+		int expected = (int) (((unsigned) rand() << 16) ^ (unsigned) rand());
+		snprintf(text, sizeof(text), "%d", expected);
+		ASSERT(parse_str(text, &value) && value == expected);
+	}
+
+	/* literals in expressions go through it as well */
+	ASSERT(0 != calc_eval(objs->calc, "a = 0002147483647", &value));
+	ASSERT(INT_MAX == value);
+	ASSERT(0 != calc_eval(objs->calc, "-0", &value));
+	ASSERT(0 == value);
+	ASSERT(0 == calc_eval(objs->calc, "12345678901", &value));
+}
+
+void testFormatInt(TestObjs *objs) {
+	long long values[80];
+	char expected[32], text[CALC_INT_TEXT_MAX + 1];
+	(void) objs;
+
+	int n = boundary_values(values);
+	for (int i = 0; i < n; i++) {
+		if (values[i] < INT_MIN || values[i] > INT_MAX)
+			continue;
+		int len = snprintf(expected, sizeof(expected), "%lld", values[i]);
+		memset(text, 'x', sizeof(text));
+		ASSERT((size_t) len == calc_format_int((int) values[i], text));
+		ASSERT(0 == memcmp(expected, text, len));
+		/* nothing is written past the number */
+		ASSERT(len == CALC_INT_TEXT_MAX || text[len] == 'x');
+	}
+
+	srand(16);
+	for (int i = 0; i < RANDOM_INTS; i++) {
+		int value = (int) (((unsigned) rand() << 16) ^ (unsigned) rand());
+		int len = snprintf(expected, sizeof(expected), "%d", value);
+		ASSERT((size_t) len == calc_format_int(value, text));
+		ASSERT(0 == memcmp(expected, text, len));
+	}
+}
+
+void testVarIds(TestObjs *objs) {
+	int result, value;
+
+	ASSERT(0 != calc_eval(objs->calc, "a = 4", &result));
+	int a = calc_var_id(objs->calc, "a", 1);
+	ASSERT(a >= 0);
+	/* the same variable, however it is named */
+	ASSERT(a == calc_var_id(objs->calc, "abc", 1));
+	ASSERT(calc_get_var(objs->calc, a, &value));
+	ASSERT(4 == value);
+
+	/* only an assignment creates a variable */
+	ASSERT(-1 == calc_var_id(objs->calc, "bravo", 5));
+	ASSERT(0 == calc_eval(objs->calc, "bravo", &result));
+	ASSERT(-1 == calc_var_id(objs->calc, "bravo", 5));
+	ASSERT(0 != calc_eval(objs->calc, "bravo = 1", &result));
+	int b = calc_var_id(objs->calc, "bravo", 5);
+	ASSERT(b >= 0 && b != a);
+
+	/* and one that fails to compile creates none */
+	ASSERT(0 == calc_eval(objs->calc, "xa = )", &result));
+	ASSERT(0 == calc_eval(objs->calc, "xb = undefined", &result));
+	ASSERT(0 == calc_eval(objs->calc, "xc = xc + 1", &result));
+	ASSERT(0 == calc_eval(objs->calc, "xd = 1 +", &result));
+	ASSERT(-1 == calc_var_id(objs->calc, "xa", 2));
+	ASSERT(-1 == calc_var_id(objs->calc, "xb", 2));
+	ASSERT(-1 == calc_var_id(objs->calc, "undefined", 9));
+	ASSERT(-1 == calc_var_id(objs->calc, "xc", 2));
+	ASSERT(-1 == calc_var_id(objs->calc, "xd", 2));
+
+	/* assigning by id is seen by expressions, and the other way around */
+	ASSERT(calc_set_var(objs->calc, b, -7));
+	ASSERT(0 != calc_eval(objs->calc, "bravo * a", &result));
+	ASSERT(-28 == result);
+	ASSERT(0 != calc_eval(objs->calc, "bravo = bravo + 1", &result));
+	ASSERT(calc_get_var(objs->calc, b, &value));
+	ASSERT(-6 == value);
+
+	/* not names */
+	ASSERT(-1 == calc_var_id(objs->calc, "", 0));
+	ASSERT(-1 == calc_var_id(objs->calc, "a1", 2));
+	ASSERT(-1 == calc_var_id(objs->calc, "a b", 3));
+
+	/* not ids */
+	ASSERT(0 == calc_get_var(objs->calc, -1, &value));
+	ASSERT(0 == calc_get_var(objs->calc, 1000000, &value));
+	ASSERT(0 == calc_set_var(objs->calc, 1000000, 1));
+}
+
+void testStatements(TestObjs *objs) {
+	int result;
+
+	ASSERT(NULL == calc_statement_create(objs->calc, "1 +"));
+	ASSERT(NULL == calc_statement_create(objs->calc, "a = = 2"));
+
+	struct CalcStatement *inc = calc_statement_create(objs->calc, "k = k + 1");
+	struct CalcStatement *twice = calc_statement_create(objs->calc, "j = 2 * (k + j)");
+	struct CalcStatement *div = calc_statement_create(objs->calc, "100 / k");
+	ASSERT(NULL != inc && NULL != twice && NULL != div);
+
+	/* k is undefined until it is assigned */
+	ASSERT(0 == calc_statement_exec(inc, &result));
+	ASSERT(0 != calc_eval(objs->calc, "k = 0", &result));
+	ASSERT(0 == calc_statement_exec(div, &result));
+	for (int i = 1; i <= 1000; i++) {
+		ASSERT(0 != calc_statement_exec(inc, &result));
+		ASSERT(i == result);
+	}
+	ASSERT(0 != calc_eval(objs->calc, "k", &result));
+	ASSERT(1000 == result);
+	ASSERT(0 != calc_statement_exec(div, &result));
+	ASSERT(0 == result);
+
+	/* an assignment that needs the lock */
+	ASSERT(0 != calc_eval(objs->calc, "j = 1", &result));
+	ASSERT(0 != calc_statement_exec(twice, &result));
+	ASSERT(2002 == result);
+	ASSERT(0 != calc_eval(objs->calc, "j", &result));
+	ASSERT(2002 == result);
+
+	/* a statement too long for the cache */
+	char expr[400] = "m = 1";
+	for (int i = 0; i < 60; i++)
+		strcat(expr, " + 1");
+	struct CalcStatement *lng = calc_statement_create(objs->calc, expr);
+	ASSERT(NULL != lng);
+	ASSERT(0 != calc_statement_exec(lng, &result));
+	ASSERT(61 == result);
+
+	/* a name no variable has yet fails until it is assigned */
+	struct CalcStatement *later = calc_statement_create(objs->calc, "nv * 2");
+	ASSERT(NULL != later);
+	ASSERT(0 == calc_statement_exec(later, &result));
+	ASSERT(0 != calc_eval(objs->calc, "nv = 21", &result));
+	ASSERT(0 != calc_statement_exec(later, &result));
+	ASSERT(42 == result);
+	ASSERT(NULL == calc_statement_create(objs->calc, "nw +"));
+
+	calc_statement_destroy(inc);
+	calc_statement_destroy(twice);
+	calc_statement_destroy(div);
+	calc_statement_destroy(lng);
+	calc_statement_destroy(later);
+}
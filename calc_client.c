@@ -0,0 +1,368 @@
+// Authors:
+// Jack Zhang (jzhan237)
+// Tony Pan (jpan26)
+//
+// Client library for calcServer's text protocol (calc_client.h).
+//
+// Sockets are blocking, so waiting for replies is a plain recv, but
+// requests go out with MSG_DONTWAIT: a write the server doesn't take
+// at once makes calc_conn_flush poll for room and read the replies
+// that are ready meanwhile, instead of blocking in send.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "calc_client.h"
+
+// bytes of replies read at a time; a longer line is a bad reply
+#define IN_BUF 65536
+
+// A request waiting for its reply
+struct Pending {
+  CalcCallback cb;
+  void *arg;
+};
+
+struct CalcConn {
+  int fd;
+  int status;                   // CALC_CLIENT_OK until the connection fails
+  int replied;                  // a reply has come, so "Busy" can't
+  char *out;                    // requests not written yet, from outpos on
+  size_t outpos, outlen, outcap;
+  char in[IN_BUF];              // the start of a reply not read in full
+  size_t inlen;
+  struct Pending *pending;      // a ring of count from head on
+  size_t head, count, cap;
+  struct CalcConn *next_idle;
+};
+
+struct CalcClient {
+  struct addrinfo *addr;
+  pthread_mutex_t lock;
+  pthread_cond_t released;      // a connection went back to the pool
+  struct CalcConn *idle;
+  int open, max_conns;
+};
+
+const char *calc_client_strerror(int status) {
+  switch (status) {
+  case CALC_CLIENT_OK: return "Success";
+  case CALC_CLIENT_EVAL_ERROR: return "The server could not evaluate it";
+  case CALC_CLIENT_IO_ERROR: return "The connection failed";
+  case CALC_CLIENT_BUSY: return "The server is busy";
+  case CALC_CLIENT_BAD_REPLY: return "Bad reply";
+  case CALC_CLIENT_BAD_REQUEST: return "Bad request";
+  default: return "Unknown status";
+  }
+}
+
+// Take the oldest request waiting for a reply
+static struct Pending pop_pending(struct CalcConn *conn) {
+  struct Pending p = conn->pending[conn->head];
+  conn->head = (conn->head + 1) % conn->cap;
+  conn->count--;
+  return p;
+}
+
+// The connection has failed with status: so has every request on it
+static void fail(struct CalcConn *conn, int status) {
+  if (conn->status != CALC_CLIENT_OK) return;
+  conn->status = status;
+  conn->outpos = conn->outlen = 0;
+  while (conn->count > 0) {
+    struct Pending p = pop_pending(conn);
+    p.cb(p.arg, status, 0);
+  }
+}
+
+// Hand one reply line to the request it answers
+static void dispatch(struct CalcConn *conn, const char *line) {
+  int status = CALC_CLIENT_OK, value = 0;
+  char *end;
+  if (!conn->replied && strcmp(line, "Busy") == 0) {
+    fail(conn, CALC_CLIENT_BUSY);
+    return;
+  }
+  conn->replied = 1;
+  if (conn->count == 0) {
+    fail(conn, CALC_CLIENT_BAD_REPLY); // nothing asked for it
+    return;
+  }
+  if (strcmp(line, "Error") == 0) {
+    status = CALC_CLIENT_EVAL_ERROR;
+  } else {
+    errno = 0;
+    long v = strtol(line, &end, 10);
+    if (end == line || *end != '\0' || errno != 0 || v < INT_MIN ||
+        v > INT_MAX) {
+      status = CALC_CLIENT_BAD_REPLY;
+    } else {
+      value = (int) v;
+    }
+  }
+  struct Pending p = pop_pending(conn);
+  p.cb(p.arg, status, value);
+}
+
+// Read the replies there are (or wait for some, without MSG_DONTWAIT)
+// and dispatch every complete one
+static int read_replies(struct CalcConn *conn, int flags) {
+  ssize_t n = recv(conn->fd, conn->in + conn->inlen, IN_BUF - conn->inlen,
+                   flags);
+  if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+                 errno != EINTR)) {
+    fail(conn, CALC_CLIENT_IO_ERROR);
+    return conn->status;
+  }
+  if (n < 0) return conn->status;
+  conn->inlen += n;
+  char *start = conn->in, *nl;
+  while (conn->status == CALC_CLIENT_OK &&
+         (nl = memchr(start, '\n', conn->in + conn->inlen - start)) != NULL) {
+    *nl = '\0';
+    if (nl > start && nl[-1] == '\r') nl[-1] = '\0';
+    dispatch(conn, start);
+    start = nl + 1;
+  }
+  conn->inlen -= start - conn->in;
+  memmove(conn->in, start, conn->inlen);
+  if (conn->inlen == IN_BUF) fail(conn, CALC_CLIENT_BAD_REPLY);
+  return conn->status;
+}
+
+// Write as much of the queued requests as the socket takes now
+static int write_some(struct CalcConn *conn) {
+  while (conn->status == CALC_CLIENT_OK && conn->outpos < conn->outlen) {
+    ssize_t n = send(conn->fd, conn->out + conn->outpos,
+                     conn->outlen - conn->outpos, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        fail(conn, CALC_CLIENT_IO_ERROR);
+      }
+      break;
+    }
+    conn->outpos += n;
+  }
+  if (conn->outpos == conn->outlen) conn->outpos = conn->outlen = 0;
+  return conn->status;
+}
+
+int calc_conn_flush(struct CalcConn *conn) {
+  while (write_some(conn) == CALC_CLIENT_OK && conn->outpos < conn->outlen) {
+    // the server may be waiting for us to take replies first
+    struct pollfd pfd = { conn->fd, POLLOUT | POLLIN, 0 };
+    if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+      fail(conn, CALC_CLIENT_IO_ERROR);
+    } else if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+      read_replies(conn, MSG_DONTWAIT);
+    }
+  }
+  return conn->status;
+}
+
+int calc_conn_wait(struct CalcConn *conn, size_t pending) {
+  calc_conn_flush(conn);
+  while (conn->status == CALC_CLIENT_OK && conn->count > pending) {
+    read_replies(conn, 0);
+  }
+  return conn->status;
+}
+
+// Whether the server would take expr[0..len) for quit or shutdown,
+// which end the connection for everyone sharing it without a reply.
+// Like the server, this ignores a '\r' before the newline.
+static int ends_connection(const char *expr, size_t len) {
+  if (len > 0 && expr[len - 1] == '\r') len--;
+  return (len == 4 && memcmp(expr, "quit", 4) == 0) ||
+         (len == 8 && memcmp(expr, "shutdown", 8) == 0);
+}
+
+int calc_conn_submit(struct CalcConn *conn, const char *expr,
+                     CalcCallback cb, void *arg) {
+  size_t len = strlen(expr);
+  if (conn->status != CALC_CLIENT_OK) return conn->status;
+  if (memchr(expr, '\n', len) != NULL || ends_connection(expr, len)) {
+    return CALC_CLIENT_BAD_REQUEST;
+  }
+  if (conn->count == conn->cap) {
+    // grow the ring, unwrapping it
+    size_t cap = conn->cap ? conn->cap * 2 : 64;
+    struct Pending *p = malloc(cap * sizeof(struct Pending));
+    if (p == NULL) return CALC_CLIENT_IO_ERROR;
+    for (size_t i = 0; i < conn->count; i++) {
+      p[i] = conn->pending[(conn->head + i) % conn->cap];
+    }
+    free(conn->pending);
+    conn->pending = p;
+    conn->head = 0;
+    conn->cap = cap;
+  }
+  if (conn->outlen + len + 1 > conn->outcap) {
+    size_t cap = conn->outcap ? conn->outcap : CALC_CLIENT_BATCH;
+    while (cap < conn->outlen + len + 1) cap *= 2;
+    char *out = realloc(conn->out, cap);
+    if (out == NULL) return CALC_CLIENT_IO_ERROR;
+    conn->out = out;
+    conn->outcap = cap;
+  }
+  memcpy(conn->out + conn->outlen, expr, len);
+  conn->out[conn->outlen + len] = '\n';
+  conn->outlen += len + 1;
+  conn->pending[(conn->head + conn->count) % conn->cap] =
+      (struct Pending) { cb, arg };
+  conn->count++;
+  // a full batch goes now, as far as the socket takes it
+  if (conn->outlen - conn->outpos >= CALC_CLIENT_BATCH) write_some(conn);
+  return CALC_CLIENT_OK;
+}
+
+static void future_done(void *arg, int status, int value) {
+  struct CalcFuture *future = arg;
+  future->status = status;
+  future->value = value;
+  future->done = 1;
+}
+
+int calc_conn_submit_future(struct CalcConn *conn, const char *expr,
+                            struct CalcFuture *future) {
+  future->done = 0;
+  return calc_conn_submit(conn, expr, future_done, future);
+}
+
+int calc_future_get(struct CalcConn *conn, struct CalcFuture *future,
+                    int *value) {
+  calc_conn_flush(conn);
+  // a failure completes every future on the connection
+  while (!future->done && conn->status == CALC_CLIENT_OK && conn->count > 0) {
+    read_replies(conn, 0);
+  }
+  if (!future->done) return CALC_CLIENT_BAD_REQUEST; // not submitted on conn
+  if (future->status == CALC_CLIENT_OK && value != NULL) {
+    *value = future->value;
+  }
+  return future->status;
+}
+
+size_t calc_conn_pending(const struct CalcConn *conn) {
+  return conn->count;
+}
+
+struct CalcClient *calc_client_create(const char *host, const char *port,
+                                      int max_conns) {
+  struct addrinfo hints;
+  struct CalcClient *cl = calloc(1, sizeof(struct CalcClient));
+  if (cl == NULL) return NULL;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, port, &hints, &cl->addr) != 0) {
+    free(cl);
+    return NULL;
+  }
+  pthread_mutex_init(&cl->lock, NULL);
+  pthread_cond_init(&cl->released, NULL);
+  cl->max_conns = max_conns > 0 ? max_conns : 1;
+  return cl;
+}
+
+static void conn_free(struct CalcConn *conn) {
+  close(conn->fd);
+  free(conn->out);
+  free(conn->pending);
+  free(conn);
+}
+
+void calc_client_destroy(struct CalcClient *cl) {
+  while (cl->idle != NULL) {
+    struct CalcConn *conn = cl->idle;
+    cl->idle = conn->next_idle;
+    conn_free(conn);
+  }
+  freeaddrinfo(cl->addr);
+  pthread_mutex_destroy(&cl->lock);
+  pthread_cond_destroy(&cl->released);
+  free(cl);
+}
+
+// A new connection to the server
+static struct CalcConn *conn_open(struct CalcClient *cl, int *status) {
+  int fd = -1, one = 1;
+  for (struct addrinfo *p = cl->addr; p != NULL && fd < 0; p = p->ai_next) {
+    fd = socket(p->ai_family, p->ai_socktype | SOCK_CLOEXEC, p->ai_protocol);
+    if (fd >= 0 && connect(fd, p->ai_addr, p->ai_addrlen) < 0) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  struct CalcConn *conn = fd >= 0 ? calloc(1, sizeof(struct CalcConn)) : NULL;
+  if (conn == NULL) {
+    if (fd >= 0) close(fd);
+    *status = CALC_CLIENT_IO_ERROR;
+    return NULL;
+  }
+  // requests are already gathered into batches
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  conn->fd = fd;
+  conn->status = CALC_CLIENT_OK;
+  return conn;
+}
+
+struct CalcConn *calc_client_acquire(struct CalcClient *cl, int *status) {
+  pthread_mutex_lock(&cl->lock);
+  while (cl->idle == NULL && cl->open >= cl->max_conns) {
+    pthread_cond_wait(&cl->released, &cl->lock);
+  }
+  struct CalcConn *conn = cl->idle;
+  if (conn != NULL) {
+    cl->idle = conn->next_idle;
+  } else {
+    cl->open++; // ours to open
+  }
+  pthread_mutex_unlock(&cl->lock);
+  if (conn != NULL) return conn;
+
+  conn = conn_open(cl, status);
+  if (conn == NULL) {
+    pthread_mutex_lock(&cl->lock);
+    cl->open--;
+    pthread_cond_signal(&cl->released);
+    pthread_mutex_unlock(&cl->lock);
+  }
+  return conn;
+}
+
+void calc_client_release(struct CalcClient *cl, struct CalcConn *conn) {
+  calc_conn_wait(conn, 0);
+  int failed = conn->status != CALC_CLIENT_OK;
+  if (failed) conn_free(conn);
+  pthread_mutex_lock(&cl->lock);
+  if (failed) {
+    cl->open--;
+  } else {
+    conn->next_idle = cl->idle;
+    cl->idle = conn;
+  }
+  pthread_cond_signal(&cl->released);
+  pthread_mutex_unlock(&cl->lock);
+}
+
+int calc_client_eval(struct CalcClient *cl, const char *expr, int *value) {
+  struct CalcFuture future;
+  int status;
+  struct CalcConn *conn = calc_client_acquire(cl, &status);
+  if (conn == NULL) return status;
+  status = calc_conn_submit_future(conn, expr, &future);
+  if (status == CALC_CLIENT_OK) {
+    status = calc_future_get(conn, &future, value);
+  }
+  calc_client_release(cl, conn);
+  return status;
+}
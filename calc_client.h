@@ -0,0 +1,112 @@
+// Authors:
+// Jack Zhang (jzhan237)
+// Tony Pan (jpan26)
+//
+// A client library for calcServer's text protocol, for programs that
+// would otherwise open a socket (or run nc) and wait for every reply
+// before sending the next line.
+//
+// A CalcClient is a pool of connections to one server, which threads
+// may share: calc_client_eval borrows a connection, evaluates one
+// expression and gives it back, and calc_client_acquire lends one out
+// for as long as the caller likes. On a connection of its own a caller
+// can pipeline: calc_conn_submit queues a request with a callback (or
+// calc_conn_submit_future with a future) and returns at once. Queued
+// requests are written together, once CALC_CLIENT_BATCH bytes of them
+// pile up or the caller flushes or waits, and each reply is handed to
+// its request's callback in order as it arrives. While a write waits
+// for the server to take more, the replies that have come in are read,
+// so a caller with any number of requests in flight can't deadlock
+// with a server that stops reading until its replies are taken.
+//
+// Replies are mapped to a status: CALC_CLIENT_OK with the value, or
+// one of the negative codes below, "Error" becoming
+// CALC_CLIENT_EVAL_ERROR. A connection that fails fails every request
+// still outstanding on it with CALC_CLIENT_IO_ERROR (or
+// CALC_CLIENT_BUSY if the server turned it away), and is closed rather
+// than pooled when it is released.
+//
+// A request is one line without its newline: an expression, or a
+// command that gets a reply (PREPARE, EXEC, DEALLOCATE, LIMIT, STATS).
+// quit and shutdown would end the connection for everyone sharing it,
+// without a reply, so they are refused with CALC_CLIENT_BAD_REQUEST.
+#ifndef CALC_CLIENT_H
+#define CALC_CLIENT_H
+
+#include <stddef.h>
+
+/* bytes of queued requests written as soon as they have piled up */
+#define CALC_CLIENT_BATCH 16384
+
+// Status of a request
+enum CalcClientStatus {
+  CALC_CLIENT_OK = 0,
+  CALC_CLIENT_EVAL_ERROR = -1,  // "Error": not a valid expression, an
+                                // undefined variable, division by zero...
+  CALC_CLIENT_IO_ERROR = -2,    // the connection failed or was closed
+  CALC_CLIENT_BUSY = -3,        // the server has too many connections
+  CALC_CLIENT_BAD_REPLY = -4,   // a reply that is neither a number nor
+                                // "Error"
+  CALC_CLIENT_BAD_REQUEST = -5  // a newline in the request, or quit or
+                                // shutdown
+};
+
+// A description of a status, like strerror
+const char *calc_client_strerror(int status);
+
+// Called with the status of a request and, for CALC_CLIENT_OK, its
+// value, from whichever call on the connection reads the reply
+typedef void (*CalcCallback)(void *arg, int status, int value);
+
+// The result of a request, once done is set
+struct CalcFuture {
+  int done;
+  int status;
+  int value;
+};
+
+struct CalcClient;
+struct CalcConn;
+
+// A pool of at most max_conns connections to host and port, opened as
+// they are needed; NULL if host and port don't resolve
+struct CalcClient *calc_client_create(const char *host, const char *port,
+                                      int max_conns);
+// Close every pooled connection and free the client; connections
+// acquired from it must have been released
+void calc_client_destroy(struct CalcClient *cl);
+
+// Evaluate expr on a pooled connection and wait for the reply;
+// returns its status, with the result in *value for CALC_CLIENT_OK
+int calc_client_eval(struct CalcClient *cl, const char *expr, int *value);
+
+// Take a connection from the pool, opening one if none is idle and
+// fewer than max_conns are open, or else waiting for one to be
+// released. NULL if a connection can't be opened, with the reason in
+// *status.
+struct CalcConn *calc_client_acquire(struct CalcClient *cl, int *status);
+// Give conn back to the pool once its outstanding replies are in
+void calc_client_release(struct CalcClient *cl, struct CalcConn *conn);
+
+// Queue expr on conn; cb(arg, status, value) is called with its reply.
+// Returns CALC_CLIENT_OK, or the status the request failed with at
+// once (and cb isn't called).
+int calc_conn_submit(struct CalcConn *conn, const char *expr,
+                     CalcCallback cb, void *arg);
+// The same, filling in *future when the reply comes
+int calc_conn_submit_future(struct CalcConn *conn, const char *expr,
+                            struct CalcFuture *future);
+// Write every queued request, reading replies meanwhile if the server
+// doesn't take them at once; CALC_CLIENT_OK or why the connection failed
+int calc_conn_flush(struct CalcConn *conn);
+// Flush, then read replies until at most pending requests are
+// outstanding; CALC_CLIENT_OK or why the connection failed
+int calc_conn_wait(struct CalcConn *conn, size_t pending);
+// Wait for the reply to the request of future; returns its status,
+// with the result in *value for CALC_CLIENT_OK
+int calc_future_get(struct CalcConn *conn, struct CalcFuture *future,
+                    int *value);
+// Requests submitted on conn and not answered yet
+size_t calc_conn_pending(const struct CalcConn *conn);
+
+#endif // CALC_CLIENT_H
@@ -0,0 +1,104 @@
+// Authors:
+// Jack Zhang (jzhan237)
+// Tony Pan (jpan26)
+//
+// The binary protocol of calcServer, an alternative to its text
+// protocol for clients that would rather not format and parse decimal
+// text, nor have the server search for newlines.
+//
+// A connection speaks it if its first byte is CALC_PROTO_MAGIC (which
+// can't start a line of text protocol input); otherwise it is a text
+// connection as before. After the magic byte both sides send frames:
+//
+//   u32 length            bytes that follow, at most the server's
+//                         maximum line length (calcServer -l)
+//   u8  opcode / status   requests carry an opcode, replies a status
+//   ... payload
+//
+// All integers are little-endian; values are 32-bit two's complement.
+// Every request gets exactly one reply, in order, and requests may be
+// pipelined. Requests:
+//
+//   CALC_OP_EVAL    expression text, NUL-terminated
+//                   -> CALC_OK, i32 result
+//   CALC_OP_VAR     variable name (letters only, not NUL-terminated)
+//                   -> CALC_OK, u32 id, or CALC_ERROR if no variable
+//                   of that name has been assigned yet. The id stays
+//                   valid for the life of the server and is the same
+//                   on every connection.
+//   CALC_OP_GET     u32 id
+//                   -> CALC_OK, i32 value
+//   CALC_OP_ASSIGN  u32 id, i32 value (like "name = value")
+//                   -> CALC_OK, i32 value
+//   CALC_OP_BATCH   expressions, each NUL-terminated, back to back
+//                   -> CALC_OK, u32 count, then for each expression in
+//                   order a u8 status and an i32 result (0 on error)
+//   CALC_OP_SHUTDOWN no payload; no reply, the server shuts down
+//
+// A request that fails (an invalid expression, division by zero, an
+// undefined variable or an unknown id) gets CALC_ERROR and no payload,
+// like "Error" in the text protocol. A frame that doesn't follow this
+// description, or is too long, gets CALC_BAD_FRAME and the server then
+// closes the connection. Closing the connection stands for "quit".
+//
+// A server with as many connections open as it allows answers a new
+// one with CALC_BUSY_REPLY, text even to a binary client since it has
+// read nothing yet, and closes it. Its first four bytes can't start a
+// reply frame: as a length they are far longer than any reply.
+#ifndef CALCPROTO_H
+#define CALCPROTO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CALC_PROTO_MAGIC 0xCA
+
+/* all a connection gets when the server is too busy to take it */
+#define CALC_BUSY_REPLY "Busy\n"
+
+/* bytes of the length field */
+#define CALC_FRAME_HEADER 4
+
+// Request opcodes
+enum CalcOpcode {
+  CALC_OP_EVAL = 1,
+  CALC_OP_VAR = 2,
+  CALC_OP_GET = 3,
+  CALC_OP_ASSIGN = 4,
+  CALC_OP_BATCH = 5,
+  CALC_OP_SHUTDOWN = 6
+};
+
+// Reply statuses
+enum CalcStatus {
+  CALC_OK = 0,
+  CALC_ERROR = 1,
+  CALC_BAD_FRAME = 2
+};
+
+/* reply to EVAL, GET or ASSIGN: header, status and an i32 */
+#define CALC_VALUE_REPLY (CALC_FRAME_HEADER + 5)
+
+static inline uint32_t calc_get_u32(const void *p) {
+  const unsigned char *b = p;
+  return (uint32_t) b[0] | (uint32_t) b[1] << 8 | (uint32_t) b[2] << 16 |
+         (uint32_t) b[3] << 24;
+}
+
+static inline void calc_put_u32(void *p, uint32_t v) {
+  unsigned char *b = p;
+  b[0] = v;
+  b[1] = v >> 8;
+  b[2] = v >> 16;
+  b[3] = v >> 24;
+}
+
+// Write a frame header for length bytes and the opcode or status at
+// buf; returns the bytes written (CALC_FRAME_HEADER + 1)
+static inline size_t calc_put_header(void *buf, uint32_t length, int code) {
+  calc_put_u32(buf, length);
+  ((unsigned char *) buf)[CALC_FRAME_HEADER] = code;
+  return CALC_FRAME_HEADER + 1;
+}
+
+#endif // CALCPROTO_H
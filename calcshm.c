@@ -0,0 +1,224 @@
+/*
+ * Client library for calcServer's shared-memory transport (calcshm.h).
+ *
+ * A CalcShm is one slot of the region: the client is the producer of
+ * its request ring and the consumer of its reply ring. Waiting for
+ * room or for replies, it looks at the ring SPIN_TRIES times before it
+ * sleeps on its slot's futex, so that a server answering promptly
+ * costs it no system call at all.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "calcshm.h"
+
+/* times a waiting client looks at the ring before it sleeps */
+#define SPIN_TRIES 100
+/* bytes of replies calc_shm_getline reads ahead */
+#define LINE_BUF 4096
+
+struct CalcShm {
+	struct CalcShmRegion *region;
+	struct CalcShmSlot *slot;
+	char buf[LINE_BUF];	/* replies read ahead, from pos to len */
+	size_t pos, len;
+};
+
+/* wake the server if it sleeps: there is input for it, or room */
+static void wake_server(struct CalcShm *c) {
+	calc_shm_ring_bell(&c->region->server_waiting, &c->region->server_bell);
+}
+
+/* whether what the client waits for has come: room for requests
+   (writing) or replies, or the server hanging up */
+static int ready(struct CalcShm *c, int writing) {
+	struct CalcShmSlot *s = c->slot;
+	if (atomic_load(&s->hung_up))
+		return 1;
+	if (writing)
+		return calc_shm_writable(&s->requests) > 0;
+	return calc_shm_readable(&s->replies) > 0;
+}
+
+/* wait until ready(c, writing) */
+static void wait_for(struct CalcShm *c, int writing) {
+	struct CalcShmSlot *s = c->slot;
+	for (int i = 0; !ready(c, writing); i++) {
+		if (i < SPIN_TRIES)
+			continue;
+		unsigned seen = atomic_load(&s->client_bell);
+		atomic_store(&s->client_waiting, 1);
+		atomic_thread_fence(memory_order_seq_cst);
+		if (!ready(c, writing))
+			calc_shm_wait(&s->client_bell, seen);
+		atomic_store(&s->client_waiting, 0);
+	}
+}
+
+struct CalcShm *calc_shm_open(const char *name) {
+	char path[NAME_MAX];
+	struct stat st;
+	snprintf(path, sizeof(path), "%s%s", name[0] == '/' ? "" : "/", name);
+	int fd = shm_open(path, O_RDWR, 0);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(struct CalcShmRegion)) {
+		close(fd);
+		errno = EPROTO;
+		return NULL;
+	}
+	struct CalcShmRegion *region = mmap(NULL, sizeof(struct CalcShmRegion),
+		PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (region == MAP_FAILED)
+		return NULL;
+	int err = 0;
+	struct CalcShmSlot *slot = NULL;
+	if (region->magic != CALC_SHM_MAGIC || region->version != CALC_SHM_VERSION ||
+			region->slots != CALC_SHM_SLOTS || region->ring_size != CALC_SHM_RING)
+		err = EPROTO;
+	else if (atomic_load(&region->closed))
+		err = EPIPE;
+	for (int i = 0; err == 0 && slot == NULL && i < CALC_SHM_SLOTS; i++) {
+		unsigned expected = CALC_SHM_FREE;
+		if (atomic_compare_exchange_strong(&region->slot[i].state, &expected,
+				CALC_SHM_OPEN))
+			slot = &region->slot[i];
+	}
+	if (err == 0 && slot == NULL) {
+		/* have the server look for slots of clients that died */
+		atomic_fetch_add(&region->reclaim, 1);
+		calc_shm_ring_bell(&region->server_waiting, &region->server_bell);
+		err = EBUSY;
+	}
+	if (slot != NULL && atomic_load(&region->closed)) {
+		/* the server shut down as the slot was claimed: it may be gone */
+		atomic_store(&slot->state, CALC_SHM_CLOSED);
+		calc_shm_ring_bell(&region->server_waiting, &region->server_bell);
+		err = EPIPE;
+	}
+	if (err != 0) {
+		munmap(region, sizeof(struct CalcShmRegion));
+		errno = err;
+		return NULL;
+	}
+	atomic_store(&slot->pid, getpid());
+
+	struct CalcShm *c = malloc(sizeof(struct CalcShm));
+	if (c == NULL) {
+		atomic_store(&slot->state, CALC_SHM_CLOSED);
+		munmap(region, sizeof(struct CalcShmRegion));
+		errno = ENOMEM;
+		return NULL;
+	}
+	c->region = region;
+	c->slot = slot;
+	c->pos = c->len = 0;
+	return c;
+}
+
+void calc_shm_close(struct CalcShm *c) {
+	/* the server carries out what is left of the input, then frees it */
+	atomic_store_explicit(&c->slot->state, CALC_SHM_CLOSED, memory_order_release);
+	wake_server(c);
+	munmap(c->region, sizeof(struct CalcShmRegion));
+	free(c);
+}
+
+/* write all n bytes of data without waking the server once done */
+static ssize_t put(struct CalcShm *c, const void *data, size_t n) {
+	const char *p = data;
+	size_t left = n;
+	while (left > 0) {
+		if (atomic_load(&c->slot->hung_up)) {
+			errno = EPIPE;
+			return -1;
+		}
+		size_t done = calc_shm_write(&c->slot->requests, p, left);
+		p += done;
+		left -= done;
+		if (left > 0) {
+			/* full: the server has to read some first */
+			wake_server(c);
+			wait_for(c, 1);
+		}
+	}
+	return n;
+}
+
+ssize_t calc_shm_send(struct CalcShm *c, const void *data, size_t n) {
+	ssize_t sent = put(c, data, n);
+	wake_server(c);
+	return sent;
+}
+
+/* read up to n bytes of replies from the ring itself */
+static ssize_t take(struct CalcShm *c, void *buf, size_t n) {
+	for (;;) {
+		size_t got = calc_shm_read(&c->slot->replies, buf, n);
+		if (got > 0) {
+			/* the server may wait for room to put more */
+			wake_server(c);
+			return got;
+		}
+		if (atomic_load(&c->slot->hung_up) &&
+				calc_shm_readable(&c->slot->replies) == 0)
+			return 0;
+		wait_for(c, 0);
+	}
+}
+
+ssize_t calc_shm_recv(struct CalcShm *c, void *buf, size_t n) {
+	if (c->pos < c->len) {
+		if (n > c->len - c->pos)
+			n = c->len - c->pos;
+		memcpy(buf, c->buf + c->pos, n);
+		c->pos += n;
+		return n;
+	}
+	return take(c, buf, n);
+}
+
+ssize_t calc_shm_getline(struct CalcShm *c, char *line, size_t cap) {
+	for (;;) {
+		char *nl = memchr(c->buf + c->pos, '\n', c->len - c->pos);
+		if (nl != NULL) {
+			size_t len = nl - (c->buf + c->pos);
+			if (len >= cap)
+				return -1;
+			memcpy(line, c->buf + c->pos, len);
+			line[len] = '\0';
+			c->pos += len + 1;
+			return len;
+		}
+		memmove(c->buf, c->buf + c->pos, c->len - c->pos);
+		c->len -= c->pos;
+		c->pos = 0;
+		if (c->len == LINE_BUF)
+			return -1;
+		ssize_t got = take(c, c->buf + c->len, LINE_BUF - c->len);
+		if (got <= 0)
+			return 0;
+		c->len += got;
+	}
+}
+
+int calc_shm_eval(struct CalcShm *c, const char *expr, int *value) {
+	char reply[32], *end;
+	if (put(c, expr, strlen(expr)) < 0 || calc_shm_send(c, "\n", 1) < 0)
+		return -1;
+	if (calc_shm_getline(c, reply, sizeof(reply)) <= 0)
+		return -1;
+	if (strcmp(reply, "Error") == 0)
+		return 0;
+	long v = strtol(reply, &end, 10);
+	if (*end != '\0')
+		return -1;
+	*value = (int) v;
+	return 1;
+}
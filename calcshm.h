@@ -0,0 +1,180 @@
+// Authors:
+// Jack Zhang (jzhan237)
+// Tony Pan (jpan26)
+//
+// The shared-memory transport of calcServer, for clients on the same
+// host that would rather not have every request and reply go through
+// the kernel.
+//
+// calcServer -R name creates a POSIX shared memory object (shm_open)
+// holding a CalcShmRegion: CALC_SHM_SLOTS slots, each of which is one
+// connection at a time. A client claims a free slot and then writes
+// its input into the slot's request ring and reads the replies from
+// its reply ring, exactly the bytes a socket connection would carry
+// (text lines, or the binary protocol of calcproto.h after its magic
+// byte). Each ring has a single producer and a single consumer, so it
+// needs no lock: the producer only moves head and the consumer only
+// moves tail.
+//
+// Neither side makes a system call while the other keeps up. A side
+// that finds nothing to do sets its waiting flag, looks once more, and
+// sleeps on a futex in the region; the other side only wakes it (one
+// FUTEX_WAKE) when it sees the flag set after making progress.
+//
+// The functions below are the client library (calcshm.c); the server
+// side is shm.c.
+#ifndef CALCSHM_H
+#define CALCSHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define CALC_SHM_MAGIC 0x43616c63   // "Calc"
+#define CALC_SHM_VERSION 1
+
+/* slots in a region: the connections it can carry at once */
+#define CALC_SHM_SLOTS 64
+/* bytes of each ring, a power of two */
+#define CALC_SHM_RING 65536
+
+#define CALC_SHM_CACHELINE 64
+
+// Bytes flowing one way. head and tail count every byte ever written
+// and read (wrapping around), and sit on cache lines of their own so
+// that the two sides don't contend for one.
+struct CalcShmRing {
+  _Alignas(CALC_SHM_CACHELINE) atomic_uint head;
+  _Alignas(CALC_SHM_CACHELINE) atomic_uint tail;
+  _Alignas(CALC_SHM_CACHELINE) char data[CALC_SHM_RING];
+};
+
+// What a slot is doing
+enum CalcShmState {
+  CALC_SHM_FREE,        // waiting for a client
+  CALC_SHM_OPEN,        // claimed by a client
+  CALC_SHM_CLOSED       // its client is done; the server frees it
+};
+
+struct CalcShmSlot {
+  atomic_uint state;
+  atomic_int pid;               // of the client, to reclaim from the dead
+  atomic_uint hung_up;          // the server closed the connection
+  atomic_uint client_waiting;   // the client sleeps on client_bell
+  atomic_uint client_bell;
+  struct CalcShmRing requests;  // client to server
+  struct CalcShmRing replies;   // server to client
+};
+
+struct CalcShmRegion {
+  uint32_t magic, version, slots, ring_size;
+  atomic_uint closed;           // the server shut down: no new clients
+  atomic_uint server_waiting;   // the server sleeps on server_bell
+  atomic_uint server_bell;
+  atomic_uint reclaim;          // bumped by a client that found no slot
+  struct CalcShmSlot slot[CALC_SHM_SLOTS];
+};
+
+// Sleep on *bell unless it has changed from seen (a wakeup came since)
+static inline void calc_shm_wait(atomic_uint *bell, unsigned seen) {
+  syscall(SYS_futex, bell, FUTEX_WAIT, seen, NULL, NULL, 0);
+}
+
+// After making progress: wake the other side if it has gone to sleep.
+// The fence pairs with the one a sleeper makes between setting its
+// flag and looking for work, so that one of them sees the other.
+static inline void calc_shm_ring_bell(atomic_uint *waiting,
+                                      atomic_uint *bell) {
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(waiting, memory_order_relaxed)) {
+    atomic_fetch_add(bell, 1);
+    syscall(SYS_futex, bell, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+  }
+}
+
+// Whether r's indices are at most CALC_SHM_RING bytes apart, as they
+// are unless one side has scribbled over them: both live in memory the
+// other side can write, so neither can take them on trust
+static inline int calc_shm_ring_ok(struct CalcShmRing *r) {
+  unsigned head = atomic_load_explicit(&r->head, memory_order_acquire);
+  return head - atomic_load_explicit(&r->tail, memory_order_acquire) <=
+         CALC_SHM_RING;
+}
+
+// Bytes waiting to be read from r (none if its indices are broken)
+static inline size_t calc_shm_readable(struct CalcShmRing *r) {
+  unsigned used = atomic_load_explicit(&r->head, memory_order_acquire) -
+                  atomic_load_explicit(&r->tail, memory_order_relaxed);
+  return used <= CALC_SHM_RING ? used : 0;
+}
+
+// Bytes that can be written to r (none if its indices are broken)
+static inline size_t calc_shm_writable(struct CalcShmRing *r) {
+  unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+  unsigned used = head - atomic_load_explicit(&r->tail, memory_order_acquire);
+  return used <= CALC_SHM_RING ? CALC_SHM_RING - used : 0;
+}
+
+// Copy up to n bytes out of r into buf (consumer side); returns how many
+static inline size_t calc_shm_read(struct CalcShmRing *r, void *buf, size_t n) {
+  unsigned tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+  size_t avail = calc_shm_readable(r);
+  if (n > avail) n = avail;
+  size_t at = tail & (CALC_SHM_RING - 1), first = CALC_SHM_RING - at;
+  if (first > n) first = n;
+  memcpy(buf, r->data + at, first);
+  memcpy((char *) buf + first, r->data, n - first);
+  atomic_store_explicit(&r->tail, tail + n, memory_order_release);
+  return n;
+}
+
+// Copy up to n bytes of data into r (producer side); returns how many
+static inline size_t calc_shm_write(struct CalcShmRing *r, const void *data,
+                                    size_t n) {
+  unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+  size_t room = calc_shm_writable(r);
+  if (n > room) n = room;
+  size_t at = head & (CALC_SHM_RING - 1), first = CALC_SHM_RING - at;
+  if (first > n) first = n;
+  memcpy(r->data + at, data, first);
+  memcpy(r->data, (const char *) data + first, n - first);
+  atomic_store_explicit(&r->head, head + n, memory_order_release);
+  return n;
+}
+
+// A client's connection through a slot of a region (calcshm.c). One
+// thread at a time may use it.
+struct CalcShm;
+
+// Map the region calcServer -R name created and claim a free slot.
+// Returns NULL with errno set on failure: EBUSY if every slot is
+// taken (the server is then asked to free the slots of clients that
+// exited without closing theirs, so a later try may succeed), EPIPE if
+// the server has shut down.
+struct CalcShm *calc_shm_open(const char *name);
+// Free the slot and unmap the region
+void calc_shm_close(struct CalcShm *c);
+
+// Write all n bytes of data, waiting for room as needed; -1 (EPIPE) if
+// the server has closed the connection
+ssize_t calc_shm_send(struct CalcShm *c, const void *data, size_t n);
+// Read at least one and at most n bytes of replies, waiting for them
+// as needed; 0 once the server has closed the connection and every
+// reply has been read
+ssize_t calc_shm_recv(struct CalcShm *c, void *buf, size_t n);
+
+// Read one reply line into line (at most cap bytes, NUL-terminated,
+// without its newline); returns its length, 0 at the end, or -1 if it
+// is too long
+ssize_t calc_shm_getline(struct CalcShm *c, char *line, size_t cap);
+// Evaluate expr (one line of the text protocol) and wait for its
+// reply: 1 with the result in *value, 0 for "Error", -1 on failure
+int calc_shm_eval(struct CalcShm *c, const char *expr, int *value);
+
+#endif // CALCSHM_H
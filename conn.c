@@ -0,0 +1,745 @@
+// Authors:
+// Jack Zhang (jzhan237)
+// Tony Pan (jpan26)
+//
+// Connections on non-blocking sockets, shared by the event-driven
+// server modes. A connection holds the part of a line read so far and
+// any replies the socket wasn't ready to take; servicing it reads and
+// evaluates input until the socket runs dry.
+#include "csapp.h"
+#include "calc.h"
+#include "server.h"
+#include "calcproto.h"
+#include <netinet/tcp.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <sys/un.h>
+
+// connections admitted and not released yet, in every mode
+static atomic_size_t open_conns;
+// connections turned away
+static atomic_size_t rejected_conns;
+
+// What is counted for the AF_UNIX clients of one user
+struct PeerAccount {
+  uid_t uid;
+  atomic_size_t conns;          // open now
+  atomic_size_t requests;       // lines and frames carried out
+};
+
+// Accounts are only ever added, under accounts_lock; once published
+// (naccounts) an entry's uid doesn't change, so it is read without it
+static struct PeerAccount accounts[PEER_ACCOUNTS];
+static atomic_int naccounts;
+static pthread_mutex_t accounts_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+    unix_error("fcntl error");
+  }
+}
+
+void set_blocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0 || fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) < 0) {
+    unix_error("fcntl error");
+  }
+}
+
+void set_nodelay(int fd) {
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+int open_reuseport_listenfd(const char *port) {
+  struct addrinfo hints, *listp, *p;
+  int listenfd = -1, optval = 1;
+
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+  if (getaddrinfo(NULL, port, &hints, &listp) != 0) {
+    return -1;
+  }
+  for (p = listp; p; p = p->ai_next) {
+    listenfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+    if (listenfd < 0) continue;
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(int));
+    if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0) break;
+    close(listenfd);
+    listenfd = -1;
+  }
+  freeaddrinfo(listp);
+  if (listenfd >= 0 && listen(listenfd, LISTENQ) < 0) {
+    close(listenfd);
+    return -1;
+  }
+  return listenfd;
+}
+
+int open_unix_listenfd(const char *path) {
+  struct sockaddr_un addr;
+  struct stat st;
+  if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  int listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listenfd < 0) return -1;
+  // a server that didn't exit cleanly leaves its socket behind
+  if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+  if (bind(listenfd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+      listen(listenfd, LISTENQ) < 0) {
+    close(listenfd);
+    return -1;
+  }
+  return listenfd;
+}
+
+int accept_conn(int listenfd, int *reserve_fd) {
+  for (;;) {
+    int fd = accept(listenfd, NULL, NULL);
+    if (fd >= 0) {
+      if (!conn_admit(fd)) continue;
+      set_nonblocking(fd);
+      set_nodelay(fd);
+      return fd;
+    }
+    if (errno == EINTR || errno == ECONNABORTED) continue;
+    if ((errno == EMFILE || errno == ENFILE) && *reserve_fd >= 0) {
+      // out of descriptors: use the spare one to accept and close
+      // the connection, rather than have it wake us up forever
+      close(*reserve_fd);
+      fd = accept(listenfd, NULL, NULL);
+      if (fd >= 0) close(fd);
+      *reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+      continue;
+    }
+    return -1; // EAGAIN: no more pending
+  }
+}
+
+int conn_admit(int fd) {
+  if (atomic_fetch_add(&open_conns, 1) < max_conns) return 1;
+  atomic_fetch_sub(&open_conns, 1);
+  atomic_fetch_add(&rejected_conns, 1);
+  // Turn it away at once, rather than leave it waiting for a thread or
+  // a turn that would only slow down the clients already admitted.
+  // Whatever it has sent already is read first: closing with unread
+  // input would reset the connection and could lose the reply.
+  char discard[256];
+  if (send(fd, CALC_BUSY_REPLY, strlen(CALC_BUSY_REPLY),
+           MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+    // nowhere to put it: the client only sees the connection close
+  }
+  shutdown(fd, SHUT_WR);
+  for (int i = 0; i < 16; i++) {
+    if (recv(fd, discard, sizeof(discard), MSG_DONTWAIT) <= 0) break;
+  }
+  close(fd);
+  return 0;
+}
+
+void conn_release(void) {
+  atomic_fetch_sub(&open_conns, 1);
+}
+
+size_t conn_count(void) {
+  return atomic_load(&open_conns);
+}
+
+size_t conn_rejected(void) {
+  return atomic_load(&rejected_conns);
+}
+
+// The account of the user at the other end of fd if it is an AF_UNIX
+// socket, created if need be and counting the connection; NULL for
+// TCP, or when there is no room for another account
+static struct PeerAccount *peer_account(int fd) {
+  uid_t uid;
+  if (peer_uid(fd, &uid) < 0) return NULL;
+  struct PeerAccount *a = NULL;
+  pthread_mutex_lock(&accounts_lock);
+  int n = atomic_load(&naccounts);
+  for (int i = 0; i < n && a == NULL; i++) {
+    if (accounts[i].uid == uid) a = &accounts[i];
+  }
+  if (a == NULL && n < PEER_ACCOUNTS) {
+    a = &accounts[n];
+    a->uid = uid;
+    atomic_store(&naccounts, n + 1);
+  }
+  if (a != NULL) atomic_fetch_add(&a->conns, 1);
+  pthread_mutex_unlock(&accounts_lock);
+  return a;
+}
+
+// The account of user uid, or NULL if there is none
+static struct PeerAccount *find_account(uid_t uid) {
+  int n = atomic_load(&naccounts);
+  for (int i = 0; i < n; i++) {
+    if (accounts[i].uid == uid) return &accounts[i];
+  }
+  return NULL;
+}
+
+// Add the requests s has carried out for c to c's account
+static void conn_account(struct ConnScratch *s, struct Conn *c) {
+  if (s->requests > 0 && c->account != NULL) {
+    atomic_fetch_add(&c->account->requests, s->requests);
+  }
+  s->requests = 0;
+}
+
+struct Conn *conn_create(int fd) {
+  struct Conn *c = Malloc(sizeof(struct Conn));
+  c->fd = fd;
+  c->closing = 0;
+  c->registered = 0;
+  c->ready = 0;
+  c->next_ready = NULL;
+  c->proto = PROTO_UNKNOWN;
+  c->statements = NULL;
+  c->account = peer_account(fd);
+  c->out = NULL;
+  c->outpos = c->outlen = c->outcap = 0;
+  reader_init(&c->in, max_line);
+  return c;
+}
+
+void conn_scratch_init(struct ConnScratch *s, struct Calc *calc) {
+  s->calc = calc;
+  s->replies = NULL;
+  s->replies_len = s->replies_cap = 0;
+  s->batch_n = 0;
+  s->requests = 0;
+}
+
+void conn_scratch_cleanup(struct ConnScratch *s) {
+  free(s->replies);
+}
+
+// Append len bytes at data to the buffer *buf of capacity *cap
+static void append(
+  char **buf, size_t *len, size_t *cap, const char *data, size_t n) {
+  if (*len + n > *cap) {
+    size_t newcap = *cap ? *cap : 256;
+    while (newcap < *len + n) newcap *= 2;
+    *buf = Realloc(*buf, newcap);
+    *cap = newcap;
+  }
+  memcpy(*buf + *len, data, n);
+  *len += n;
+}
+
+void conn_free(struct Conn *c) {
+  if (c->account != NULL) atomic_fetch_sub(&c->account->conns, 1);
+  if (c->statements != NULL) {
+    for (int i = 0; i < STATEMENTS_MAX; i++) {
+      if (c->statements[i] != NULL) calc_statement_destroy(c->statements[i]);
+    }
+    free(c->statements);
+  }
+  free(c->out);
+  reader_free(&c->in);
+  free(c);
+}
+
+void conn_close(struct Conn *c) {
+  close(c->fd); // also removes it from any epoll set
+  conn_free(c);
+  conn_release();
+}
+
+// Make room for n more bytes of replies in s->replies
+static void reserve_replies(struct ConnScratch *s, size_t n) {
+  size_t need = s->replies_len + n;
+  if (need > s->replies_cap) {
+    size_t newcap = s->replies_cap ? s->replies_cap : 256;
+    while (newcap < need) newcap *= 2;
+    s->replies = Realloc(s->replies, newcap);
+    s->replies_cap = newcap;
+  }
+}
+
+// Write a binary reply with value, or an error if !ok, at out; returns
+// its length
+static size_t put_value(char *out, int ok, int value) {
+  if (!ok) return calc_put_header(out, 1, CALC_ERROR);
+  calc_put_header(out, 5, CALC_OK);
+  calc_put_u32(out + CALC_FRAME_HEADER + 1, (uint32_t) value);
+  return CALC_VALUE_REPLY;
+}
+
+// Evaluate the lines (or binary EVAL requests) batched in s,
+// collecting their replies in s->replies
+static void conn_run_batch(struct ConnScratch *s, struct Conn *c) {
+  if (s->batch_n == 0) return;
+  reserve_replies(s, s->batch_n * REPLY_MAX);
+  char *out = s->replies + s->replies_len;
+  if (c->proto == PROTO_BINARY) {
+    int results[BATCH_LINES], ok[BATCH_LINES];
+    calc_eval_batch(s->calc, s->batch, s->batch_n, results, ok);
+    for (size_t i = 0; i < s->batch_n; i++) {
+      out += put_value(out, ok[i], results[i]);
+    }
+    s->replies_len = out - s->replies;
+  } else {
+    s->replies_len += eval_lines(s->calc, s->batch, s->batch_n, out);
+  }
+  s->batch_n = 0;
+}
+
+// The prepared statement that the text at arg names, or NULL
+static struct CalcStatement **conn_statement(struct Conn *c, const char *arg) {
+  const char *end = arg + strlen(arg);
+  int handle;
+  while (*arg == ' ') arg++;
+  while (end > arg && end[-1] == ' ') end--;
+  if (c->statements == NULL || !calc_parse_int(arg, end - arg, &handle) ||
+      handle < 0 || handle >= STATEMENTS_MAX ||
+      c->statements[handle] == NULL) {
+    return NULL;
+  }
+  return &c->statements[handle];
+}
+
+// Carry out PREPARE, EXEC or DEALLOCATE, replying with the handle or
+// the result (or an error)
+static void conn_statement_line(struct ConnScratch *s, struct Conn *c,
+                                enum LineAction action, const char *arg) {
+  struct CalcStatement **stmt;
+  int ok = 0, value = 0;
+  conn_run_batch(s, c);
+  if (action == LINE_PREPARE) {
+    if (c->statements == NULL) {
+      c->statements = Calloc(STATEMENTS_MAX, sizeof(struct CalcStatement *));
+    }
+    while (value < STATEMENTS_MAX && c->statements[value] != NULL) value++;
+    // no free handle: the client has to DEALLOCATE one first
+    if (value < STATEMENTS_MAX) {
+      c->statements[value] = calc_statement_create(s->calc, arg);
+      ok = c->statements[value] != NULL;
+    }
+  } else if ((stmt = conn_statement(c, arg)) == NULL) {
+    // not a handle in use: an error
+  } else if (action == LINE_EXEC) {
+    ok = calc_statement_exec(*stmt, &value);
+  } else {
+    value = stmt - c->statements;
+    calc_statement_destroy(*stmt);
+    *stmt = NULL;
+    ok = 1;
+  }
+  reserve_replies(s, REPLY_MAX);
+  s->replies_len += format_reply(ok, value, s->replies + s->replies_len);
+}
+
+// Carry out "LIMIT name [value]" (arg is the text after "LIMIT "):
+// set the limit called name to value if there is one, and reply with
+// the value it has
+static void conn_limit_line(
+  struct ConnScratch *s, struct Conn *c, const char *arg) {
+  static const struct {
+    const char *name;
+    volatile size_t *limit;
+  } limits[] = {
+    { "conns", &max_conns },
+    { "line", &max_line },
+    { "output", &max_output }
+  };
+  int ok = 0, value = 0;
+  size_t name_len = strcspn(arg, " ");
+  const char *rest = arg + name_len, *end = rest + strlen(rest);
+  while (*rest == ' ') rest++;
+  while (end > rest && end[-1] == ' ') end--;
+  conn_run_batch(s, c);
+  for (size_t i = 0; i < sizeof(limits) / sizeof(limits[0]); i++) {
+    if (strlen(limits[i].name) != name_len ||
+        strncmp(arg, limits[i].name, name_len) != 0) {
+      continue;
+    }
+    if (rest == end) {
+      ok = 1;
+    } else if (calc_parse_int(rest, end - rest, &value) && value > 0) {
+      *limits[i].limit = value;
+      ok = 1;
+    }
+    value = *limits[i].limit > INT_MAX ? INT_MAX : (int) *limits[i].limit;
+    break;
+  }
+  reserve_replies(s, REPLY_MAX);
+  s->replies_len += format_reply(ok, value, s->replies + s->replies_len);
+}
+
+// Carry out "STATS name [uid]" (arg is the text after "STATS "): reply
+// with the counter called name, that of user uid's account if given:
+//
+//   conns [uid]     connections open
+//   rejected        connections turned away
+//   requests uid    lines and frames carried out
+//   uid             the user at the other end of this connection
+static void conn_stats_line(
+  struct ConnScratch *s, struct Conn *c, const char *arg) {
+  size_t count = 0, name_len = strcspn(arg, " ");
+  const char *rest = arg + name_len, *end = rest + strlen(rest);
+  struct PeerAccount *a = NULL;
+  int ok = 1, uid;
+  while (*rest == ' ') rest++;
+  while (end > rest && end[-1] == ' ') end--;
+  if (rest < end) {
+    ok = calc_parse_int(rest, end - rest, &uid) &&
+         (a = find_account(uid)) != NULL;
+  }
+  if (!ok) {
+    // no such user
+  } else if (name_len == 5 && strncmp(arg, "conns", 5) == 0) {
+    count = a != NULL ? atomic_load(&a->conns) : conn_count();
+  } else if (name_len == 8 && strncmp(arg, "rejected", 8) == 0 && !a) {
+    count = conn_rejected();
+  } else if (name_len == 8 && strncmp(arg, "requests", 8) == 0 && a) {
+    count = atomic_load(&a->requests);
+  } else if (name_len == 3 && strncmp(arg, "uid", 3) == 0 && !a &&
+             c->account != NULL) {
+    count = c->account->uid;
+  } else {
+    ok = 0;
+  }
+  conn_run_batch(s, c);
+  reserve_replies(s, REPLY_MAX);
+  s->replies_len += format_reply(
+    ok, count > INT_MAX ? INT_MAX : (int) count, s->replies + s->replies_len);
+}
+
+// Add a line to the batch (NULL for one that was too long, which
+// gets an error); quit and shutdown take effect once the lines before
+// them are evaluated
+static void conn_line(struct ConnScratch *s, struct Conn *c, char *line) {
+  const char *arg;
+  s->requests++;
+  if (line == NULL) {
+    conn_run_batch(s, c);
+    append(&s->replies, &s->replies_len, &s->replies_cap, "Error\n", 6);
+    return;
+  }
+  if (s->batch_n == BATCH_LINES) conn_run_batch(s, c);
+  enum LineAction action = line_action(line, &arg);
+  switch (action) {
+  case LINE_SHUTDOWN:
+    conn_run_batch(s, c);
+    request_shutdown();
+    c->closing = 1;
+    break;
+  case LINE_QUIT:
+    conn_run_batch(s, c);
+    c->closing = 1;
+    break;
+  case LINE_PREPARE:
+  case LINE_EXEC:
+  case LINE_DEALLOCATE:
+    conn_statement_line(s, c, action, arg);
+    break;
+  case LINE_LIMIT:
+    conn_limit_line(s, c, arg);
+    break;
+  case LINE_STATS:
+    conn_stats_line(s, c, arg);
+    break;
+  case LINE_REPLY:
+    s->batch[s->batch_n++] = line;
+    break;
+  }
+}
+
+// Answer a frame that breaks the binary protocol, and hang up
+static void conn_bad_frame(struct ConnScratch *s, struct Conn *c) {
+  conn_run_batch(s, c);
+  reserve_replies(s, CALC_FRAME_HEADER + 1);
+  s->replies_len += calc_put_header(
+    s->replies + s->replies_len, 1, CALC_BAD_FRAME);
+  c->closing = 1;
+}
+
+// Evaluate the expressions of a BATCH request: its n-byte payload at
+// data, each of them NUL-terminated
+static void conn_batch_request(
+  struct ConnScratch *s, struct Conn *c, const char *data, size_t n) {
+  const char *exprs[BATCH_LINES];
+  int results[BATCH_LINES], ok[BATCH_LINES];
+  if (n > 0 && data[n - 1] != '\0') {
+    conn_bad_frame(s, c);
+    return;
+  }
+  conn_run_batch(s, c);
+  // the count goes in once the expressions have been counted
+  reserve_replies(s, CALC_FRAME_HEADER + 5);
+  char *head = s->replies + s->replies_len;
+  s->replies_len += CALC_FRAME_HEADER + 5;
+  uint32_t count = 0;
+  const char *end = data + n;
+  while (data < end) {
+    size_t k = 0;
+    while (k < BATCH_LINES && data < end) {
+      exprs[k++] = data;
+      data += strlen(data) + 1;
+    }
+    calc_eval_batch(s->calc, exprs, k, results, ok);
+    size_t at = head - s->replies;
+    reserve_replies(s, 5 * k);
+    head = s->replies + at;
+    char *out = s->replies + s->replies_len;
+    for (size_t i = 0; i < k; i++) {
+      out[0] = ok[i] ? CALC_OK : CALC_ERROR;
+      calc_put_u32(out + 1, ok[i] ? (uint32_t) results[i] : 0);
+      out += 5;
+    }
+    s->replies_len = out - s->replies;
+    count += k;
+  }
+  calc_put_header(head, 5 + 5 * count, CALC_OK);
+  calc_put_u32(head + CALC_FRAME_HEADER + 1, count);
+}
+
+// Carry out a binary request with opcode op and an n-byte payload at
+// data. EVAL requests are batched like lines; the others take effect
+// once the batch before them is evaluated.
+static void conn_frame(struct ConnScratch *s, struct Conn *c, int op,
+                       char *data, size_t n) {
+  int value, ok;
+  s->requests++;
+  if (op == CALC_OP_EVAL) {
+    if (n == 0 || data[n - 1] != '\0') {
+      conn_bad_frame(s, c);
+      return;
+    }
+    if (s->batch_n == BATCH_LINES) conn_run_batch(s, c);
+    s->batch[s->batch_n++] = data;
+    return;
+  }
+  if (op == CALC_OP_BATCH) {
+    conn_batch_request(s, c, data, n);
+    return;
+  }
+  conn_run_batch(s, c);
+  reserve_replies(s, CALC_VALUE_REPLY);
+  char *out = s->replies + s->replies_len;
+  switch (op) {
+  case CALC_OP_VAR:
+    value = calc_var_id(s->calc, data, n);
+    s->replies_len += put_value(out, value >= 0, value);
+    return;
+  case CALC_OP_GET:
+    if (n != 4) break;
+    ok = calc_get_var(s->calc, (int) calc_get_u32(data), &value);
+    s->replies_len += put_value(out, ok, value);
+    return;
+  case CALC_OP_ASSIGN:
+    if (n != 8) break;
+    value = (int) calc_get_u32(data + 4);
+    ok = calc_set_var(s->calc, (int) calc_get_u32(data), value);
+    s->replies_len += put_value(out, ok, value);
+    return;
+  case CALC_OP_SHUTDOWN:
+    if (n != 0) break;
+    request_shutdown();
+    c->closing = 1;
+    return;
+  }
+  conn_bad_frame(s, c);
+}
+
+// Carry out the complete binary requests in c->in
+static void conn_frames(struct ConnScratch *s, struct Conn *c) {
+  char *frame;
+  while (!c->closing &&
+         reader_peek(&c->in, CALC_FRAME_HEADER, &frame) == FRAME_LINE) {
+    uint32_t len = calc_get_u32(frame);
+    if (len == 0 || len > c->in.max_line) {
+      conn_bad_frame(s, c);
+      break;
+    }
+    if (reader_peek(&c->in, CALC_FRAME_HEADER + len, &frame) != FRAME_LINE) {
+      break;
+    }
+    reader_skip(&c->in, CALC_FRAME_HEADER + len);
+    conn_frame(s, c, (unsigned char) frame[CALC_FRAME_HEADER],
+               frame + CALC_FRAME_HEADER + 1, len - 1);
+  }
+  // the batch points into the input, so it is done before returning
+  conn_run_batch(s, c);
+}
+
+void conn_lines(struct ConnScratch *s, struct Conn *c) {
+  char *line;
+  size_t len;
+  if (c->proto == PROTO_UNKNOWN) {
+    if (reader_peek(&c->in, 1, &line) != FRAME_LINE) return;
+    c->proto = PROTO_TEXT;
+    if ((unsigned char) line[0] == CALC_PROTO_MAGIC) {
+      reader_skip(&c->in, 1);
+      c->proto = PROTO_BINARY;
+    }
+  }
+  if (c->proto == PROTO_BINARY) {
+    conn_frames(s, c);
+    conn_account(s, c);
+    return;
+  }
+  while (!c->closing) {
+    enum FrameStatus status = reader_next(&c->in, &line, &len);
+    if (status == FRAME_MORE) break;
+    conn_line(s, c, status == FRAME_LINE ? line : NULL);
+  }
+  // the batch points into the input, so it is done before returning
+  conn_run_batch(s, c);
+  conn_account(s, c);
+}
+
+void conn_input(struct ConnScratch *s, struct Conn *c, char *data, size_t n) {
+  reader_append(&c->in, data, n);
+  conn_lines(s, c);
+  reader_release(&c->in);
+}
+
+void conn_end_input(struct ConnScratch *s, struct Conn *c) {
+  char *line;
+  size_t len;
+  if (!c->closing && c->proto != PROTO_BINARY) {
+    /* a last line without newline is evaluated, never a command */
+    switch (reader_rest(&c->in, &line, &len)) {
+    case FRAME_LINE:
+      s->requests++;
+      s->batch[s->batch_n++] = line;
+      conn_run_batch(s, c);
+      break;
+    case FRAME_TOO_LONG:
+      conn_line(s, c, NULL);
+      break;
+    case FRAME_MORE:
+      break;
+    }
+    conn_account(s, c);
+  }
+  c->closing = 1;
+}
+
+void conn_queue(struct ConnScratch *s, struct Conn *c) {
+  append(&c->out, &c->outlen, &c->outcap, s->replies, s->replies_len);
+  s->replies_len = 0;
+}
+
+// Send the queued replies in c->out followed by those collected in
+// s->replies, both in one sendmsg. With more, further replies are
+// about to follow, so MSG_MORE lets the kernel hold back a segment
+// that isn't full until they do. Whatever the socket doesn't take is
+// queued in c->out, leaving s->replies empty; 0 on error.
+static int conn_send(struct ConnScratch *s, struct Conn *c, int more) {
+  size_t done = 0; // of s->replies
+  for (;;) {
+    struct iovec iov[2];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    if (c->outpos < c->outlen) {
+      iov[msg.msg_iovlen].iov_base = c->out + c->outpos;
+      iov[msg.msg_iovlen++].iov_len = c->outlen - c->outpos;
+    }
+    if (done < s->replies_len) {
+      iov[msg.msg_iovlen].iov_base = s->replies + done;
+      iov[msg.msg_iovlen++].iov_len = s->replies_len - done;
+    }
+    if (msg.msg_iovlen == 0) break;
+    ssize_t sent = sendmsg(c->fd, &msg, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+    if (sent < 0) {
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        s->replies_len = 0;
+        return 0;
+      }
+      break;
+    }
+    size_t queued = c->outlen - c->outpos;
+    if ((size_t) sent < queued) {
+      c->outpos += sent;
+    } else {
+      c->outpos = c->outlen;
+      done += sent - queued;
+    }
+  }
+  if (c->outpos == c->outlen && c->out != NULL) {
+    // drop the buffer, an idle connection shouldn't hold one
+    free(c->out);
+    c->out = NULL;
+    c->outpos = c->outlen = c->outcap = 0;
+  }
+  if (done < s->replies_len) {
+    append(&c->out, &c->outlen, &c->outcap,
+           s->replies + done, s->replies_len - done);
+  }
+  s->replies_len = 0;
+  return 1;
+}
+
+// Bytes of replies waiting to be sent
+static size_t conn_pending(struct ConnScratch *s, struct Conn *c) {
+  return c->outlen - c->outpos + s->replies_len;
+}
+
+int conn_flush(struct ConnScratch *s, struct Conn *c, int dry) {
+  if (!dry && conn_pending(s, c) < OUTBUF_FLUSH && !c->closing) return 1;
+  return conn_send(s, c, !dry && !c->closing);
+}
+
+enum ConnStatus conn_service(struct ConnScratch *s, struct Conn *c) {
+  size_t quantum = CONN_QUANTUM; // input left to read this turn
+  for (;;) {
+    if (c->closing || c->outlen - c->outpos >= max_output) {
+      if (!conn_send(s, c, 0)) {
+        conn_close(c);
+        return CONN_CLOSED;
+      }
+      if (c->closing && c->out == NULL) {
+        conn_close(c);
+        return CONN_CLOSED;
+      }
+      if (c->closing || c->outlen - c->outpos >= max_output) {
+        return CONN_BLOCKED;
+      }
+    }
+    if (quantum == 0) {
+      // the turn is over; the replies wait in c->out like any others
+      // while more input is coming, as its next turn is near
+      if (!conn_flush(s, c, 0)) {
+        conn_close(c);
+        return CONN_CLOSED;
+      }
+      if (s->replies_len > 0) conn_queue(s, c);
+      return CONN_READY;
+    }
+    ssize_t n = read(c->fd, s->readbuf,
+                     quantum < READBUF_SIZE ? quantum : READBUF_SIZE);
+    if (n > 0) {
+      quantum -= n;
+      conn_input(s, c, s->readbuf, n);
+    } else if (n == 0) {
+      conn_end_input(s, c);
+      continue;
+    } else if (errno == EINTR) {
+      continue;
+    } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      s->replies_len = 0;
+      conn_close(c);
+      return CONN_CLOSED;
+    }
+    int dry = n < 0; // EAGAIN
+    if (!conn_flush(s, c, dry)) {
+      conn_close(c);
+      return CONN_CLOSED;
+    }
+    if (dry && !c->closing) {
+      return c->out != NULL ? CONN_WRITING : CONN_IDLE;
+    }
+  }
+}
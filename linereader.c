@@ -0,0 +1,170 @@
+// Authors:
+// Jack Zhang (jzhan237)
+// Tony Pan (jpan26)
+//
+// Line framing for the calculator programs (see linereader.h).
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "linereader.h"
+
+void reader_init(struct LineReader *r, size_t max_line) {
+  r->buf = r->own = NULL;
+  r->pos = r->len = r->cap = r->scanned = 0;
+  r->max_line = max_line;
+  r->lent = 0;
+  r->skipping = 0;
+}
+
+void reader_free(struct LineReader *r) {
+  free(r->own);
+  reader_init(r, r->max_line);
+}
+
+// Make room for n more bytes after the input in the own buffer (which
+// must hold the input), plus one for a NUL after it
+static void reserve(struct LineReader *r, size_t n) {
+  if (r->pos == r->len) {
+    r->pos = r->len = 0;
+  }
+  if (r->len + n + 1 <= r->cap) return;
+  if (r->pos > 0) {
+    // move the unfinished line to the front first
+    memmove(r->own, r->own + r->pos, r->len - r->pos);
+    r->len -= r->pos;
+    r->pos = 0;
+    if (r->len + n + 1 <= r->cap) return;
+  }
+  size_t cap = r->cap ? r->cap : READER_FILL_SIZE;
+  while (cap < r->len + n + 1) cap *= 2;
+  char *own = realloc(r->own, cap);
+  if (own == NULL) abort();
+  r->buf = r->own = own;
+  r->cap = cap;
+}
+
+ssize_t reader_fill(struct LineReader *r, int fd) {
+  if (r->lent) reader_release(r);
+  reserve(r, READER_FILL_SIZE);
+  ssize_t n = read(fd, r->own + r->len, r->cap - r->len - 1);
+  if (n > 0) r->len += n;
+  return n;
+}
+
+ssize_t reader_recv(struct LineReader *r, int fd, int flags) {
+  if (r->lent) reader_release(r);
+  reserve(r, READER_FILL_SIZE);
+  ssize_t n = recv(fd, r->own + r->len, r->cap - r->len - 1, flags);
+  if (n > 0) r->len += n;
+  return n;
+}
+
+void reader_append(struct LineReader *r, char *data, size_t n) {
+  if (!r->lent && r->pos == r->len) {
+    // nothing left over: frame the lines where they are
+    r->buf = data;
+    r->pos = 0;
+    r->len = n;
+    r->scanned = 0;
+    r->lent = 1;
+    return;
+  }
+  reader_release(r);
+  reserve(r, n);
+  memcpy(r->own + r->len, data, n);
+  r->len += n;
+}
+
+void reader_release(struct LineReader *r) {
+  if (r->lent) {
+    char *data = r->buf + r->pos;
+    size_t n = r->len - r->pos;
+    r->lent = 0;
+    r->buf = r->own;
+    r->pos = r->len = 0;
+    if (n > 0) {
+      reserve(r, n);
+      memcpy(r->own, data, n);
+      r->len = n;
+    }
+  }
+  if (r->pos == r->len && r->own != NULL) {
+    // a connection waiting for input shouldn't hold a buffer
+    free(r->own);
+    r->buf = r->own = NULL;
+    r->pos = r->len = r->cap = 0;
+  }
+}
+
+enum FrameStatus reader_next(struct LineReader *r, char **line, size_t *len) {
+  for (;;) {
+    char *start = r->buf + r->pos;
+    size_t avail = r->len - r->pos;
+    char *nl = NULL;
+    if (r->scanned < avail) {
+      nl = memchr(start + r->scanned, '\n', avail - r->scanned);
+    }
+    if (nl == NULL) {
+      r->scanned = avail;
+      // room for a '\r' before the newline still to come
+      if (!r->skipping && avail > r->max_line + 1) {
+        r->skipping = 1;
+        r->pos = r->len;
+        r->scanned = 0;
+        return FRAME_TOO_LONG;
+      }
+      if (r->skipping) {
+        r->pos = r->len;
+        r->scanned = 0;
+      }
+      return FRAME_MORE;
+    }
+    size_t n = nl - start;
+    r->pos += n + 1;
+    r->scanned = 0;
+    if (r->skipping) {
+      // the end of a line already reported as too long
+      r->skipping = 0;
+      continue;
+    }
+    if (n > 0 && start[n - 1] == '\r') n--;
+    if (n > r->max_line) return FRAME_TOO_LONG;
+    start[n] = '\0';
+    *line = start;
+    *len = n;
+    return FRAME_LINE;
+  }
+}
+
+enum FrameStatus reader_peek(struct LineReader *r, size_t n, char **data) {
+  if (r->len - r->pos < n) return FRAME_MORE;
+  *data = r->buf + r->pos;
+  return FRAME_LINE;
+}
+
+void reader_skip(struct LineReader *r, size_t n) {
+  r->pos += n;
+  r->scanned = 0;
+}
+
+enum FrameStatus reader_rest(struct LineReader *r, char **line, size_t *len) {
+  if (r->skipping) {
+    r->skipping = 0;
+    r->pos = r->len;
+    return FRAME_MORE;
+  }
+  if (r->pos == r->len) return FRAME_MORE;
+  size_t n = r->len - r->pos;
+  if (n > r->max_line) {
+    r->pos = r->len;
+    return FRAME_TOO_LONG;
+  }
+  // the own buffer always has room for the NUL
+  reader_release(r);
+  *line = r->buf + r->pos;
+  *len = n;
+  r->buf[r->len] = '\0';
+  r->pos = r->len;
+  return FRAME_LINE;
+}
@@ -0,0 +1,75 @@
+// Authors:
+// Jack Zhang (jzhan237)
+// Tony Pan (jpan26)
+#ifndef LINEREADER_H
+#define LINEREADER_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* longest line accepted unless the reader is told otherwise */
+#define DEFAULT_MAX_LINE 65536
+
+// Splits input into lines by searching whole blocks for newlines
+// (memchr, which glibc vectorizes) instead of going byte by byte like
+// rio_readlineb. Lines are returned as views into the buffer, made
+// NUL-terminated in place by overwriting their newline ("\r\n" and
+// "\n" both end a line and neither is part of the view), so they stay
+// valid until the next reader_fill or reader_append.
+//
+// The input is either read into the reader's own buffer (reader_fill),
+// or appended from a buffer of the caller's (reader_append), which is
+// used in place when the reader holds nothing, so that only the part
+// of a line left over at the end has to be copied.
+struct LineReader {
+  char *buf;            // the input: own, or the caller's while lent
+  size_t pos;           // start of the input not returned yet
+  size_t len;           // end of the input
+  char *own;            // the reader's own buffer (NULL until needed)
+  size_t cap;
+  size_t scanned;       // input from pos on already searched for '\n'
+  size_t max_line;
+  int lent;             // buf is the caller's
+  int skipping;         // dropping the rest of a line that is too long
+};
+
+// What reader_next found
+enum FrameStatus {
+  FRAME_LINE,           // a line
+  FRAME_TOO_LONG,       // a line longer than max_line, which is dropped
+  FRAME_MORE            // no complete line: more input is needed
+};
+
+void reader_init(struct LineReader *r, size_t max_line);
+void reader_free(struct LineReader *r);
+
+/* bytes reader_fill asks read for, at least: getting fewer means the
+   input has run dry for now */
+#define READER_FILL_SIZE 16384
+
+// Read once from fd into the reader; returns what read returned
+ssize_t reader_fill(struct LineReader *r, int fd);
+// The same with recv on a socket, passing it flags
+ssize_t reader_recv(struct LineReader *r, int fd, int flags);
+
+// Add n bytes of input at data, which must stay unchanged (and
+// writable) until reader_release is called
+void reader_append(struct LineReader *r, char *data, size_t n);
+// Copy what is left of the input lent by reader_append into the
+// reader's own buffer
+void reader_release(struct LineReader *r);
+
+// Find the next line, setting *line and *len for FRAME_LINE
+enum FrameStatus reader_next(struct LineReader *r, char **line, size_t *len);
+
+// For input that isn't made of lines: point *data at the next n bytes
+// of input, which stay there until reader_skip consumes them, if there
+// are that many yet (FRAME_LINE; FRAME_MORE if not)
+enum FrameStatus reader_peek(struct LineReader *r, size_t n, char **data);
+void reader_skip(struct LineReader *r, size_t n);
+
+// At the end of input: the last line if it had no newline. Returns
+// FRAME_MORE if there is none (or what is left was being dropped).
+enum FrameStatus reader_rest(struct LineReader *r, char **line, size_t *len);
+
+#endif // LINEREADER_H
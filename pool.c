@@ -0,0 +1,326 @@
+// Authors:
+// Jack Zhang (jzhan237)
+// Tony Pan (jpan26)
+//
+// Thread pool server mode: a fixed set of worker threads share one
+// epoll set in which every connection (and each listening socket) is
+// registered with EPOLLONESHOT, so that whichever worker receives an
+// event owns that connection until it re-arms it. A worker pushes the
+// events it receives onto its own deque and works through them; idle
+// workers steal from the other end of busy workers' deques.
+#include "csapp.h"
+#include "calc.h"
+#include "server.h"
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+/* capacity of a worker's deque (a power of two) */
+#define DEQUE_SIZE 1024
+/* events taken per epoll_wait */
+#define POOL_EVENTS 64
+/* connections accepted per turn before letting other work run */
+#define ACCEPT_BATCH 64
+
+// Chase-Lev work-stealing deque: the owner pushes and takes at the
+// bottom, thieves steal from the top.
+struct Deque {
+  atomic_long top;
+  char pad[64 - sizeof(atomic_long)]; // keep thieves off the owner's line
+  atomic_long bottom;
+  _Atomic(void *) tasks[DEQUE_SIZE];
+};
+
+struct Pool;
+
+struct Worker {
+  struct Pool *pool;
+  pthread_t thread;
+  unsigned next_victim;
+  struct Deque deque;
+  struct ConnScratch scratch;
+};
+
+struct Pool {
+  int epfd;
+  struct Listeners listen;
+  int reserve_fd;
+  int wakefd;           // written to have an idle worker come and steal
+  int stopfd;           // becomes readable once all work is done
+  pthread_mutex_t accept_lock;
+  atomic_int listening; // only cleared, under accept_lock
+  atomic_int nconns;
+  int nworkers;
+  struct Worker *workers;
+};
+
+// Push task; 0 if the deque is full
+static int deque_push(struct Deque *d, void *task) {
+  long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+  long t = atomic_load_explicit(&d->top, memory_order_acquire);
+  if (b - t >= DEQUE_SIZE) return 0;
+  atomic_store_explicit(&d->tasks[b & (DEQUE_SIZE - 1)], task,
+                        memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+  return 1;
+}
+
+// Take the most recently pushed task (owner only); NULL if empty
+static void *deque_take(struct Deque *d) {
+  long b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+  atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  long t = atomic_load_explicit(&d->top, memory_order_relaxed);
+  void *task = NULL;
+  if (t <= b) {
+    task = atomic_load_explicit(&d->tasks[b & (DEQUE_SIZE - 1)],
+                                memory_order_relaxed);
+    if (t == b) {
+      // last task: race thieves for it
+      if (!atomic_compare_exchange_strong_explicit(
+            &d->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed)) {
+        task = NULL;
+      }
+      atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    }
+  } else {
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+  }
+  return task;
+}
+
+// Steal the oldest task; NULL if empty or another thread got it first
+static void *deque_steal(struct Deque *d) {
+  long t = atomic_load_explicit(&d->top, memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  long b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+  if (t >= b) return NULL;
+  void *task = atomic_load_explicit(&d->tasks[t & (DEQUE_SIZE - 1)],
+                                    memory_order_relaxed);
+  if (!atomic_compare_exchange_strong_explicit(
+        &d->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed)) {
+    return NULL;
+  }
+  return task;
+}
+
+static void *steal_any(struct Worker *w) {
+  struct Pool *p = w->pool;
+  for (int i = 1; i < p->nworkers; i++) {
+    struct Worker *victim = &p->workers[(w->next_victim + i) % p->nworkers];
+    if (victim == w) continue;
+    void *task = deque_steal(&victim->deque);
+    if (task != NULL) {
+      w->next_victim = victim - p->workers;
+      return task;
+    }
+  }
+  return NULL;
+}
+
+static void signal_fd(int fd) {
+  uint64_t one = 1;
+  if (write(fd, &one, sizeof(one)) < 0) {
+    // the counter can't overflow in practice; nothing to do
+  }
+}
+
+// Wake every worker to exit once nothing is left to serve
+// (connections are only added under accept_lock while listening, so
+// once it is cleared the count can only go down)
+static void check_finished(struct Pool *p) {
+  if (!atomic_load(&p->listening) && atomic_load(&p->nconns) == 0) {
+    signal_fd(p->stopfd);
+  }
+}
+
+// After a shutdown: stop accepting, the open connections finish normally
+static void stop_listening(struct Pool *p) {
+  pthread_mutex_lock(&p->accept_lock);
+  if (atomic_load(&p->listening)) {
+    atomic_store(&p->listening, 0);
+    for (int i = 0; i < p->listen.n; i++) {
+      epoll_ctl(p->epfd, EPOLL_CTL_DEL, p->listen.fds[i], NULL);
+    }
+  }
+  pthread_mutex_unlock(&p->accept_lock);
+  check_finished(p);
+}
+
+// Wait for events on c again, or close it if that fails. The set is
+// level-triggered, so a connection that used up its quantum
+// (CONN_READY) and still has input is reported again at once, but
+// behind the events already waiting: that is its place in the queue.
+static void arm(struct Pool *p, struct Conn *c, enum ConnStatus status) {
+  struct epoll_event ev;
+  ev.events = EPOLLONESHOT | EPOLLRDHUP;
+  if (status != CONN_BLOCKED) ev.events |= EPOLLIN;
+  if (status != CONN_IDLE) ev.events |= EPOLLOUT;
+  ev.data.ptr = c;
+  int op = c->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+  c->registered = 1;
+  if (epoll_ctl(p->epfd, op, c->fd, &ev) < 0) {
+    conn_close(c);
+    atomic_fetch_sub(&p->nconns, 1);
+    check_finished(p);
+  }
+}
+
+static void run_conn(struct Worker *w, struct Conn *c) {
+  struct Pool *p = w->pool;
+  enum ConnStatus status = conn_service(&w->scratch, c);
+  if (status == CONN_CLOSED) {
+    atomic_fetch_sub(&p->nconns, 1);
+    check_finished(p);
+  } else {
+    arm(p, c, status);
+  }
+  if (shut_down) stop_listening(p);
+}
+
+// The listening socket a task is, or NULL for a connection
+static int *listener_of(struct Pool *p, void *task) {
+  int *fd = task;
+  return fd >= p->listen.fds && fd < p->listen.fds + p->listen.n ? fd : NULL;
+}
+
+// Accept a batch of connections from *listenfd onto this worker's
+// deque, where they get serviced right away (or stolen by idle workers)
+static void run_accept(struct Worker *w, int *listenfd) {
+  struct Pool *p = w->pool;
+  struct Conn *overflow = NULL;  // accepted when the deque was full
+  int pushed = 0;
+  pthread_mutex_lock(&p->accept_lock);
+  if (atomic_load(&p->listening)) {
+    int fd;
+    for (int i = 0; i < ACCEPT_BATCH && overflow == NULL; i++) {
+      if ((fd = accept_conn(*listenfd, &p->reserve_fd)) < 0) break;
+      struct Conn *c = conn_create(fd);
+      atomic_fetch_add(&p->nconns, 1);
+      if (deque_push(&w->deque, c)) {
+        pushed++;
+      } else {
+        overflow = c;
+      }
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = listenfd;
+    epoll_ctl(p->epfd, EPOLL_CTL_MOD, *listenfd, &ev);
+  }
+  pthread_mutex_unlock(&p->accept_lock);
+  if (pushed > 1) signal_fd(p->wakefd);
+  if (overflow != NULL) run_conn(w, overflow);
+}
+
+static void *worker_main(void *arg) {
+  struct Worker *w = arg;
+  struct Pool *p = w->pool;
+  struct epoll_event events[POOL_EVENTS];
+
+  for (;;) {
+    void *task = deque_take(&w->deque);
+    if (task == NULL) task = steal_any(w);
+    if (task != NULL && listener_of(p, task) != NULL) {
+      run_accept(w, task);
+      continue;
+    }
+    if (task != NULL) {
+      run_conn(w, task);
+      continue;
+    }
+
+    int n = epoll_wait(p->epfd, events, POOL_EVENTS, -1);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      unix_error("epoll_wait error");
+    }
+    int pushed = 0, stop = 0;
+    for (int i = 0; i < n; i++) {
+      void *t = events[i].data.ptr;
+      if (t == &p->stopfd) {
+        stop = 1;
+      } else if (t == &shutdown_event) {
+        stop_listening(p);
+      } else if (t == &p->wakefd) {
+        uint64_t count;
+        if (read(p->wakefd, &count, sizeof(count)) < 0) {
+          // another worker already reset it
+        }
+      } else if (deque_push(&w->deque, t)) {
+        pushed++;
+      } else if (listener_of(p, t) != NULL) {
+        run_accept(w, t);
+      } else {
+        run_conn(w, t);
+      }
+    }
+    if (stop) break;
+    // more than we can start on at once: get an idle worker to help
+    if (pushed > 1) signal_fd(p->wakefd);
+  }
+  return NULL;
+}
+
+// Add fd to the epoll set with ptr as its token
+static void watch(struct Pool *p, int fd, uint32_t events, void *ptr) {
+  struct epoll_event ev;
+  ev.events = events;
+  ev.data.ptr = ptr;
+  if (epoll_ctl(p->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    unix_error("epoll_ctl error");
+  }
+}
+
+void pool_run(const struct Listeners *listen, struct Calc *calc,
+              int nthreads) {
+  struct Pool *p = Malloc(sizeof(struct Pool));
+  p->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (p->epfd < 0) unix_error("epoll_create1 error");
+  p->listen = *listen;
+  p->reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  p->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  p->stopfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (p->wakefd < 0 || p->stopfd < 0) unix_error("eventfd error");
+  pthread_mutex_init(&p->accept_lock, NULL);
+  atomic_init(&p->listening, 1);
+  atomic_init(&p->nconns, 0);
+  p->nworkers = nthreads;
+
+  for (int i = 0; i < p->listen.n; i++) {
+    set_nonblocking(p->listen.fds[i]);
+    watch(p, p->listen.fds[i], EPOLLIN | EPOLLONESHOT, &p->listen.fds[i]);
+  }
+  // each wake-up write is reported to one worker; the stop event
+  // stays readable, so every worker sees it
+  watch(p, p->wakefd, EPOLLIN | EPOLLET, &p->wakefd);
+  watch(p, p->stopfd, EPOLLIN, &p->stopfd);
+  // a shutdown requested outside the pool (by a shared-memory client)
+  watch(p, shutdown_event, EPOLLIN | EPOLLONESHOT, &shutdown_event);
+
+  p->workers = Calloc(nthreads, sizeof(struct Worker));
+  for (int i = 0; i < nthreads; i++) {
+    struct Worker *w = &p->workers[i];
+    w->pool = p;
+    w->next_victim = i;
+    atomic_init(&w->deque.top, 0);
+    atomic_init(&w->deque.bottom, 0);
+    conn_scratch_init(&w->scratch, calc);
+  }
+  for (int i = 0; i < nthreads; i++) {
+    Pthread_create(&p->workers[i].thread, NULL, worker_main, &p->workers[i]);
+  }
+  for (int i = 0; i < nthreads; i++) {
+    Pthread_join(p->workers[i].thread, NULL);
+    conn_scratch_cleanup(&p->workers[i].scratch);
+  }
+
+  free(p->workers);
+  pthread_mutex_destroy(&p->accept_lock);
+  if (p->reserve_fd >= 0) close(p->reserve_fd);
+  close(p->wakefd);
+  close(p->stopfd);
+  close(p->epfd);
+  free(p);
+}
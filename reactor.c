@@ -0,0 +1,187 @@
+// Authors:
+// Jack Zhang (jzhan237)
+// Tony Pan (jpan26)
+//
+// Event-driven server mode: a single thread serves every connection
+// from an edge-triggered epoll loop. Each connection is a small struct
+// (see conn.c) instead of a thread with its own stack and rio buffer.
+//
+// A connection gets a quantum of input per turn (conn_service); one
+// that had more waits in a FIFO of ready connections. Between two
+// turns from that queue the loop polls for events without blocking
+// and services them first, so a client sending a line now and then,
+// or a control command like shutdown or STATS, waits for at most one
+// quantum of a busy client's input rather than all of it.
+#include "csapp.h"
+#include "calc.h"
+#include "server.h"
+#include <sys/epoll.h>
+
+/* events handled per epoll_wait */
+#define MAX_EVENTS 256
+
+struct Reactor {
+  int epfd;
+  struct Listeners listen;  // n is 0 once shutting down
+  int reserve_fd;       // spare fd for shedding connections at EMFILE
+  int nconns;
+  // connections that used up their quantum, oldest first
+  struct Conn *ready_head, *ready_tail;
+  struct ConnScratch scratch;
+};
+
+// The listening socket an event with token ptr is for, or NULL
+static int *listener_of(struct Reactor *r, void *ptr) {
+  int *fd = ptr;
+  return fd >= r->listen.fds && fd < r->listen.fds + r->listen.n ? fd : NULL;
+}
+
+// Accept every pending connection on listenfd
+static void accept_all(struct Reactor *r, int listenfd) {
+  int fd;
+  while ((fd = accept_conn(listenfd, &r->reserve_fd)) >= 0) {
+    struct Conn *c = conn_create(fd);
+    // readiness for both directions is reported on every change
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = c;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      conn_close(c);
+      continue;
+    }
+    r->nconns++;
+  }
+}
+
+// Service c, queueing it for another turn if it wants one
+static void reactor_service(struct Reactor *r, struct Conn *c) {
+  switch (conn_service(&r->scratch, c)) {
+  case CONN_CLOSED:
+    r->nconns--;
+    break;
+  case CONN_READY:
+    c->ready = 1;
+    c->next_ready = NULL;
+    if (r->ready_tail != NULL) r->ready_tail->next_ready = c;
+    else r->ready_head = c;
+    r->ready_tail = c;
+    break;
+  default:
+    // edge-triggered, so a connection waiting for more input or
+    // for the socket to drain is simply reported again
+    break;
+  }
+}
+
+void reactor_run(const struct Listeners *listen, struct Calc *calc) {
+  struct Reactor *r = Malloc(sizeof(struct Reactor));
+  r->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (r->epfd < 0) unix_error("epoll_create1 error");
+  r->listen = *listen;
+  r->reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  r->nconns = 0;
+  r->ready_head = r->ready_tail = NULL;
+  conn_scratch_init(&r->scratch, calc);
+
+  // the listening sockets are level-triggered, their entry in
+  // r->listen tells them apart
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  for (int i = 0; i < r->listen.n; i++) {
+    set_nonblocking(r->listen.fds[i]);
+    ev.data.ptr = &r->listen.fds[i];
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->listen.fds[i], &ev) < 0) {
+      unix_error("epoll_ctl error");
+    }
+  }
+  // wakes us up when a shutdown comes from another thread
+  ev.data.ptr = &shutdown_event;
+  if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, shutdown_event, &ev) < 0) {
+    unix_error("epoll_ctl error");
+  }
+
+  struct epoll_event events[MAX_EVENTS];
+  while (r->listen.n > 0 || r->nconns > 0) {
+    int n = epoll_wait(r->epfd, events, MAX_EVENTS,
+                       r->ready_head != NULL ? 0 : -1);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      unix_error("epoll_wait error");
+    }
+    for (int i = 0; i < n; i++) {
+      int *listenfd = listener_of(r, events[i].data.ptr);
+      if (listenfd != NULL) {
+        accept_all(r, *listenfd);
+      } else if (events[i].data.ptr == &shutdown_event) {
+        // it stays readable: seen once is enough
+        epoll_ctl(r->epfd, EPOLL_CTL_DEL, shutdown_event, NULL);
+      } else if (!((struct Conn *) events[i].data.ptr)->ready) {
+        // (one in the queue is serviced when its turn comes)
+        reactor_service(r, events[i].data.ptr);
+      }
+    }
+    // then one turn for the connection that has waited longest
+    struct Conn *c = r->ready_head;
+    if (c != NULL) {
+      r->ready_head = c->next_ready;
+      if (r->ready_head == NULL) r->ready_tail = NULL;
+      c->ready = 0;
+      reactor_service(r, c);
+    }
+    if (shut_down && r->listen.n > 0) {
+      // stop accepting; the connections already open finish normally
+      for (int i = 0; i < r->listen.n; i++) {
+        epoll_ctl(r->epfd, EPOLL_CTL_DEL, r->listen.fds[i], NULL);
+      }
+      r->listen.n = 0;
+    }
+  }
+
+  if (r->reserve_fd >= 0) close(r->reserve_fd);
+  close(r->epfd);
+  conn_scratch_cleanup(&r->scratch);
+  free(r);
+}
+
+struct ReactorThread {
+  pthread_t thread;
+  struct Listeners listen;
+  int cpu;              // -1: not pinned
+  struct Calc *calc;
+};
+
+static void *reactor_thread(void *arg) {
+  struct ReactorThread *t = arg;
+  if (t->cpu >= 0 && pin_thread(t->cpu) != 0) {
+    fprintf(stderr, "Could not pin a reactor to CPU %d\n", t->cpu);
+  }
+  reactor_run(&t->listen, t->calc);
+  return NULL;
+}
+
+void multi_reactor_run(const char *port, int unixfd, struct Calc *calc,
+                       int n, const int *cpus) {
+  struct ReactorThread *threads = Calloc(n, sizeof(struct ReactorThread));
+  // open every socket first, so the kernel spreads connections over
+  // all of them from the start
+  for (int i = 0; i < n; i++) {
+    threads[i].listen.fds[0] = open_reuseport_listenfd(port);
+    threads[i].listen.n = 1;
+    if (threads[i].listen.fds[0] < 0) {
+      fprintf(stderr, "Could not listen on port %s\n", port);
+      exit(1);
+    }
+    // AF_UNIX has no SO_REUSEPORT: they all accept from the one socket
+    if (unixfd >= 0) threads[i].listen.fds[threads[i].listen.n++] = unixfd;
+    threads[i].cpu = cpus ? cpus[i] : -1;
+    threads[i].calc = calc;
+  }
+  for (int i = 0; i < n; i++) {
+    Pthread_create(&threads[i].thread, NULL, reactor_thread, &threads[i]);
+  }
+  for (int i = 0; i < n; i++) {
+    Pthread_join(threads[i].thread, NULL);
+    close(threads[i].listen.fds[0]);
+  }
+  free(threads);
+}
@@ -0,0 +1,253 @@
+// Authors:
+// Jack Zhang (jzhan237)
+// Tony Pan (jpan26)
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "calc.h"
+#include "linereader.h"
+
+/* longest reply to a line: "Error\n" or an int and a newline */
+#define REPLY_MAX 16
+
+/* most reactors in reuseport mode */
+#define MAX_REACTORS 256
+
+// set once a client sends "shutdown"
+extern volatile int shut_down;
+// eventfd that becomes readable (and stays so) once shut_down is set,
+// so that event loops blocked in epoll_wait notice
+extern int shutdown_event;
+
+// Set shut_down and signal shutdown_event
+void request_shutdown(void);
+
+// What a line of input asks for
+enum LineAction {
+  LINE_REPLY,      // evaluate it and send the reply
+  LINE_QUIT,       // close this connection
+  LINE_SHUTDOWN,   // close this connection and shut down the server
+  LINE_PREPARE,    // PREPARE expr: compile expr, reply with a handle for it
+  LINE_EXEC,       // EXEC handle: run a prepared expression
+  LINE_DEALLOCATE, // DEALLOCATE handle: free the handle, reply with it
+  LINE_LIMIT,      // LIMIT name [value]: set a limit, reply with its value
+  LINE_STATS       // STATS name [uid]: reply with one of the counters
+};
+
+/* prepared statements a connection may hold at once */
+#define STATEMENTS_MAX 64
+
+// Limits on what the server takes on, set on the command line and
+// changed at run time with "LIMIT name value" (see conn.c). They are
+// read as they are, without locking: a change is seen a little late
+// at worst.
+//
+// longest line of input a client may send (-l; LIMIT line); a
+// connection keeps the one it started with
+extern volatile size_t max_line;
+// connections open at once (-C; LIMIT conns): those over it are
+// turned away with "Busy"
+extern volatile size_t max_conns;
+// bytes of replies a connection may have waiting before its input is
+// no longer read (-O; LIMIT output)
+extern volatile size_t max_output;
+
+#define DEFAULT_MAX_CONNS 100000
+#define DEFAULT_MAX_OUTPUT 65536
+
+// Classify a line of input (NUL-terminated, without its newline); for
+// the statement commands, *arg is set to the text after the command
+enum LineAction line_action(const char *line, const char **arg);
+
+// Write the reply to a line that gave value, or "Error" if !ok, at
+// reply (REPLY_MAX bytes); returns its length
+size_t format_reply(int ok, int value, char *reply);
+
+// Evaluate n lines of input that are all LINE_REPLY, in order, with
+// calc_eval_batch, and write their replies to replies, which has room
+// for n * REPLY_MAX bytes; returns the length written. Every server
+// mode answers through this, so they all answer alike.
+size_t eval_lines(
+  struct Calc *calc, const char *const *lines, size_t n, char *replies);
+
+/* bytes read from a socket at a time */
+#define READBUF_SIZE 65536
+/* replies gathered before a write while input keeps coming */
+#define OUTBUF_FLUSH 16384
+/* lines evaluated together */
+#define BATCH_LINES 64
+/* bytes of input a connection is serviced for per turn; one that has
+   more waits for the other ready connections to have their turn */
+#define CONN_QUANTUM 16384
+
+// Which protocol a connection speaks, told by its first byte
+enum ConnProto {
+  PROTO_UNKNOWN,        // nothing read yet
+  PROTO_TEXT,           // lines of text
+  PROTO_BINARY          // frames (see calcproto.h)
+};
+
+// A connection on a non-blocking socket (conn.c)
+struct Conn {
+  int fd;
+  int closing;          // quit, shutdown or end of input: close once flushed
+  int registered;       // added to an epoll set yet
+  int ready;            // waiting for another turn (reactor.c)
+  struct Conn *next_ready;
+  enum ConnProto proto;
+  // prepared statements by handle (NULL until the first PREPARE)
+  struct CalcStatement **statements;
+  struct PeerAccount *account;  // NULL unless an accounted AF_UNIX peer
+  char *out;            // replies not sent yet (NULL if none)
+  size_t outpos, outlen, outcap;
+  struct LineReader in; // input not made into lines yet
+};
+
+// Buffers of a thread that services connections
+struct ConnScratch {
+  struct Calc *calc;
+  char *replies;        // replies to the input being processed
+  size_t replies_len, replies_cap;
+  // complete lines not evaluated yet (views into the input)
+  const char *batch[BATCH_LINES];
+  size_t batch_n;
+  size_t requests;      // carried out, not yet added to their account
+  char readbuf[READBUF_SIZE];
+};
+
+// What a connection waits for after being serviced
+enum ConnStatus {
+  CONN_IDLE,            // more input
+  CONN_WRITING,         // the socket to take queued replies, or more input
+  CONN_BLOCKED,         // the socket to take queued replies, before reading on
+  CONN_READY,           // another turn: it used up its quantum, and more
+                        // input may be waiting already
+  CONN_CLOSED           // nothing: it has been closed and freed
+};
+
+void set_nonblocking(int fd);
+void set_blocking(int fd);
+// Turn off Nagle's algorithm: replies are already gathered into one
+// write per batch of input, and holding a batch back until the last
+// one is acknowledged only adds the client's delayed ACK to it
+void set_nodelay(int fd);
+
+// Like open_listenfd, with SO_REUSEPORT so that several sockets can
+// listen on the same port, the kernel spreading connections over them
+int open_reuseport_listenfd(const char *port);
+// Listen on an AF_UNIX stream socket at path (-u), replacing a socket
+// left there by an earlier server but nothing else; -1 on error
+int open_unix_listenfd(const char *path);
+
+/* listening sockets a server mode serves: the TCP port and -u */
+#define MAX_LISTENERS 2
+struct Listeners {
+  int fds[MAX_LISTENERS];
+  int n;
+};
+
+// Accept a connection on the non-blocking listenfd and make it
+// non-blocking; -1 when none is pending. reserve_fd is a spare
+// descriptor (open on /dev/null) for turning clients away when
+// out of descriptors. Connections over max_conns are turned away
+// by conn_admit and never returned.
+int accept_conn(int listenfd, int *reserve_fd);
+
+// Count a newly accepted connection as open and return 1, or, if
+// max_conns are open already, answer it with "Busy", close it and
+// return 0. Every connection admitted is counted until conn_release.
+int conn_admit(int fd);
+void conn_release(void);
+// Connections open now, and turned away since the server started
+size_t conn_count(void);
+size_t conn_rejected(void);
+
+// Connections from the same host over AF_UNIX are accounted to their
+// user, whom the kernel tells (SO_PEERCRED): connections open and
+// requests carried out, which STATS reports. PEER_ACCOUNTS users are
+// accounted at most; further ones go unaccounted.
+#define PEER_ACCOUNTS 256
+struct PeerAccount;
+
+struct Conn *conn_create(int fd);
+// Close c's descriptor, free it and release it (conn_release)
+void conn_close(struct Conn *c);
+// Free c, leaving its descriptor open
+void conn_free(struct Conn *c);
+void conn_scratch_init(struct ConnScratch *s, struct Calc *calc);
+void conn_scratch_cleanup(struct ConnScratch *s);
+
+// Evaluate n bytes of input on c, collecting the replies in s->replies;
+// conn_end_input evaluates what is left at the end of input. Every
+// complete line is evaluated before they return, batched with the
+// lines next to it. The lines are framed in data itself (which is
+// why it isn't const), only an unfinished one being copied to c->in.
+void conn_input(struct ConnScratch *s, struct Conn *c, char *data, size_t n);
+void conn_end_input(struct ConnScratch *s, struct Conn *c);
+// Evaluate the complete lines that input read straight into c->in has
+// (or carry out the complete requests, on a binary connection)
+void conn_lines(struct ConnScratch *s, struct Conn *c);
+// Move the replies in s->replies to the end of c->out without writing
+void conn_queue(struct ConnScratch *s, struct Conn *c);
+
+// Send the replies queued in c->out and collected in s->replies with
+// one sendmsg, if the input has run dry (dry), the connection is
+// closing, or OUTBUF_FLUSH bytes of them have piled up; otherwise they
+// wait for more. A write that more replies follow goes out with
+// MSG_MORE, so that the segments stay full. Whatever a non-blocking
+// socket doesn't take is queued in c->out; 0 on error.
+int conn_flush(struct ConnScratch *s, struct Conn *c, int dry);
+
+// Read and evaluate input until the socket runs dry, the connection
+// ends, max_output bytes of replies are queued or CONN_QUANTUM bytes
+// of input have been read, writing the replies as conn_flush does.
+// The quantum keeps a client that pipelines without pause from
+// holding the thread while others wait: their lines are evaluated
+// between its turns.
+enum ConnStatus conn_service(struct ConnScratch *s, struct Conn *c);
+
+// Event-driven server mode (reactor.c): serve every connection from one
+// thread with edge-triggered epoll until shutdown. Returns once the
+// last connection is closed after a shutdown.
+void reactor_run(const struct Listeners *listen, struct Calc *calc);
+
+// Reuseport server mode (reactor.c): n reactors, each on its own
+// SO_REUSEPORT listening socket for port and, if cpus isn't NULL,
+// pinned to cpus[i]. All of them evaluate with calc, and accept from
+// the AF_UNIX listening socket unixfd too unless it is -1.
+void multi_reactor_run(const char *port, int unixfd, struct Calc *calc,
+                       int n, const int *cpus);
+
+// Parse a CPU list like "0-3,8,10" into cpus (at most max of them);
+// returns how many, or -1 if it isn't valid (affinity.c)
+int parse_cpu_list(const char *list, int *cpus, int max);
+// Pin the calling thread to cpu; 0 on success
+int pin_thread(int cpu);
+// The user at the other end of AF_UNIX socket fd (SO_PEERCRED) into
+// *uid; -1 if fd isn't one
+int peer_uid(int fd, uid_t *uid);
+
+// io_uring server mode (uring.c): like reactor_run, but with
+// multishot accept and receive into provided buffers, and sends
+// batched into one io_uring_enter per turn of the loop. Returns -1
+// without touching the listening sockets if io_uring isn't available
+// (not built in, or refused by the kernel), 0 after a shutdown. With
+// stats, it prints how many system calls the requests took.
+int uring_run(const struct Listeners *listen, struct Calc *calc, int stats);
+
+// Thread pool server mode (pool.c): nthreads workers service ready
+// connections from work-stealing deques. Returns like reactor_run.
+void pool_run(const struct Listeners *listen, struct Calc *calc,
+              int nthreads);
+
+// Shared-memory transport (shm.c, calcshm.h): create the region name
+// (-R) and serve its clients with calc on a thread of their own, in
+// any mode; -1 if the region can't be created. shm_wake makes the
+// thread notice a shutdown, and shm_stop waits for it to finish its
+// clients after one and removes the region. Both do nothing without
+// a region.
+int shm_start(const char *name, struct Calc *calc);
+void shm_wake(void);
+void shm_stop(void);
+
+#endif // SERVER_H
@@ -0,0 +1,287 @@
+// Authors:
+// Jack Zhang (jzhan237)
+// Tony Pan (jpan26)
+//
+// The server side of the shared-memory transport (calcServer -R,
+// described in calcshm.h). One thread serves every slot of the region,
+// next to whichever mode serves the sockets. A slot in use is a Conn
+// like any other: what its client writes to the request ring goes
+// through conn_input, so it is evaluated (in batches, with the same
+// Calc) and answered exactly as on a socket, and the replies are
+// copied into the reply ring instead of being sent. Input is copied
+// out of the ring before it is parsed, so a client can't change a line
+// under the parser.
+//
+// Each slot gets a turn of up to CONN_QUANTUM bytes of input per pass
+// over the slots, and a slot whose replies don't fit in its ring stops
+// being read, like a socket connection, until max_output is no longer
+// exceeded. When a whole pass finds nothing to do the thread sleeps on
+// the region's futex, to be woken by a client that writes or reads, or
+// by request_shutdown (shm_wake). After a shutdown no new client can
+// claim a slot, and the thread returns once the open ones are closed.
+#include "csapp.h"
+#include "calc.h"
+#include "server.h"
+#include "calcshm.h"
+#include <sys/mman.h>
+
+struct ShmServer {
+  struct CalcShmRegion *region;
+  char name[NAME_MAX];
+  struct Conn *conns[CALC_SHM_SLOTS];   // NULL for a free slot
+  unsigned reclaim_seen;                // region->reclaim when last done
+  pthread_t thread;
+  struct ConnScratch scratch;
+};
+
+// the server's region, if -R was given
+static struct ShmServer *shm;
+
+// Copy the replies queued in c->out and then those collected in
+// s->replies into the slot's reply ring, queueing in c->out whatever
+// doesn't fit, as conn_send does with a socket; returns the bytes
+// copied
+static size_t shm_send(struct ConnScratch *s, struct CalcShmSlot *slot,
+                       struct Conn *c) {
+  size_t sent = 0, n;
+  if (c->outpos < c->outlen) {
+    n = calc_shm_write(&slot->replies, c->out + c->outpos,
+                       c->outlen - c->outpos);
+    c->outpos += n;
+    sent += n;
+  }
+  if (c->outpos == c->outlen && c->out != NULL) {
+    // drop the buffer, an idle connection shouldn't hold one
+    free(c->out);
+    c->out = NULL;
+    c->outpos = c->outlen = c->outcap = 0;
+  }
+  if (c->out == NULL && s->replies_len > 0) {
+    n = calc_shm_write(&slot->replies, s->replies, s->replies_len);
+    memmove(s->replies, s->replies + n, s->replies_len - n);
+    s->replies_len -= n;
+    sent += n;
+  }
+  if (s->replies_len > 0) conn_queue(s, c);
+  return sent;
+}
+
+// Free slot i for the next client
+static void shm_free_slot(struct ShmServer *m, int i) {
+  struct CalcShmSlot *slot = &m->region->slot[i];
+  conn_free(m->conns[i]);
+  m->conns[i] = NULL;
+  atomic_store(&slot->requests.head, 0);
+  atomic_store(&slot->requests.tail, 0);
+  atomic_store(&slot->replies.head, 0);
+  atomic_store(&slot->replies.tail, 0);
+  atomic_store(&slot->hung_up, 0);
+  atomic_store(&slot->client_waiting, 0);
+  atomic_store(&slot->pid, 0);
+  atomic_store_explicit(&slot->state, CALC_SHM_FREE, memory_order_release);
+}
+
+// Whether the indices of both of slot's rings are sound
+static int shm_rings_ok(struct CalcShmSlot *slot) {
+  return calc_shm_ring_ok(&slot->requests) && calc_shm_ring_ok(&slot->replies);
+}
+
+// Drop the connection of a slot whose client broke its rings, as a
+// socket's would be on a reset: its input and queued replies are
+// dropped and the client is hung up on. The slot itself stays its
+// client's until closed, so that nobody else is handed rings the
+// client may still be writing.
+static void shm_break(struct CalcShmSlot *slot, struct Conn *c) {
+  free(c->out);
+  c->out = NULL;
+  c->outpos = c->outlen = c->outcap = 0;
+  c->closing = 1;
+  atomic_store(&slot->hung_up, 1);
+  calc_shm_ring_bell(&slot->client_waiting, &slot->client_bell);
+}
+
+// Close the slots of clients that exited without closing them; a
+// client asks for this when it finds no free slot
+static void shm_reclaim(struct ShmServer *m) {
+  for (int i = 0; i < CALC_SHM_SLOTS; i++) {
+    struct CalcShmSlot *slot = &m->region->slot[i];
+    unsigned open = CALC_SHM_OPEN;
+    int pid = atomic_load(&slot->pid);
+    if (pid > 0 && kill(pid, 0) < 0 && errno == ESRCH) {
+      atomic_compare_exchange_strong(&slot->state, &open, CALC_SHM_CLOSED);
+    }
+  }
+}
+
+// Whether slot i has something for shm_turn to do
+static int shm_has_work(struct ShmServer *m, int i) {
+  struct CalcShmSlot *slot = &m->region->slot[i];
+  struct Conn *c = m->conns[i];
+  unsigned state = atomic_load_explicit(&slot->state, memory_order_acquire);
+  if (c == NULL) return state != CALC_SHM_FREE;
+  if (state == CALC_SHM_CLOSED) return 1;
+  if (!shm_rings_ok(slot)) return !atomic_load(&slot->hung_up);
+  if (c->out != NULL && calc_shm_writable(&slot->replies) > 0) return 1;
+  if (c->closing) return c->out == NULL && !atomic_load(&slot->hung_up);
+  return c->outlen - c->outpos < max_output &&
+         calc_shm_readable(&slot->requests) > 0;
+}
+
+// Give slot i a turn; returns whether anything was done
+static int shm_turn(struct ShmServer *m, int i) {
+  struct CalcShmSlot *slot = &m->region->slot[i];
+  struct ConnScratch *s = &m->scratch;
+  unsigned state = atomic_load_explicit(&slot->state, memory_order_acquire);
+  struct Conn *c = m->conns[i];
+  int progress = 0;
+  if (state == CALC_SHM_FREE) return 0;
+  if (c == NULL) {
+    c = m->conns[i] = conn_create(-1);
+    progress = 1;
+  }
+  if (state == CALC_SHM_CLOSED) {
+    // its client is gone, having written all it will: carry that out
+    // (and drop whatever follows a quit) a quantum per turn, as a
+    // socket's server would after the client closed, but with nobody
+    // left to read the replies. The slot is freed once its ring is empty.
+    size_t quantum = CONN_QUANTUM;
+    while (quantum > 0) {
+      size_t n = calc_shm_read(&slot->requests, s->readbuf,
+                               quantum < READBUF_SIZE ? quantum : READBUF_SIZE);
+      if (n == 0) {
+        if (!c->closing) conn_end_input(s, c);
+        s->replies_len = 0;
+        shm_free_slot(m, i);
+        return 1;
+      }
+      quantum -= n;
+      if (!c->closing) conn_input(s, c, s->readbuf, n);
+      s->replies_len = 0;
+    }
+    return 1;
+  }
+
+  if (!shm_rings_ok(slot)) {
+    if (atomic_load(&slot->hung_up)) return progress;
+    shm_break(slot, c);
+    return 1;
+  }
+
+  size_t quantum = CONN_QUANTUM; // input left to read this turn
+  progress |= shm_send(s, slot, c) > 0;
+  while (quantum > 0 && !c->closing && c->outlen - c->outpos < max_output) {
+    size_t n = calc_shm_read(&slot->requests, s->readbuf,
+                             quantum < READBUF_SIZE ? quantum : READBUF_SIZE);
+    if (n == 0) break;
+    quantum -= n;
+    conn_input(s, c, s->readbuf, n);
+    shm_send(s, slot, c);
+    progress = 1;
+  }
+  if (c->closing && c->out == NULL && !atomic_load(&slot->hung_up)) {
+    // quit or shutdown, and every reply is in the ring: the client
+    // reads the end of input after them
+    atomic_store(&slot->hung_up, 1);
+    progress = 1;
+  }
+  if (progress) {
+    calc_shm_ring_bell(&slot->client_waiting, &slot->client_bell);
+  }
+  return progress;
+}
+
+// Whether the thread has anything to do before it may sleep
+static int shm_has_any_work(struct ShmServer *m) {
+  if (shut_down && !atomic_load(&m->region->closed)) return 1;
+  if (atomic_load(&m->region->reclaim) != m->reclaim_seen) return 1;
+  for (int i = 0; i < CALC_SHM_SLOTS; i++) {
+    if (shm_has_work(m, i)) return 1;
+  }
+  return 0;
+}
+
+static void *shm_loop(void *arg) {
+  struct ShmServer *m = arg;
+  struct CalcShmRegion *region = m->region;
+  for (;;) {
+    int busy = 0, open = 0;
+    if (shut_down && !atomic_load(&region->closed)) {
+      atomic_store(&region->closed, 1);
+    }
+    unsigned reclaim = atomic_load(&region->reclaim);
+    if (reclaim != m->reclaim_seen) {
+      m->reclaim_seen = reclaim;
+      shm_reclaim(m);
+    }
+    for (int i = 0; i < CALC_SHM_SLOTS; i++) {
+      if (shm_has_work(m, i)) busy |= shm_turn(m, i);
+      open += m->conns[i] != NULL;
+    }
+    if (shut_down && open == 0) break;
+    if (busy) continue;
+
+    // idle: sleep until a client (or request_shutdown) rings
+    unsigned seen = atomic_load(&region->server_bell);
+    atomic_store(&region->server_waiting, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!shm_has_any_work(m)) calc_shm_wait(&region->server_bell, seen);
+    atomic_store(&region->server_waiting, 0);
+  }
+  return NULL;
+}
+
+int shm_start(const char *name, struct Calc *calc) {
+  struct ShmServer *m = Calloc(1, sizeof(struct ShmServer));
+  snprintf(m->name, sizeof(m->name), "%s%s", name[0] == '/' ? "" : "/", name);
+  // a server that didn't exit cleanly leaves its region behind
+  shm_unlink(m->name);
+  int fd = shm_open(m->name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) {
+    free(m);
+    return -1;
+  }
+  if (ftruncate(fd, sizeof(struct CalcShmRegion)) < 0 ||
+      (m->region = mmap(NULL, sizeof(struct CalcShmRegion),
+                        PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) ==
+      MAP_FAILED) {
+    close(fd);
+    shm_unlink(m->name);
+    free(m);
+    return -1;
+  }
+  close(fd);
+  // the object starts out zeroed: every slot is free and every ring empty
+  m->region->magic = CALC_SHM_MAGIC;
+  m->region->version = CALC_SHM_VERSION;
+  m->region->slots = CALC_SHM_SLOTS;
+  m->region->ring_size = CALC_SHM_RING;
+  conn_scratch_init(&m->scratch, calc);
+  shm = m;
+  if (pthread_create(&m->thread, NULL, shm_loop, m) != 0) {
+    shm = NULL;
+    conn_scratch_cleanup(&m->scratch);
+    munmap(m->region, sizeof(struct CalcShmRegion));
+    shm_unlink(m->name);
+    free(m);
+    return -1;
+  }
+  return 0;
+}
+
+void shm_wake(void) {
+  if (shm != NULL) {
+    calc_shm_ring_bell(&shm->region->server_waiting,
+                       &shm->region->server_bell);
+  }
+}
+
+void shm_stop(void) {
+  struct ShmServer *m = shm;
+  if (m == NULL) return;
+  pthread_join(m->thread, NULL);
+  shm = NULL;
+  conn_scratch_cleanup(&m->scratch);
+  munmap(m->region, sizeof(struct CalcShmRegion));
+  shm_unlink(m->name);
+  free(m);
+}
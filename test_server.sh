@@ -1,16 +1,17 @@
 #! /bin/bash
 
-if [ $# -ne 3 ]; then
-	echo "Usage: test_server.sh <port> <input file> <output file>"
+if [ $# -ne 3 -a $# -ne 4 ]; then
+	echo "Usage: test_server.sh <port> <input file> <output file> [server mode]"
 	exit 1
 fi
 
 port="$1"
 input_file="$2"
 output_file="$3"
+mode="${4:-threads}"
 
 # Start server process
-./calcServer $port &
+./calcServer -m $mode $port &
 CALC_PID=$!
 
 # Send input to server, capture its output
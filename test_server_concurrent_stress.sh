@@ -17,22 +17,37 @@ check_client_output() {
 	return 0
 }
 
-if [ "$#" -ne 1 ]; then
-	echo "usage: ./test_server_concurrent_stress.sh <port>"
+if [ "$#" -lt 1 -o "$#" -gt 2 ]; then
+	echo "usage: ./test_server_concurrent_stress.sh <port> [socket path]"
 	exit 1
 fi
 
 port="$1"
+path="$2"
+
+# Connect standard input and output to the server: over TCP, or over
+# its AF_UNIX socket if a path was given
+client() {
+	if [ -n "$path" ]; then
+		nc -U "$path"
+	else
+		nc localhost $port
+	fi
+}
 
 # Start server process
-./calcServer $port &
+if [ -n "$path" ]; then
+	./calcServer -u "$path" $port &
+else
+	./calcServer $port &
+fi
 CALC_PID=$!
 
 # Give the server a moment or two to start up...
 sleep 2
 
 # Make sure that server correctly reports errors
-( (echo "x + 3"; echo "quit") | nc localhost $port) > err.txt
+( (echo "x + 3"; echo "quit") | client) > err.txt
 if [ "$(grep -i error err.txt | wc -l)" = "0" ]; then
 	echo "Server does not correctly report errors!"
 	kill -9 $CALC_PID
@@ -40,17 +55,18 @@ if [ "$(grep -i error err.txt | wc -l)" = "0" ]; then
 fi
 
 # Create and initialize the shared variable
-( (echo "k = 0"; echo "quit") | nc localhost $port ) > /dev/null
+( (echo "k = 0"; echo "quit") | client ) > /dev/null
 sleep 1
 
 # Start clients
 NUM_INCR=200000
-( ( (perl -e 'for $v (1..'$NUM_INCR') { print "k = k + 1\n" }'; echo "quit") | nc localhost $port) > client1.out )&
+START=$(date +%s%N)
+( ( (perl -e 'for $v (1..'$NUM_INCR') { print "k = k + 1\n" }'; echo "quit") | client) > client1.out )&
 CLIENT_PID1=$!
-( ( (perl -e 'for $v (1..'$NUM_INCR') { print "k = k + 1\n" }'; echo "quit") | nc localhost $port) > client2.out )&
+( ( (perl -e 'for $v (1..'$NUM_INCR') { print "k = k + 1\n" }'; echo "quit") | client) > client2.out )&
 CLIENT_PID2=$!
 # Client 3 creates new variables in a tight loop
-( ( (perl -e 'sub r { chr(97+int(rand(26))) }; for $v (1..'$NUM_INCR') { print r().r().r()," = ",int(rand(1000)),"\n" }'; echo "quit") | nc localhost $port) > client3.out )&
+( ( (perl -e 'sub r { chr(97+int(rand(26))) }; for $v (1..'$NUM_INCR') { print r().r().r()," = ",int(rand(1000)),"\n" }'; echo "quit") | client) > client3.out )&
 CLIENT_PID3=$!
 
 good=true
@@ -68,6 +84,7 @@ wait $CLIENT_PID3
 echo "Client 3 finished"
 check_client_output client3.out $NUM_INCR
 check3=$?
+echo "Clients took $((($(date +%s%N) - START) / 1000000)) ms"
 
 # Make sure server is still running
 kill -0 $CALC_PID
@@ -85,7 +102,7 @@ else
 fi
 
 # Get final count, save to final_count.txt
-( (echo "k"; echo "quit") | nc localhost $port) > final_count.txt
+( (echo "k"; echo "quit") | client) > final_count.txt
 final_count=$(cat final_count.txt)
 echo "Final count was: $final_count"
 if [ "$final_count" = "$(expr $NUM_INCR \* 2)" ]; then
@@ -99,3 +116,6 @@ fi
 # Shut down server
 sleep 1
 kill -9 $CALC_PID
+if [ -n "$path" ]; then
+	rm -f "$path"
+fi
@@ -0,0 +1,646 @@
+// Authors:
+// Jack Zhang (jzhan237)
+// Tony Pan (jpan26)
+//
+// io_uring server mode: one thread, like the epoll reactor, but the
+// socket I/O itself goes through an io_uring. Each listening socket has
+// a multishot accept and every connection a multishot receive, which
+// keep producing completions without being resubmitted; received data
+// lands in buffers the kernel picks from a provided buffer ring. Replies
+// are collected per connection and sent with one send per connection
+// per turn of the loop, and each turn submits everything and waits for
+// completions in a single io_uring_enter. Under pipelined load this
+// takes far fewer system calls than a read and a write per request.
+//
+// Received buffers aren't evaluated as their completions are reaped,
+// but queued on their connection, which then gets turns of up to
+// CONN_QUANTUM bytes of input. After each batch of completions, the
+// connections that had nothing queued get a turn first, then the one
+// whose leftover input has waited longest gets one, as in the epoll
+// reactor: a client pipelining without pause can't make the others
+// wait for all of its input.
+//
+// Written against the kernel interface in <linux/io_uring.h> rather
+// than liburing; the Makefile builds it in when that header has
+// multishot receive (HAVE_IO_URING).
+#include "csapp.h"
+#include "calc.h"
+#include "server.h"
+
+#ifdef HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* submission queue entries (the completion queue gets twice as many) */
+#define RING_ENTRIES 1024
+/* receive buffers in the provided buffer ring (a power of two) */
+#define BUF_COUNT 1024
+#define BUF_SIZE 4096
+#define BUF_GROUP 0
+/* stop receiving on a connection while this much input waits its turn */
+#define QUEUED_LIMIT (4 * CONN_QUANTUM)
+
+// What a completion is for: kept in the low bits of its user_data,
+// the rest being the UringConn (or the UringListener; nothing for
+// OP_SHUTDOWN, the poll on shutdown_event)
+enum UringOp { OP_ACCEPT, OP_RECV, OP_SEND, OP_CANCEL, OP_POLL, OP_SHUTDOWN };
+#define OP_MASK 7
+
+// A listening socket and the operations it has in flight (aligned
+// like a pointer, to leave room for the UringOp in user_data)
+struct UringListener {
+  int fd;
+  int accepting;        // multishot accept armed
+  int polling;          // out of descriptors: waiting for a client instead
+} __attribute__((aligned(8)));
+
+// A connection and the operations it has in flight
+struct UringConn {
+  struct Conn *c;
+  char *sendbuf;        // replies being sent (taken from c->out)
+  size_t sendpos, sendlen;
+  int inflight;         // operations whose last completion hasn't come
+  int receiving;        // multishot receive armed
+  int sending;
+  int cancelling;       // receive being cancelled
+  int failed;           // socket error: drop output and close
+  int dirty;            // on the dirty list
+  struct UringConn *next_dirty;
+  // input received and not evaluated yet: buffer ids, linked through
+  // Uring.queued_next, with the end of input after them if eof
+  int queued_head, queued_tail;  // -1 if none
+  size_t queued;        // bytes
+  int eof;
+  int backlogged;       // on the fresh list or the backlog
+  struct UringConn *next_backlog;
+};
+
+struct Uring {
+  int fd;
+  // submission queue
+  unsigned *sq_head, *sq_tail, *sq_array, sq_mask, sq_entries;
+  unsigned sq_local_tail, sq_submitted;
+  struct io_uring_sqe *sqes;
+  // completion queue
+  unsigned *cq_head, *cq_tail, cq_mask;
+  struct io_uring_cqe *cqes;
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_size, cq_ring_size, sqes_size;
+  // provided receive buffers
+  struct io_uring_buf_ring *buf_ring;
+  char *bufs;
+  unsigned short buf_tail;
+
+  struct UringListener listeners[MAX_LISTENERS];
+  int nlisteners;
+  int listening;
+  int reserve_fd;
+  int nconns;
+  struct UringConn *dirty;  // connections to settle after this batch
+  // connections with input queued: newly, and left over from a turn
+  struct UringConn *fresh_head, *fresh_tail;
+  struct UringConn *backlog_head, *backlog_tail;
+  int queued_next[BUF_COUNT];   // next queued buffer of the same connection
+  int queued_len[BUF_COUNT];
+  struct ConnScratch scratch;
+  long enters, replies;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(
+  int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                 NULL, 0);
+}
+
+static int sys_io_uring_register(
+  int fd, unsigned opcode, void *arg, unsigned nr_args) {
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// Set up the rings and the receive buffers; 0 on success
+static int ring_init(struct Uring *r) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  // completions are only reaped by this thread, inside io_uring_enter
+  p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+  r->fd = sys_io_uring_setup(RING_ENTRIES, &p);
+  if (r->fd < 0) {
+    memset(&p, 0, sizeof(p));
+    r->fd = sys_io_uring_setup(RING_ENTRIES, &p);
+    if (r->fd < 0) return -1;
+  }
+  if (!(p.features & IORING_FEAT_NODROP)) {
+    close(r->fd);
+    return -1;
+  }
+
+  r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (r->cq_ring_size > r->sq_ring_size) r->sq_ring_size = r->cq_ring_size;
+    r->cq_ring_size = 0;
+  }
+  r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (r->sq_ring == MAP_FAILED) {
+    close(r->fd);
+    return -1;
+  }
+  r->cq_ring = r->sq_ring;
+  if (r->cq_ring_size > 0) {
+    r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if (r->cq_ring == MAP_FAILED) {
+      munmap(r->sq_ring, r->sq_ring_size);
+      close(r->fd);
+      return -1;
+    }
+  }
+  r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED) {
+    if (r->cq_ring_size > 0) munmap(r->cq_ring, r->cq_ring_size);
+    munmap(r->sq_ring, r->sq_ring_size);
+    close(r->fd);
+    return -1;
+  }
+
+  char *sq = r->sq_ring, *cq = r->cq_ring;
+  r->sq_head = (unsigned *) (sq + p.sq_off.head);
+  r->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+  r->sq_array = (unsigned *) (sq + p.sq_off.array);
+  r->sq_mask = *(unsigned *) (sq + p.sq_off.ring_mask);
+  r->sq_entries = p.sq_entries;
+  r->sq_local_tail = r->sq_submitted = *r->sq_tail;
+  r->cq_head = (unsigned *) (cq + p.cq_off.head);
+  r->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+  r->cq_mask = *(unsigned *) (cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+  // the buffer ring must be page aligned, so it gets its own mapping
+  r->buf_ring = mmap(NULL, BUF_COUNT * sizeof(struct io_uring_buf),
+                     PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                     -1, 0);
+  r->bufs = Malloc((size_t) BUF_COUNT * BUF_SIZE);
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (unsigned long) r->buf_ring;
+  reg.ring_entries = BUF_COUNT;
+  reg.bgid = BUF_GROUP;
+  if (r->buf_ring == MAP_FAILED ||
+      sys_io_uring_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    // kernel too old for provided buffer rings
+    if (r->buf_ring != MAP_FAILED) {
+      munmap(r->buf_ring, BUF_COUNT * sizeof(struct io_uring_buf));
+    }
+    free(r->bufs);
+    munmap(r->sqes, r->sqes_size);
+    if (r->cq_ring_size > 0) munmap(r->cq_ring, r->cq_ring_size);
+    munmap(r->sq_ring, r->sq_ring_size);
+    close(r->fd);
+    return -1;
+  }
+  for (int i = 0; i < BUF_COUNT; i++) {
+    struct io_uring_buf *b = &r->buf_ring->bufs[i];
+    b->addr = (unsigned long) (r->bufs + (size_t) i * BUF_SIZE);
+    b->len = BUF_SIZE;
+    b->bid = i;
+  }
+  r->buf_tail = BUF_COUNT;
+  __atomic_store_n(&r->buf_ring->tail, r->buf_tail, __ATOMIC_RELEASE);
+  return 0;
+}
+
+static void ring_cleanup(struct Uring *r) {
+  munmap(r->buf_ring, BUF_COUNT * sizeof(struct io_uring_buf));
+  free(r->bufs);
+  munmap(r->sqes, r->sqes_size);
+  if (r->cq_ring_size > 0) munmap(r->cq_ring, r->cq_ring_size);
+  munmap(r->sq_ring, r->sq_ring_size);
+  close(r->fd);
+}
+
+// Submit the queued entries and wait for at least wait completions
+static void ring_enter(struct Uring *r, unsigned wait) {
+  __atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+  unsigned to_submit = r->sq_local_tail - r->sq_submitted;
+  // even without waiting: with DEFER_TASKRUN, completions are only
+  // posted while we are in io_uring_enter with GETEVENTS
+  unsigned flags = IORING_ENTER_GETEVENTS;
+  for (;;) {
+    r->enters++;
+    int n = sys_io_uring_enter(r->fd, to_submit, wait, flags);
+    if (n >= 0) {
+      r->sq_submitted += n;
+      return;
+    }
+    if (errno == EINTR) {
+      if (wait > 0) return; // let the caller look at the flags again
+      continue;
+    }
+    if (errno == EBUSY || errno == EAGAIN) {
+      // completions have piled up: reap those first
+      return;
+    }
+    unix_error("io_uring_enter error");
+  }
+}
+
+// Next free submission queue entry, zeroed
+static struct io_uring_sqe *get_sqe(struct Uring *r, void *ptr,
+                                    enum UringOp op) {
+  while (r->sq_local_tail -
+         __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+    ring_enter(r, 0);
+  }
+  unsigned index = r->sq_local_tail & r->sq_mask;
+  struct io_uring_sqe *sqe = &r->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->user_data = (unsigned long) ptr | op;
+  r->sq_array[index] = index;
+  r->sq_local_tail++;
+  return sqe;
+}
+
+static void arm_accept(struct Uring *r, struct UringListener *l) {
+  struct io_uring_sqe *sqe = get_sqe(r, l, OP_ACCEPT);
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = l->fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  l->accepting = 1;
+}
+
+static void arm_poll(struct Uring *r, struct UringListener *l) {
+  struct io_uring_sqe *sqe = get_sqe(r, l, OP_POLL);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = l->fd;
+  sqe->poll32_events = POLLIN;
+  l->polling = 1;
+}
+
+static void arm_recv(struct Uring *r, struct UringConn *u) {
+  struct io_uring_sqe *sqe = get_sqe(r, u, OP_RECV);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = u->c->fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = BUF_GROUP;
+  u->receiving = 1;
+  u->inflight++;
+}
+
+static void arm_send(struct Uring *r, struct UringConn *u) {
+  struct io_uring_sqe *sqe = get_sqe(r, u, OP_SEND);
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = u->c->fd;
+  sqe->addr = (unsigned long) (u->sendbuf + u->sendpos);
+  sqe->len = u->sendlen - u->sendpos;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  u->sending = 1;
+  u->inflight++;
+}
+
+static void cancel(struct Uring *r, void *ptr, enum UringOp op) {
+  struct io_uring_sqe *sqe = get_sqe(r, ptr, OP_CANCEL);
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = (unsigned long) ptr | op;
+}
+
+static void mark_dirty(struct Uring *r, struct UringConn *u) {
+  if (!u->dirty) {
+    u->dirty = 1;
+    u->next_dirty = r->dirty;
+    r->dirty = u;
+  }
+}
+
+// Give a receive buffer back to the kernel
+static void recycle_buf(struct Uring *r, unsigned bid) {
+  struct io_uring_buf *b =
+    &r->buf_ring->bufs[r->buf_tail & (BUF_COUNT - 1)];
+  b->addr = (unsigned long) (r->bufs + (size_t) bid * BUF_SIZE);
+  b->len = BUF_SIZE;
+  b->bid = bid;
+  r->buf_tail++;
+}
+
+static void add_conn(struct Uring *r, int fd) {
+  if (!r->listening) {
+    close(fd);
+    return;
+  }
+  if (!conn_admit(fd)) return;
+  struct UringConn *u = Calloc(1, sizeof(struct UringConn));
+  u->c = conn_create(fd);
+  u->queued_head = u->queued_tail = -1;
+  set_nodelay(fd);
+  r->nconns++;
+  mark_dirty(r, u);   // settling it arms the receive
+}
+
+static void on_accept(struct Uring *r, struct UringListener *l,
+                      struct io_uring_cqe *cqe) {
+  if (!(cqe->flags & IORING_CQE_F_MORE)) l->accepting = 0;
+  if (cqe->res >= 0) {
+    add_conn(r, cqe->res);
+  } else if (cqe->res == -EMFILE || cqe->res == -ENFILE) {
+    // io_uring reports this even with no client waiting, so rather
+    // than re-arm at once, wait for one (accept errors end the
+    // multishot accept anyway)
+    if (r->listening && !l->accepting) arm_poll(r, l);
+    return;
+  }
+  if (!l->accepting && r->listening) arm_accept(r, l);
+}
+
+// A client is waiting while we may be out of descriptors: accept it
+// here, or turn it away with the spare descriptor, then go back to
+// the multishot accept
+static void on_poll(struct Uring *r, struct UringListener *l) {
+  l->polling = 0;
+  if (!r->listening) return;
+  int flags = fcntl(l->fd, F_GETFL, 0);
+  fcntl(l->fd, F_SETFL, flags | O_NONBLOCK);
+  int fd = accept(l->fd, NULL, NULL);
+  if (fd >= 0) {
+    add_conn(r, fd);
+  } else if ((errno == EMFILE || errno == ENFILE) && r->reserve_fd >= 0) {
+    close(r->reserve_fd);
+    fd = accept(l->fd, NULL, NULL);
+    if (fd >= 0) close(fd);
+    r->reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  }
+  fcntl(l->fd, F_SETFL, flags);
+  arm_accept(r, l);
+}
+
+// Append u to the list with the head and tail at *head and *tail
+static void push_turn(struct UringConn **head, struct UringConn **tail,
+                      struct UringConn *u) {
+  u->backlogged = 1;
+  u->next_backlog = NULL;
+  if (*tail != NULL) (*tail)->next_backlog = u;
+  else *head = u;
+  *tail = u;
+}
+
+static struct UringConn *pop_turn(struct UringConn **head,
+                                  struct UringConn **tail) {
+  struct UringConn *u = *head;
+  *head = u->next_backlog;
+  if (*head == NULL) *tail = NULL;
+  u->backlogged = 0;
+  return u;
+}
+
+// Queue input for u's next turn: the buffer bid holding len bytes, or
+// the end of input if bid < 0
+static void queue_input(struct Uring *r, struct UringConn *u, int bid,
+                        int len) {
+  if (bid < 0) {
+    u->eof = 1;
+  } else {
+    r->queued_next[bid] = -1;
+    r->queued_len[bid] = len;
+    if (u->queued_tail >= 0) r->queued_next[u->queued_tail] = bid;
+    else u->queued_head = bid;
+    u->queued_tail = bid;
+    u->queued += len;
+  }
+  if (!u->backlogged) push_turn(&r->fresh_head, &r->fresh_tail, u);
+}
+
+static void on_recv(struct Uring *r, struct UringConn *u,
+                    struct io_uring_cqe *cqe) {
+  if (cqe->flags & IORING_CQE_F_BUFFER) {
+    unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    if (cqe->res > 0 && !u->failed) {
+      queue_input(r, u, bid, cqe->res);
+    } else {
+      recycle_buf(r, bid);
+    }
+  } else if (cqe->res == 0 && !u->failed) {
+    queue_input(r, u, -1, 0);
+  } else if (cqe->res < 0 && cqe->res != -ENOBUFS &&
+             cqe->res != -ECANCELED) {
+    u->failed = 1;
+  }
+  if (!(cqe->flags & IORING_CQE_F_MORE)) {
+    // out of buffers, cancelled, or the end of input: settling it
+    // re-arms the receive if the connection is still reading
+    u->receiving = 0;
+    u->cancelling = 0;
+    u->inflight--;
+  }
+  mark_dirty(r, u);
+}
+
+// Evaluate up to CONN_QUANTUM bytes of u's queued input (all of what is
+// left if it is closing or has failed, which just drops it), queueing
+// the replies; returns whether input is left for another turn
+static int run_turn(struct Uring *r, struct UringConn *u) {
+  struct Conn *c = u->c;
+  size_t quantum = CONN_QUANTUM;
+  while (u->queued_head >= 0 && (quantum > 0 || c->closing || u->failed)) {
+    int bid = u->queued_head;
+    int len = r->queued_len[bid];
+    u->queued_head = r->queued_next[bid];
+    if (u->queued_head < 0) u->queued_tail = -1;
+    u->queued -= len;
+    if (!c->closing && !u->failed) {
+      conn_input(&r->scratch, c, r->bufs + (size_t) bid * BUF_SIZE, len);
+      quantum -= (size_t) len < quantum ? (size_t) len : quantum;
+    }
+    recycle_buf(r, bid);
+  }
+  if (u->queued_head < 0 && u->eof) {
+    u->eof = 0;
+    if (!c->closing && !u->failed) conn_end_input(&r->scratch, c);
+  }
+  if (r->scratch.replies_len > 0) {
+    const char *p = r->scratch.replies, *end = p + r->scratch.replies_len;
+    while ((p = memchr(p, '\n', end - p)) != NULL) {
+      r->replies++;
+      p++;
+    }
+    conn_queue(&r->scratch, c);
+  }
+  mark_dirty(r, u);
+  return u->queued_head >= 0 || u->eof;
+}
+
+// Give a turn to every connection with new input, then to the one on
+// the backlog that has waited longest
+static void run_turns(struct Uring *r) {
+  while (r->fresh_head != NULL) {
+    struct UringConn *u = pop_turn(&r->fresh_head, &r->fresh_tail);
+    if (run_turn(r, u)) push_turn(&r->backlog_head, &r->backlog_tail, u);
+  }
+  if (r->backlog_head != NULL) {
+    struct UringConn *u = pop_turn(&r->backlog_head, &r->backlog_tail);
+    if (run_turn(r, u)) push_turn(&r->backlog_head, &r->backlog_tail, u);
+  }
+  __atomic_store_n(&r->buf_ring->tail, r->buf_tail, __ATOMIC_RELEASE);
+}
+
+static void on_send(struct Uring *r, struct UringConn *u,
+                    struct io_uring_cqe *cqe) {
+  u->sending = 0;
+  u->inflight--;
+  if (cqe->res < 0) {
+    u->failed = 1;
+  } else {
+    u->sendpos += cqe->res;
+    if (u->sendpos == u->sendlen) {
+      free(u->sendbuf);
+      u->sendbuf = NULL;
+    }
+  }
+  mark_dirty(r, u);
+}
+
+// Bring a connection's operations in line with its state after a
+// batch of completions: send what is queued, receive while it reads
+// on, and close it once it is done and nothing is in flight
+static void settle(struct Uring *r, struct UringConn *u) {
+  struct Conn *c = u->c;
+  if (!u->failed && !u->sending) {
+    if (u->sendbuf == NULL && c->out != NULL) {
+      // everything queued since the last send goes in one
+      u->sendbuf = c->out;
+      u->sendlen = c->outlen;
+      u->sendpos = 0;
+      c->out = NULL;
+      c->outpos = c->outlen = c->outcap = 0;
+    }
+    if (u->sendbuf != NULL) arm_send(r, u);
+  }
+  size_t queued = c->outlen + (u->sendbuf ? u->sendlen - u->sendpos : 0);
+  int reading = !u->failed && !c->closing && queued < max_output &&
+                u->queued < QUEUED_LIMIT;
+  if (reading && !u->receiving) {
+    arm_recv(r, u);
+  } else if (!reading && u->receiving && !u->cancelling) {
+    cancel(r, u, OP_RECV);
+    u->cancelling = 1;
+  }
+  int done = u->failed || (c->closing && u->sendbuf == NULL && c->out == NULL);
+  if (done && u->inflight == 0 && !u->backlogged) {
+    free(u->sendbuf);
+    conn_close(c);
+    free(u);
+    r->nconns--;
+  }
+}
+
+// Handle every completion that is ready
+static void reap(struct Uring *r) {
+  unsigned head = *r->cq_head;
+  unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++) {
+    struct io_uring_cqe *cqe = &r->cqes[head & r->cq_mask];
+    void *ptr = (void *) (unsigned long) (cqe->user_data & ~(__u64) OP_MASK);
+    switch ((enum UringOp) (cqe->user_data & OP_MASK)) {
+    case OP_ACCEPT:
+      on_accept(r, ptr, cqe);
+      break;
+    case OP_RECV:
+      on_recv(r, ptr, cqe);
+      break;
+    case OP_SEND:
+      on_send(r, ptr, cqe);
+      break;
+    case OP_POLL:
+      on_poll(r, ptr);
+      break;
+    case OP_CANCEL:
+    case OP_SHUTDOWN:   // the loop checks shut_down after every batch
+      break;
+    }
+  }
+  __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+  __atomic_store_n(&r->buf_ring->tail, r->buf_tail, __ATOMIC_RELEASE);
+}
+
+// Whether a listening socket still has an operation in flight
+static int listeners_busy(struct Uring *r) {
+  for (int i = 0; i < r->nlisteners; i++) {
+    if (r->listeners[i].accepting || r->listeners[i].polling) return 1;
+  }
+  return 0;
+}
+
+int uring_run(const struct Listeners *listen, struct Calc *calc, int stats) {
+  struct Uring *r = Calloc(1, sizeof(struct Uring));
+  if (ring_init(r) < 0) {
+    free(r);
+    return -1;
+  }
+  r->listening = 1;
+  r->reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  conn_scratch_init(&r->scratch, calc);
+  r->nlisteners = listen->n;
+  for (int i = 0; i < listen->n; i++) {
+    r->listeners[i].fd = listen->fds[i];
+    arm_accept(r, &r->listeners[i]);
+  }
+  // a shutdown requested outside the loop (by a shared-memory client)
+  // has to end its wait for completions
+  struct io_uring_sqe *sqe = get_sqe(r, NULL, OP_SHUTDOWN);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = shutdown_event;
+  sqe->poll32_events = POLLIN;
+
+  while (r->listening || listeners_busy(r) || r->nconns > 0) {
+    // with input waiting for its turn, only look for completions
+    ring_enter(r, r->backlog_head != NULL ? 0 : 1);
+    reap(r);
+    run_turns(r);
+    while (r->dirty != NULL) {
+      struct UringConn *u = r->dirty;
+      r->dirty = u->next_dirty;
+      u->dirty = 0;
+      settle(r, u);
+    }
+    if (shut_down && r->listening) {
+      // stop accepting; the connections already open finish normally
+      r->listening = 0;
+      for (int i = 0; i < r->nlisteners; i++) {
+        struct UringListener *l = &r->listeners[i];
+        if (l->accepting) cancel(r, l, OP_ACCEPT);
+        if (l->polling) cancel(r, l, OP_POLL);
+      }
+    }
+  }
+
+  if (stats) {
+    fprintf(stderr, "io_uring: %ld replies, %ld io_uring_enter calls "
+            "(%.3f per reply)\n", r->replies, r->enters,
+            r->replies ? (double) r->enters / r->replies : 0.0);
+  }
+  if (r->reserve_fd >= 0) close(r->reserve_fd);
+  conn_scratch_cleanup(&r->scratch);
+  ring_cleanup(r);
+  free(r);
+  return 0;
+}
+
+#else // !HAVE_IO_URING
+
+int uring_run(const struct Listeners *listen, struct Calc *calc, int stats) {
+  (void) listen;
+  (void) calc;
+  (void) stats;
+  return -1;
+}
+
+#endif